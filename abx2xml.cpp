@@ -34,18 +34,28 @@ original licensing terms.
 
 
 
+// Building with -DABX_MINIMAL_STARTUP leaves out iostreams and --profile, so
+// the binary has no iostream or locale initialization and a conversion is
+// only read(2), decode, format and write(2).
+#ifndef ABX_MINIMAL_STARTUP
 #include <iostream>
-#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <chrono>
+#endif
 #include <vector>
 #include <string>
 #include <memory>
 #include <stdexcept>
 #include <cstdint>
-#include <iomanip>
-#include <sstream>
 #include <unordered_map>
 #include <algorithm>
 #include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 std::string base64_encode(const unsigned char* data, size_t len) {
     static const char base64_chars[] =
@@ -112,69 +122,217 @@ public:
 };
 
 
+#ifndef ABX_MINIMAL_STARTUP
+// Wall-clock time spent in each phase of a conversion, for --profile.
+// begin() closes the running phase; a phase entered again accumulates.
+class PhaseProfile {
+public:
+    void begin(const std::string& phase) {
+        end();
+        current = phase;
+        started = std::chrono::steady_clock::now();
+    }
+
+    void end() {
+        if (current.empty())
+            return;
+        add(current, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count());
+        current.clear();
+    }
+
+    void add(const std::string& phase, double ms) {
+        for (auto& entry : phases) {
+            if (entry.first == phase) {
+                entry.second += ms;
+                return;
+            }
+        }
+        phases.emplace_back(phase, ms);
+    }
+
+    void report(std::ostream& out, bool json) {
+        end();
+        double total = 0;
+        for (const auto& entry : phases)
+            total += entry.second;
+        std::ostringstream text;
+        text << std::fixed << std::setprecision(3);
+        if (json) {
+            text << "{\"unit\":\"ms\",\"phases\":[";
+            for (size_t i = 0; i < phases.size(); ++i)
+                text << (i ? "," : "") << "{\"name\":\"" << phases[i].first << "\",\"ms\":" << phases[i].second << "}";
+            text << "],\"total_ms\":" << total << "}\n";
+        } else {
+            for (const auto& entry : phases)
+                text << std::left << std::setw(10) << entry.first << std::right << std::setw(12) << entry.second
+                     << " ms " << std::setw(6) << std::setprecision(1)
+                     << (total > 0 ? entry.second * 100 / total : 0) << "%\n" << std::setprecision(3);
+            text << std::left << std::setw(10) << "total" << std::right << std::setw(12) << total << " ms\n";
+        }
+        out << text.str() << std::flush;
+    }
+
+private:
+    std::vector<std::pair<std::string, double>> phases;
+    std::string current;
+    std::chrono::steady_clock::time_point started;
+};
+#endif
+
+// Reads a whole file, or stdin for "-", with plain read(2) calls.
+std::string read_file(const std::string& path) {
+    int fd = path == "-" ? STDIN_FILENO : open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error("Could not open file");
+    std::string data;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        data.reserve(st.st_size);
+    char chunk[65536];
+    while (true) {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            if (fd != STDIN_FILENO)
+                close(fd);
+            throw std::runtime_error("Could not read file");
+        }
+        if (n == 0)
+            break;
+        data.append(chunk, n);
+    }
+    if (fd != STDIN_FILENO)
+        close(fd);
+    return data;
+}
+
+bool write_all_fd(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Formatted output waiting to be written: spill() hands it to write(2) once
+// FLUSH_SIZE bytes are pending. Without a descriptor the whole output is
+// collected instead, for -i and --profile.
+class OutputBuffer {
+public:
+    std::string data;
+
+    OutputBuffer() = default;
+    OutputBuffer(int fd, const std::string& error) : fd(fd), error(error) {
+        data.reserve(FLUSH_SIZE + 4096);
+    }
+
+    void spill() {
+        if (data.size() >= FLUSH_SIZE)
+            flush();
+    }
+
+    void flush() {
+        if (fd < 0)
+            return;
+        if (!write_all_fd(fd, data.data(), data.size()))
+            throw std::runtime_error(error);
+        data.clear();
+    }
+
+private:
+    static constexpr size_t FLUSH_SIZE = 65536;
+    int fd = -1;
+    std::string error;
+};
+
 class AbxReader {
 private:
-    std::ifstream stream;
+    std::string owned_data;
+    const char* cursor;
+    const char* end;
     std::vector<std::string> interned_strings;
     static constexpr char MAGIC[] = "ABX\0";
 
+    void read_bytes(void* out, size_t length, const char* what) {
+        if (static_cast<size_t>(end - cursor) < length)
+            throw std::runtime_error(std::string("Could not read ") + what);
+        memcpy(out, cursor, length);
+        cursor += length;
+    }
+
+    void skip_bytes(size_t length) {
+        cursor += std::min(length, static_cast<size_t>(end - cursor));
+    }
+
     uint8_t read_byte() {
         uint8_t byte;
-        if (!stream.read(reinterpret_cast<char*>(&byte), 1))
-            throw std::runtime_error("Could not read byte");
+        read_bytes(&byte, 1, "byte");
         return byte;
     }
 
     int16_t read_short() {
         int16_t val;
-        if (!stream.read(reinterpret_cast<char*>(&val), 2))
-            throw std::runtime_error("Could not read short");
+        read_bytes(&val, 2, "short");
         return __builtin_bswap16(val);
     }
 
     uint16_t read_unsigned_short() {
         uint16_t val;
-        if (!stream.read(reinterpret_cast<char*>(&val), 2))
-            throw std::runtime_error("Could not read unsigned short");
+        read_bytes(&val, 2, "unsigned short");
         return __builtin_bswap16(val);
     }
 
     int32_t read_int() {
         int32_t val;
-        if (!stream.read(reinterpret_cast<char*>(&val), 4))
-            throw std::runtime_error("Could not read int");
+        read_bytes(&val, 4, "int");
         return __builtin_bswap32(val);
     }
 
     int64_t read_long() {
         int64_t val;
-        if (!stream.read(reinterpret_cast<char*>(&val), 8))
-            throw std::runtime_error("Could not read long");
+        read_bytes(&val, 8, "long");
         return __builtin_bswap64(val);
     }
 
     float read_float() {
+        uint32_t bits;
+        read_bytes(&bits, 4, "float");
+        bits = __builtin_bswap32(bits);
         float val;
-        if (!stream.read(reinterpret_cast<char*>(&val), 4))
-            throw std::runtime_error("Could not read float");
-        val = __builtin_bswap32(*reinterpret_cast<int32_t*>(&val));
+        memcpy(&val, &bits, 4);
         return val;
     }
 
     double read_double() {
+        uint64_t bits;
+        read_bytes(&bits, 8, "double");
+        bits = __builtin_bswap64(bits);
         double val;
-        if (!stream.read(reinterpret_cast<char*>(&val), 8))
-            throw std::runtime_error("Could not read double");
-        val = __builtin_bswap64(*reinterpret_cast<int64_t*>(&val));
+        memcpy(&val, &bits, 8);
         return val;
     }
 
     std::string read_string_raw() {
         uint16_t length = read_unsigned_short();
-        std::vector<char> buffer(length);
-        if (!stream.read(buffer.data(), length))
+        if (static_cast<size_t>(end - cursor) < length)
             throw std::runtime_error("Could not read string");
-        return std::string(buffer.begin(), buffer.end());
+        std::string value(cursor, length);
+        cursor += length;
+        return value;
+    }
+
+    // Hex digits without leading zeros, as std::hex prints the unsigned value.
+    static std::string to_hex(uint64_t value) {
+        char buffer[17];
+        snprintf(buffer, sizeof(buffer), "%llx", static_cast<unsigned long long>(value));
+        return buffer;
     }
 
     std::string read_interned_string() {
@@ -193,7 +351,7 @@ private:
             uint8_t token = read_byte();
             if ((token & 0x0f) == static_cast<uint8_t>(XmlType::START_DOCUMENT)) {
                 // Found the start of the actual document
-                stream.seekg(-1, std::ios::cur);  // Go back one byte
+                --cursor;  // Go back one byte
                 break;
             }
             
@@ -222,13 +380,13 @@ private:
                 case DataType::TYPE_BYTES_BASE64:
                     {
                         uint16_t length = read_short();
-                        stream.seekg(length, std::ios::cur);
+                        skip_bytes(length);
                     }
                     break;
                 default:
                     // For unknown types, try to skip based on the lower 4 bits
                     if ((token & 0x0f) > 0) {
-                        stream.seekg(token & 0x0f, std::ios::cur);
+                        skip_bytes(token & 0x0f);
                     }
                     break;
             }
@@ -236,17 +394,18 @@ private:
     }
 
 public:
-    explicit AbxReader(const std::string& filename) {
-        stream.open(filename, std::ios::binary);
-        if (!stream)
-            throw std::runtime_error("Could not open file");
+    explicit AbxReader(const std::string& filename) : owned_data(read_file(filename)) {
+        cursor = owned_data.data();
+        end = cursor + owned_data.size();
     }
 
+    AbxReader(const char* data, size_t size) : cursor(data), end(data + size) {}
+
     std::shared_ptr<XMLElement> read(bool is_multi_root = false) {
         // Validate magic number
-        char magic_check[4];
-        if (!stream.read(magic_check, 4) || memcmp(magic_check, MAGIC, 4) != 0)
+        if (end - cursor < 4 || memcmp(cursor, MAGIC, 4) != 0)
             throw AbxDecodeError("Invalid magic number");
+        cursor += 4;
 
         // Skip any header extension data
         skip_header_extension();
@@ -262,9 +421,6 @@ public:
         }
 
         while (true) {
-            if (stream.eof())
-                break;
-
             uint8_t token = read_byte();
             uint8_t xml_type = token & 0x0f;
             uint8_t data_type = token & 0xf0;
@@ -346,21 +502,15 @@ public:
                     case DataType::TYPE_INT:
                         value = std::to_string(read_int());
                         break;
-                    case DataType::TYPE_INT_HEX: {
-                        std::stringstream ss;
-                        ss << std::hex << read_int();
-                        value = ss.str();
+                    case DataType::TYPE_INT_HEX:
+                        value = to_hex(static_cast<uint32_t>(read_int()));
                         break;
-                    }
                     case DataType::TYPE_LONG:
                         value = std::to_string(read_long());
                         break;
-                    case DataType::TYPE_LONG_HEX: {
-                        std::stringstream ss;
-                        ss << std::hex << read_long();
-                        value = ss.str();
+                    case DataType::TYPE_LONG_HEX:
+                        value = to_hex(static_cast<uint64_t>(read_long()));
                         break;
-                    }
                     case DataType::TYPE_FLOAT:
                         value = std::to_string(read_float());
                         break;
@@ -376,20 +526,19 @@ public:
                     case DataType::TYPE_BYTES_HEX: {
                         uint16_t length = read_short();
                         std::vector<unsigned char> buffer(length);
-                        if (!stream.read(reinterpret_cast<char*>(buffer.data()), length))
-                            throw std::runtime_error("Could not read bytes");
+                        read_bytes(buffer.data(), length, "bytes");
                         
-                        std::stringstream ss;
-                        for (auto byte : buffer)
-                            ss << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(byte);
-                        value = ss.str();
+                        static const char digits[] = "0123456789abcdef";
+                        for (auto byte : buffer) {
+                            value += digits[byte >> 4];
+                            value += digits[byte & 0x0f];
+                        }
                         break;
                     }
                     case DataType::TYPE_BYTES_BASE64: {
                         uint16_t length = read_short();
                         std::vector<unsigned char> buffer(length);
-                        if (!stream.read(reinterpret_cast<char*>(buffer.data()), length))
-                            throw std::runtime_error("Could not read bytes");
+                        read_bytes(buffer.data(), length, "bytes");
                         
                         value = base64_encode(buffer.data(), buffer.size());
                         break;
@@ -424,46 +573,204 @@ public:
         return root;
     }
 
-    void print_xml(const std::shared_ptr<XMLElement>& element, int indent = 0) {
+    // Appends the XML for element to buffer, which is spilled after each
+    // element; the caller flushes it at the end.
+    void print_xml(OutputBuffer& buffer, const std::shared_ptr<XMLElement>& element, int indent = 0) {
+        std::string& out = buffer.data;
     if (indent == 0) {  // Only print declaration for root element
-        std::cout << "<?xml version='1.0' encoding='UTF-8' standalone='yes' ?>\n";
+        out += "<?xml version='1.0' encoding='UTF-8' standalone='yes' ?>\n";
     }
         
-        std::string indentation(indent, ' ');
-        std::cout << indentation << "<" << element->tag;
+        out.append(indent, ' ');
+        out += "<";
+        out += element->tag;
         
-        for (const auto& [key, value] : element->attrib)
-            std::cout << " " << key << "=\"" << value << "\"";
+        for (const auto& [key, value] : element->attrib) {
+            out += " ";
+            out += key;
+            out += "=\"";
+            out += value;
+            out += "\"";
+        }
         
         if (element->children.empty() && element->text.empty()) {
-            std::cout << "/>" << std::endl;
+            out += "/>\n";
+            buffer.spill();
             return;
         }
         
-        std::cout << ">";
+        out += ">";
         
         if (!element->text.empty())
-            std::cout << element->text;
+            out += element->text;
         
         if (!element->children.empty()) {
-            std::cout << std::endl;
+            out += "\n";
             for (const auto& child : element->children)
-                print_xml(child, indent + 2);
-            std::cout << indentation;
+                print_xml(buffer, child, indent + 2);
+            out.append(indent, ' ');
         }
         
-        std::cout << "</" << element->tag << ">" << std::endl;
+        out += "</";
+        out += element->tag;
+        out += ">\n";
+        buffer.spill();
     }
 };
 
 
 
+// Replaces path with data without ever truncating it in place: the data goes
+// to an unnamed O_TMPFILE in the same directory that is linked in with linkat()
+// and renamed over path once complete, or to a mkstemp() sibling where
+// O_TMPFILE or /proc is unavailable.
+void replace_file_atomically(const std::string& path, const std::string& data) {
+    size_t slash = path.find_last_of('/');
+    std::string dir = slash == std::string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+    std::string temp_path = path + ".tmp" + std::to_string(getpid());
+    int fd = -1;
+    bool linked = false;
+#ifdef O_TMPFILE
+    fd = open(dir.c_str(), O_TMPFILE | O_WRONLY | O_CLOEXEC, 0666);
+    if (fd >= 0) {
+        char proc_path[64];
+        snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0) {
+            fchmod(fd, st.st_mode & 07777);
+            if (fchown(fd, st.st_uid, st.st_gid) != 0) {
+                // Unprivileged runs keep their own ownership.
+            }
+        }
+        linked = write_all_fd(fd, data.data(), data.size()) &&
+                 linkat(AT_FDCWD, proc_path, AT_FDCWD, temp_path.c_str(), AT_SYMLINK_FOLLOW) == 0;
+        close(fd);
+    }
+#endif
+    if (!linked) {
+        temp_path = path + ".tmpXXXXXX";
+        fd = mkstemp(&temp_path[0]);
+        if (fd < 0)
+            throw std::runtime_error("Could not create temporary output file");
+        // mkstemp() creates files 0600; a new file gets the umask applied to
+        // 0666 as open() would.
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0) {
+            fchmod(fd, st.st_mode & 07777);
+        } else {
+            mode_t mask = umask(0);
+            umask(mask);
+            fchmod(fd, 0666 & ~mask);
+        }
+        bool ok = write_all_fd(fd, data.data(), data.size());
+        close(fd);
+        if (!ok) {
+            unlink(temp_path.c_str());
+            throw std::runtime_error("Could not write output file");
+        }
+    }
+    if (rename(temp_path.c_str(), path.c_str()) != 0) {
+        unlink(temp_path.c_str());
+        throw std::runtime_error("Could not replace output file");
+    }
+}
+
+
+
+// Messages are written straight to the descriptor, without iostreams.
+void print_to(int fd, const std::string& text) {
+    write_all_fd(fd, text.data(), text.size());
+}
+
+void write_output_file(const std::string& path, const std::string& data) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0)
+        throw std::runtime_error("Could not open output file '" + path + "'");
+    bool ok = write_all_fd(fd, data.data(), data.size());
+    if (close(fd) != 0 || !ok)
+        throw std::runtime_error("Could not write output file '" + path + "'");
+}
+
+void write_output(const std::string& output, const std::string& input_path, const std::string& output_path,
+                  bool output_to_stdout, bool in_place) {
+    if (output_to_stdout) {
+        if (!write_all_fd(STDOUT_FILENO, output.data(), output.size()))
+            throw std::runtime_error("Could not write output");
+    } else if (in_place && output_path == input_path) {
+        replace_file_atomically(output_path, output);
+    } else {
+        write_output_file(output_path, output);
+    }
+}
+
+// Formats doc straight to stdout or the output file. An in-place conversion
+// is formatted in memory first, since the input must stay intact until the
+// new file replaces it.
+void write_xml(AbxReader& reader, const std::shared_ptr<XMLElement>& doc, const std::string& input_path,
+               const std::string& output_path, bool output_to_stdout, bool in_place) {
+    if (!output_to_stdout && in_place && output_path == input_path) {
+        OutputBuffer output;
+        reader.print_xml(output, doc);
+        replace_file_atomically(output_path, output.data);
+        return;
+    }
+    if (output_to_stdout) {
+        OutputBuffer output(STDOUT_FILENO, "Could not write output");
+        reader.print_xml(output, doc);
+        output.flush();
+        return;
+    }
+    int fd = open(output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0)
+        throw std::runtime_error("Could not open output file '" + output_path + "'");
+    try {
+        OutputBuffer output(fd, "Could not write output file '" + output_path + "'");
+        reader.print_xml(output, doc);
+        output.flush();
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    if (close(fd) != 0)
+        throw std::runtime_error("Could not write output file '" + output_path + "'");
+}
+
+#ifndef ABX_MINIMAL_STARTUP
+// The conversion with each phase timed. Decoding includes building the
+// element tree, which this reader does in the same pass.
+void convert_profiled(const std::string& input_path, const std::string& output_path, bool output_to_stdout,
+                      bool in_place, bool multi_root, PhaseProfile& profile) {
+    profile.begin("read");
+    std::string input = read_file(input_path);
+
+    profile.begin("decode");
+    std::unique_ptr<AbxReader> reader(new AbxReader(input.data(), input.size()));
+    auto doc = reader->read(multi_root);
+
+    profile.begin("format");
+    OutputBuffer output;
+    reader->print_xml(output, doc);
+
+    profile.begin("write");
+    write_output(output.data, input_path, output_path, output_to_stdout, in_place);
+
+    profile.begin("teardown");
+    doc.reset();
+    reader.reset();
+    std::string().swap(input);
+    std::string().swap(output.data);
+    profile.end();
+}
+#endif
+
 void print_usage() {
-    std::cerr << "usage: abx2xml [-mr] [-i] input [output]\n\n"
-              << "Converts between human-readable XML and Android Binary XML.\n\n"
-              << " [-mr] : Enable Multi-Root Processing.\n\n"
-              << "When invoked with the '-i' argument, the output of a successful conversion\n"
-              << "will overwrite the original input file. output can be '-' to use stdout\n\n";
+    print_to(STDERR_FILENO,
+             "usage: abx2xml [-mr] [-i] [--profile[=json]] input [output]\n\n"
+             "Converts between human-readable XML and Android Binary XML.\n\n"
+             " [-mr] : Enable Multi-Root Processing.\n\n"
+             " [--profile] : Report time per phase on stderr (--profile=json for JSON).\n\n"
+             "When invoked with the '-i' argument, the output of a successful conversion\n"
+             "will overwrite the original input file. output can be '-' to use stdout\n\n");
 }
 
 int main(int argc, char* argv[]) {
@@ -477,6 +784,10 @@ int main(int argc, char* argv[]) {
     std::string output_path;
     bool explicit_input = false;
     bool output_to_stdout = false;
+#ifndef ABX_MINIMAL_STARTUP
+    std::unique_ptr<PhaseProfile> profile;
+    bool profile_json = false;
+#endif
     
     // Argument parsing
     for (int i = 1; i < argc; ++i) {
@@ -488,6 +799,15 @@ int main(int argc, char* argv[]) {
         else if (arg == "-i") {
             explicit_input = true;
         } 
+        else if (arg == "--profile" || arg == "--profile=json") {
+#ifdef ABX_MINIMAL_STARTUP
+            print_to(STDERR_FILENO, "Error: --profile is not available in minimal-startup builds\n");
+            return 1;
+#else
+            profile.reset(new PhaseProfile());
+            profile_json = (arg == "--profile=json");
+#endif
+        }
         else if (input_path.empty()) {
             input_path = arg;
         } 
@@ -495,7 +815,7 @@ int main(int argc, char* argv[]) {
             output_path = arg;
         } 
         else {
-            std::cerr << "Error: Too many arguments\n";
+            print_to(STDERR_FILENO, "Error: Too many arguments\n");
             print_usage();
             return 1;
         }
@@ -503,7 +823,7 @@ int main(int argc, char* argv[]) {
 
     // Validation and path handling
     if (input_path.empty()) {
-        std::cerr << "Error: No input file specified\n";
+        print_to(STDERR_FILENO, "Error: No input file specified\n");
         print_usage();
         return 1;
     }
@@ -528,31 +848,33 @@ int main(int argc, char* argv[]) {
         output_path = input_path;
     }
 
+    std::string done = "Successfully converted " + input_path + " to " + output_path +
+                       (multi_root ? " (multi-root mode)" : "") + "\n";
+#ifndef ABX_MINIMAL_STARTUP
+    if (profile) {
+        try {
+            convert_profiled(input_path, output_path, output_to_stdout, explicit_input, multi_root, *profile);
+            print_to(STDERR_FILENO, done);
+            profile->report(std::cerr, profile_json);
+        }
+        catch (const std::exception& e) {
+            print_to(STDERR_FILENO, std::string("Error: ") + e.what() + "\n");
+            return 1;
+        }
+        return 0;
+    }
+#endif
+
     try {
         AbxReader reader(input_path);
         auto doc = reader.read(multi_root);
 
-        if (output_to_stdout) {
-            reader.print_xml(doc);
-        } else {
-            std::ofstream output_file(output_path, std::ios::out | std::ios::trunc);
-            if (!output_file) {
-                std::cerr << "Error: Could not open output file '" << output_path << "'\n";
-                return 1;
-            }
-            
-            auto old_buf = std::cout.rdbuf(output_file.rdbuf());
-            reader.print_xml(doc);
-            std::cout.rdbuf(old_buf);
-        }
+        write_xml(reader, doc, input_path, output_path, output_to_stdout, explicit_input);
 
-        std::cerr << "Successfully converted " << input_path 
-                   << " to " << output_path 
-                   << (multi_root ? " (multi-root mode)" : "") 
-                   << std::endl;
+        print_to(STDERR_FILENO, done);
     }
     catch (const std::exception& e) {
-        std::cerr << "Error: " << e.what() << std::endl;
+        print_to(STDERR_FILENO, std::string("Error: ") + e.what() + "\n");
         return 1;
     }
 
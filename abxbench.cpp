@@ -0,0 +1,917 @@
+// Microbenchmarks for the ABX decoder, XML emitter, XmlParser and AbxWriter.
+// Builds on abxtool.cpp so every measurement runs the code abxtool ships.
+#define ABXTOOL_NO_MAIN
+#define ABX_ALLOC_STATS
+#include "abxtool.cpp"
+#include <sys/wait.h>
+#include <spawn.h>
+
+// Deterministic values so runs are comparable across builds.
+class BenchRandom {
+public:
+    explicit BenchRandom(uint64_t seed) : state(seed) {}
+    uint64_t next() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+    std::string word(size_t length) {
+        std::string out(length, 'a');
+        for (auto& c : out)
+            c = 'a' + next() % 26;
+        return out;
+    }
+    std::string bytes(size_t length) {
+        std::string out(length, '\0');
+        for (auto& c : out)
+            c = static_cast<char>(next());
+        return out;
+    }
+private:
+    uint64_t state;
+};
+
+struct BenchOptions {
+    size_t elements = 20000;
+    int min_time_ms = 300;
+    int trials = 1;
+    std::string filter;
+    PerfCounters* counters = nullptr;
+};
+
+struct BenchResult {
+    std::string name;
+    uint64_t tokens = 0;
+    uint64_t bytes = 0;
+    double seconds = 0;
+    double allocations = 0;
+    bool perf_measured = false;
+    PerfCounters::Sample perf;
+    // Fastest iteration of each trial, the samples baselines are compared on.
+    std::vector<double> trial_seconds;
+};
+
+// Runs fn until min_time_ms has passed (at least three times) and keeps the
+// fastest iteration, once per trial. The result reports the fastest iteration
+// overall, with allocations and hardware counters from that same iteration.
+template <typename Fn>
+BenchResult measure(const BenchOptions& options, const std::string& name, uint64_t tokens, uint64_t bytes, Fn fn) {
+    BenchResult result;
+    result.name = name;
+    result.tokens = tokens;
+    result.bytes = bytes;
+    result.perf_measured = options.counters != nullptr;
+    fn();
+    for (int trial = 0; trial < options.trials; ++trial) {
+        double fastest = 0;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(options.min_time_ms);
+        for (int iteration = 0; iteration < 3 || std::chrono::steady_clock::now() < deadline; ++iteration) {
+            uint64_t allocations_before = AllocationStats::total_allocations();
+            if (options.counters)
+                options.counters->start();
+            auto start = std::chrono::steady_clock::now();
+            fn();
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            PerfCounters::Sample perf;
+            if (options.counters)
+                perf = options.counters->stop();
+            uint64_t allocations = AllocationStats::total_allocations() - allocations_before;
+            if (iteration == 0 || seconds < fastest)
+                fastest = seconds;
+            if ((result.trial_seconds.empty() && iteration == 0) || seconds < result.seconds) {
+                result.seconds = seconds;
+                result.allocations = static_cast<double>(allocations);
+                result.perf = perf;
+            }
+        }
+        result.trial_seconds.push_back(fastest);
+    }
+    return result;
+}
+
+void print_header(bool perf) {
+    std::cout << std::left << std::setw(28) << "benchmark"
+              << std::right << std::setw(10) << "tokens"
+              << std::setw(12) << "ns/token"
+              << std::setw(10) << "MB/s"
+              << std::setw(14) << "allocs/token";
+    if (perf)
+        print_perf_header(std::cout);
+    std::cout << "\n";
+}
+
+void print_result(const BenchResult& result) {
+    double ns_per_token = result.tokens ? result.seconds * 1e9 / result.tokens : 0;
+    double mb_per_second = result.seconds > 0 ? result.bytes / result.seconds / 1e6 : 0;
+    double allocations_per_token = result.tokens ? result.allocations / result.tokens : 0;
+    std::cout << std::left << std::setw(28) << result.name
+              << std::right << std::setw(10) << result.tokens
+              << std::fixed << std::setprecision(2)
+              << std::setw(12) << ns_per_token
+              << std::setw(10) << mb_per_second
+              << std::setprecision(3) << std::setw(14) << allocations_per_token;
+    if (result.perf_measured)
+        print_perf_ratios(std::cout, result.perf, static_cast<double>(result.bytes), static_cast<double>(result.tokens));
+    std::cout << "\n";
+    std::cout.unsetf(std::ios::fixed);
+}
+
+// Per-trial ns/token of one benchmark, as saved in a baseline file.
+struct BaselineEntry {
+    std::string name;
+    std::vector<double> ns_per_token;
+};
+
+std::vector<double> trial_ns_per_token(const BenchResult& result) {
+    std::vector<double> samples;
+    for (double seconds : result.trial_seconds)
+        samples.push_back(result.tokens ? seconds * 1e9 / result.tokens : 0);
+    return samples;
+}
+
+void save_baseline(const std::string& path, const BenchOptions& options, const std::vector<BenchResult>& results) {
+    std::ostringstream json;
+    json << std::setprecision(9) << "{\"elements\":" << options.elements << ",\"benchmarks\":[";
+    for (size_t i = 0; i < results.size(); ++i) {
+        json << (i ? ",\n" : "\n") << "{\"name\":\"" << json_escape(results[i].name) << "\",\"ns_per_token\":[";
+        std::vector<double> samples = trial_ns_per_token(results[i]);
+        for (size_t j = 0; j < samples.size(); ++j)
+            json << (j ? "," : "") << samples[j];
+        json << "]}";
+    }
+    json << "\n]}\n";
+    std::ofstream out(path);
+    if (!(out << json.str()) || !out.flush())
+        throw std::runtime_error("Could not write baseline '" + path + "'");
+}
+
+// Reads a file written by save_baseline; only the fields it writes are understood.
+std::vector<BaselineEntry> load_baseline(const std::string& path, size_t& elements) {
+    std::string json = read_input_file(path);
+    std::vector<BaselineEntry> entries;
+    size_t pos = json.find("\"elements\":");
+    elements = pos == std::string::npos ? 0 : std::strtoul(json.c_str() + pos + 11, nullptr, 10);
+    pos = 0;
+    while ((pos = json.find("{\"name\":\"", pos)) != std::string::npos) {
+        pos += 9;
+        size_t end = json.find('"', pos);
+        size_t samples = json.find("\"ns_per_token\":[", end);
+        if (end == std::string::npos || samples == std::string::npos)
+            throw std::runtime_error("Malformed baseline '" + path + "'");
+        BaselineEntry entry;
+        entry.name = json.substr(pos, end - pos);
+        const char* cursor = json.c_str() + samples + 16;
+        while (*cursor && *cursor != ']') {
+            char* next;
+            entry.ns_per_token.push_back(std::strtod(cursor, &next));
+            if (next == cursor)
+                throw std::runtime_error("Malformed baseline '" + path + "'");
+            cursor = *next == ',' ? next + 1 : next;
+        }
+        entries.push_back(std::move(entry));
+        pos = cursor - json.c_str();
+    }
+    return entries;
+}
+
+// 97.5% quantile of Student's t distribution by its Cornish-Fisher expansion
+// around the normal quantile; within 2% of the exact value from 3 degrees of
+// freedom up.
+double t_quantile_975(double df) {
+    const double z = 1.959964;
+    double z3 = z * z * z, z5 = z3 * z * z, z7 = z5 * z * z;
+    return z + (z3 + z) / (4 * df) + (5 * z5 + 16 * z3 + 3 * z) / (96 * df * df) +
+           (3 * z7 + 19 * z5 + 17 * z3 - 15 * z) / (384 * df * df * df);
+}
+
+void mean_and_variance(const std::vector<double>& samples, double& mean, double& variance) {
+    mean = 0;
+    for (double sample : samples)
+        mean += sample;
+    mean /= samples.size();
+    variance = 0;
+    for (double sample : samples)
+        variance += (sample - mean) * (sample - mean);
+    variance = samples.size() > 1 ? variance / (samples.size() - 1) : 0;
+}
+
+// Compares each benchmark's trials against the baseline with Welch's t-test
+// on mean ns/token. A change is flagged when the 95% confidence interval of
+// the difference excludes zero and its midpoint is at least threshold
+// (a fraction) of the baseline mean. Returns the number of regressions.
+int compare_with_baseline(const std::vector<BaselineEntry>& baseline, const std::vector<BenchResult>& results, double threshold) {
+    int regressions = 0;
+    std::ostringstream text;
+    text << std::fixed << std::setprecision(2);
+    text << std::left << std::setw(28) << "benchmark" << std::right << std::setw(12) << "base ns/tok"
+         << std::setw(12) << "new ns/tok" << std::setw(10) << "change" << std::setw(22) << "95% CI" << "  verdict\n";
+    for (const auto& result : results) {
+        auto entry = std::find_if(baseline.begin(), baseline.end(), [&](const BaselineEntry& e) {
+            return e.name == result.name;
+        });
+        text << std::left << std::setw(28) << result.name << std::right;
+        if (entry == baseline.end() || entry->ns_per_token.empty()) {
+            text << std::setw(12) << "-" << "\n";
+            continue;
+        }
+        std::vector<double> current = trial_ns_per_token(result);
+        double base_mean, base_variance, new_mean, new_variance;
+        mean_and_variance(entry->ns_per_token, base_mean, base_variance);
+        mean_and_variance(current, new_mean, new_variance);
+        double change = base_mean > 0 ? (new_mean - base_mean) / base_mean : 0;
+        text << std::setw(12) << base_mean << std::setw(12) << new_mean << std::setw(9) << change * 100 << "%";
+        size_t base_n = entry->ns_per_token.size(), new_n = current.size();
+        if (base_n < 2 || new_n < 2 || base_mean <= 0) {
+            text << std::setw(22) << "-" << "  needs 2+ trials\n";
+            continue;
+        }
+        double base_term = base_variance / base_n, new_term = new_variance / new_n;
+        double standard_error = std::sqrt(base_term + new_term);
+        double df = standard_error > 0 ? std::pow(standard_error, 4) /
+            (base_term * base_term / (base_n - 1) + new_term * new_term / (new_n - 1)) : base_n + new_n - 2;
+        double half_width = t_quantile_975(std::max(df, 1.0)) * standard_error;
+        double low = (new_mean - base_mean - half_width) / base_mean * 100;
+        double high = (new_mean - base_mean + half_width) / base_mean * 100;
+        std::ostringstream interval;
+        interval << std::fixed << std::setprecision(2) << "[" << low << "%, " << high << "%]";
+        text << std::setw(22) << interval.str();
+        bool significant = (low > 0 || high < 0) && std::fabs(change) >= threshold;
+        if (significant && change > 0) {
+            regressions++;
+            text << "  REGRESSION\n";
+        } else if (significant) {
+            text << "  improvement\n";
+        } else {
+            text << "  ~\n";
+        }
+    }
+    std::cout << text.str() << std::flush;
+    return regressions;
+}
+
+// Document of <item> elements, each carrying eight attributes written by
+// write_attribute so that decode time is dominated by that data type.
+std::string build_attribute_document(size_t elements, const std::function<void(AbxWriter&, const std::string&, BenchRandom&)>& write_attribute) {
+    std::ostringstream out;
+    AbxWriter writer(out);
+    BenchRandom random(42);
+    static const char* names[] = {"a0", "a1", "a2", "a3", "a4", "a5", "a6", "a7"};
+    writer.write_start_document();
+    writer.write_start_tag("bench");
+    for (size_t i = 0; i < elements; ++i) {
+        writer.write_start_tag("item");
+        for (const char* name : names)
+            write_attribute(writer, name, random);
+        writer.write_end_tag("item");
+    }
+    writer.write_end_tag("bench");
+    writer.write_end_document();
+    return out.str();
+}
+
+// Document of <item> elements holding text; whitespace-only text is dropped
+// by the reader and measured separately.
+std::string build_text_document(size_t elements, bool whitespace) {
+    std::ostringstream out;
+    AbxWriter writer(out);
+    BenchRandom random(7);
+    writer.write_start_document();
+    writer.write_start_tag("bench");
+    for (size_t i = 0; i < elements; ++i) {
+        writer.write_start_tag("item");
+        writer.write_text(whitespace ? std::string("\n    ") : random.word(32));
+        writer.write_end_tag("item");
+    }
+    writer.write_end_tag("bench");
+    writer.write_end_document();
+    return out.str();
+}
+
+// packages.xml-like mix of tags, string attributes and text.
+std::string build_mixed_document(size_t elements) {
+    std::ostringstream out;
+    AbxWriter writer(out);
+    BenchRandom random(3);
+    writer.write_start_document();
+    writer.write_start_tag("packages");
+    for (size_t i = 0; i < elements; ++i) {
+        writer.write_start_tag("package");
+        writer.write_attribute("name", "com.example." + random.word(8));
+        writer.write_attribute("codePath", "/data/app/" + random.word(16));
+        writer.write_attribute("version", std::to_string(random.next() % 100000));
+        writer.write_start_tag("perms");
+        writer.write_start_tag("item");
+        writer.write_attribute("name", "android.permission." + random.word(10));
+        writer.write_attribute("granted", "true");
+        writer.write_end_tag("item");
+        writer.write_end_tag("perms");
+        writer.write_start_tag("sigs");
+        writer.write_text(random.word(24));
+        writer.write_end_tag("sigs");
+        writer.write_end_tag("package");
+    }
+    writer.write_end_tag("packages");
+    writer.write_end_document();
+    return out.str();
+}
+
+uint64_t count_tokens(const std::string& abx) {
+    AbxReader reader(abx.data(), abx.size());
+    TokenCounter handler;
+    reader.read_events(handler);
+    return handler.tokens;
+}
+
+BenchResult bench_decode(const BenchOptions& options, const std::string& name, const std::string& abx) {
+    return measure(options, name, count_tokens(abx), abx.size(), [&] {
+        AbxReader reader(abx.data(), abx.size());
+        TokenCounter handler;
+        reader.read_events(handler);
+    });
+}
+
+std::vector<BenchResult> run_benchmarks(const BenchOptions& options) {
+    std::vector<BenchResult> results;
+    auto report = [&results](BenchResult result) {
+        print_result(result);
+        results.push_back(std::move(result));
+    };
+    typedef std::function<void(AbxWriter&, const std::string&, BenchRandom&)> AttributeWriter;
+    std::vector<std::string> vocabulary;
+    BenchRandom vocabulary_random(11);
+    for (int i = 0; i < 64; ++i)
+        vocabulary.push_back(vocabulary_random.word(12));
+    std::vector<std::pair<std::string, AttributeWriter>> data_types = {
+        {"decode/null", [](AbxWriter& w, const std::string& n, BenchRandom&) { w.write_attribute_null(n); }},
+        {"decode/boolean", [](AbxWriter& w, const std::string& n, BenchRandom& r) { w.write_attribute_boolean(n, r.next() & 1); }},
+        {"decode/int", [](AbxWriter& w, const std::string& n, BenchRandom& r) { w.write_attribute_int(n, static_cast<int32_t>(r.next())); }},
+        {"decode/int_hex", [](AbxWriter& w, const std::string& n, BenchRandom& r) { w.write_attribute_int(n, static_cast<int32_t>(r.next()), true); }},
+        {"decode/long", [](AbxWriter& w, const std::string& n, BenchRandom& r) { w.write_attribute_long(n, static_cast<int64_t>(r.next())); }},
+        {"decode/long_hex", [](AbxWriter& w, const std::string& n, BenchRandom& r) { w.write_attribute_long(n, static_cast<int64_t>(r.next()), true); }},
+        {"decode/float", [](AbxWriter& w, const std::string& n, BenchRandom& r) { w.write_attribute_float(n, (r.next() % 100000) / 7.0f); }},
+        {"decode/double", [](AbxWriter& w, const std::string& n, BenchRandom& r) { w.write_attribute_double(n, (r.next() % 100000000) / 7.0); }},
+        {"decode/bytes_hex", [](AbxWriter& w, const std::string& n, BenchRandom& r) { w.write_attribute_bytes(n, r.bytes(32)); }},
+        {"decode/bytes_base64", [](AbxWriter& w, const std::string& n, BenchRandom& r) { w.write_attribute_bytes(n, r.bytes(32), true); }},
+        {"decode/string_raw", [&](AbxWriter& w, const std::string& n, BenchRandom& r) { w.write_attribute(n, vocabulary[r.next() % vocabulary.size()]); }},
+        {"decode/string_interned", [&](AbxWriter& w, const std::string& n, BenchRandom& r) { w.write_attribute_interned(n, vocabulary[r.next() % vocabulary.size()]); }},
+    };
+    auto selected = [&](const std::string& name) {
+        return options.filter.empty() || name.find(options.filter) != std::string::npos;
+    };
+    print_header(options.counters != nullptr);
+    for (const auto& [name, write_attribute] : data_types) {
+        if (selected(name))
+            report(bench_decode(options, name, build_attribute_document(options.elements, write_attribute)));
+    }
+    if (selected("decode/text"))
+        report(bench_decode(options, "decode/text", build_text_document(options.elements, false)));
+    if (selected("decode/text_whitespace"))
+        report(bench_decode(options, "decode/text_whitespace", build_text_document(options.elements, true)));
+    std::string mixed = build_mixed_document(options.elements);
+    uint64_t mixed_tokens = count_tokens(mixed);
+    if (selected("decode/mixed_dom")) {
+        report(measure(options, "decode/mixed_dom", mixed_tokens, mixed.size(), [&] {
+            AbxReader reader(mixed.data(), mixed.size());
+            reader.read();
+        }));
+    }
+    AbxReader mixed_reader(mixed.data(), mixed.size());
+    auto root = mixed_reader.read();
+    std::ostringstream xml_out;
+    mixed_reader.print_xml(xml_out, root);
+    std::string xml = xml_out.str();
+    if (selected("emit/print_xml")) {
+        report(measure(options, "emit/print_xml", mixed_tokens, xml.size(), [&] {
+            std::ostringstream out;
+            mixed_reader.print_xml(out, root);
+        }));
+    }
+    if (selected("parse/xml_parser")) {
+        report(measure(options, "parse/xml_parser", mixed_tokens, xml.size(), [&] {
+            XmlParser parser;
+            parser.parse(xml);
+        }));
+    }
+    if (selected("encode/xml2abx")) {
+        report(measure(options, "encode/xml2abx", mixed_tokens, xml.size(), [&] {
+            std::ostringstream out;
+            XmlToAbxConverter::convert_content(xml, out);
+        }));
+    }
+    for (size_t distinct : {16, 256, 4096}) {
+        std::string name = "writer/intern_" + std::to_string(distinct);
+        if (!selected(name))
+            continue;
+        std::vector<std::string> names;
+        BenchRandom random(distinct);
+        for (size_t i = 0; i < distinct; ++i)
+            names.push_back(random.word(10));
+        std::vector<size_t> order(options.elements * 8);
+        for (auto& index : order)
+            index = random.next() % distinct;
+        auto write_tags = [&]() {
+            std::ostringstream out;
+            AbxWriter writer(out);
+            for (size_t index : order)
+                writer.write_start_tag(names[index]);
+            return static_cast<uint64_t>(out.tellp());
+        };
+        report(measure(options, name, order.size(), write_tags(), write_tags));
+    }
+    return results;
+}
+
+// Memory footprint of the DOM and streaming conversion paths. Every
+// measurement runs in a forked child so one path's heap cannot inflate the
+// next one's numbers. The child generates its input, resets the kernel's RSS
+// high-water mark through /proc/self/clear_refs and the allocation peak, then
+// converts; growth is the high-water mark above the RSS with the input loaded.
+struct MemoryResult {
+    uint64_t input_bytes = 0;
+    uint64_t peak_rss = 0;
+    uint64_t rss_growth = 0;
+    uint64_t heap_growth = 0;
+    uint64_t hwm_reset = 0;
+};
+
+uint64_t proc_status_bytes(const char* field) {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    size_t length = strlen(field);
+    while (std::getline(status, line)) {
+        if (line.compare(0, length, field) == 0 && line.size() > length && line[length] == ':')
+            return std::strtoull(line.c_str() + length + 1, nullptr, 10) * 1024;
+    }
+    return 0;
+}
+
+std::string format_size(uint64_t bytes) {
+    static const char* units[] = {"B", "K", "M", "G"};
+    double value = static_cast<double>(bytes);
+    int unit = 0;
+    while (value >= 1024 && unit < 3) {
+        value /= 1024;
+        unit++;
+    }
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(value < 10 && unit > 0 ? 1 : 0) << value << units[unit];
+    return out.str();
+}
+
+std::string generate_packages(uint64_t size, bool xml) {
+    std::ostringstream out;
+    CountingStreamBuf counter(out.rdbuf());
+    std::ostream counted(&counter);
+    CorpusGenerator generator(CorpusGenerator::Shape::PACKAGES, 1);
+    if (xml) {
+        XmlTextWriter writer(counted);
+        generator.generate(writer, size, [&] { return counter.count(); });
+    } else {
+        AbxWriter writer(counted);
+        generator.generate(writer, size, [&] { return counter.count(); });
+    }
+    counted.flush();
+    return out.str();
+}
+
+template <typename Fn>
+MemoryResult measure_memory(uint64_t size, bool xml_input, Fn convert) {
+    int fds[2];
+    if (pipe(fds) != 0)
+        throw std::runtime_error(std::string("pipe: ") + strerror(errno));
+    pid_t pid = fork();
+    if (pid < 0)
+        throw std::runtime_error(std::string("fork: ") + strerror(errno));
+    if (pid == 0) {
+        close(fds[0]);
+        MemoryResult result;
+        try {
+            std::string input = generate_packages(size, xml_input);
+            result.input_bytes = input.size();
+            malloc_trim(0);
+            uint64_t base_rss = proc_status_bytes("VmRSS");
+            int clear = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+            result.hwm_reset = clear >= 0 && write(clear, "5", 1) == 1;
+            if (clear >= 0)
+                close(clear);
+            AllocationStats::reset_peak();
+            uint64_t base_heap = AllocationStats::peak();
+            convert(input);
+            result.heap_growth = AllocationStats::peak() - base_heap;
+            result.peak_rss = proc_status_bytes("VmHWM");
+            result.rss_growth = result.peak_rss > base_rss ? result.peak_rss - base_rss : 0;
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            _exit(1);
+        }
+        _exit(write_all_fd(fds[1], reinterpret_cast<const char*>(&result), sizeof(result)) ? 0 : 1);
+    }
+    close(fds[1]);
+    MemoryResult result;
+    std::string reply = read_all_fd(fds[0]);
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || reply.size() != sizeof(result))
+        throw std::runtime_error("Memory benchmark child failed");
+    memcpy(&result, reply.data(), sizeof(result));
+    return result;
+}
+
+void run_memory_benchmarks(const BenchOptions& options, uint64_t max_size) {
+    struct Path {
+        const char* name;
+        bool xml_input;
+        std::function<void(const std::string&)> convert;
+    };
+    std::vector<Path> paths = {
+        {"abx2xml/dom", false, [](const std::string& input) {
+            CountingStreamBuf sink(nullptr);
+            std::ostream out(&sink);
+            AbxReader reader(input.data(), input.size());
+            auto root = reader.read();
+            reader.print_xml(out, root);
+        }},
+        // The pipeline only streams into a regular file, so it writes to an
+        // unlinked temporary file; a pipe or /dev/null would take the DOM path.
+        {"abx2xml/pipeline", false, [](const std::string& input) {
+            const char* tmpdir = getenv("TMPDIR");
+            std::string path = std::string(tmpdir && *tmpdir ? tmpdir : "/tmp") + "/abxbench.XXXXXX";
+            int out_fd = mkstemp(&path[0]);
+            if (out_fd < 0)
+                throw std::runtime_error("Could not create a temporary file");
+            unlink(path.c_str());
+            pipelined_abx_to_xml(input, out_fd, false);
+            close(out_fd);
+        }},
+        {"xml2abx/dom", true, [](const std::string& input) {
+            CountingStreamBuf sink(nullptr);
+            std::ostream out(&sink);
+            XmlToAbxConverter::convert_content(input, out);
+        }},
+    };
+    std::cout << std::left << std::setw(18) << "path" << std::right << std::setw(10) << "input"
+              << std::setw(12) << "peak RSS" << std::setw(12) << "RSS grow" << std::setw(12) << "RSS/input"
+              << std::setw(12) << "heap peak" << std::setw(12) << "heap/input" << "\n";
+    bool hwm_reset = true;
+    for (const auto& path : paths) {
+        if (!options.filter.empty() && std::string(path.name).find(options.filter) == std::string::npos)
+            continue;
+        for (uint64_t size = 1024; size <= max_size; size *= 16) {
+            MemoryResult result = measure_memory(size, path.xml_input, path.convert);
+            hwm_reset = hwm_reset && result.hwm_reset;
+            double input = static_cast<double>(result.input_bytes);
+            std::cout << std::left << std::setw(18) << path.name << std::right
+                      << std::setw(10) << format_size(result.input_bytes)
+                      << std::setw(12) << format_size(result.peak_rss)
+                      << std::setw(12) << format_size(result.rss_growth)
+                      << std::fixed << std::setprecision(2)
+                      << std::setw(12) << result.rss_growth / input
+                      << std::setw(12) << format_size(result.heap_growth)
+                      << std::setw(12) << result.heap_growth / input << "\n" << std::flush;
+            std::cout.unsetf(std::ios::fixed);
+        }
+    }
+    std::cout << "xml2abx has no streaming path: XmlParser builds the whole tree first.\n";
+    if (!hwm_reset)
+        std::cout << "/proc/self/clear_refs was not writable; peak RSS includes input generation.\n";
+}
+
+// Document shape for the sensitivity matrix; each dimension is swept from
+// these defaults with the others held fixed.
+struct DocumentShape {
+    size_t depth = 2;
+    size_t fanout = 1;
+    size_t attributes = 4;
+    size_t text_length = 0;
+    size_t distinct_names = 16;
+    size_t blob_size = 0;
+};
+
+// Records of `depth` nested elements whose innermost level repeats `fanout`
+// times; every element carries `attributes` string attributes, innermost
+// elements add text and a base64 blob. Tag and attribute names cycle through
+// `distinct_names` names, so all of them reach the intern table.
+std::string build_shaped_document(const DocumentShape& shape, uint64_t target_size) {
+    std::ostringstream out;
+    AbxWriter writer(out);
+    BenchRandom random(99);
+    std::vector<std::string> names;
+    for (size_t i = 0; i < shape.distinct_names; ++i)
+        names.push_back("n" + std::to_string(i) + "_" + random.word(6));
+    size_t next_name = 0;
+    auto name = [&]() -> const std::string& {
+        const std::string& chosen = names[next_name];
+        next_name = (next_name + 1) % names.size();
+        return chosen;
+    };
+    std::string text = random.word(shape.text_length);
+    std::string blob = random.bytes(shape.blob_size);
+    std::function<void(size_t)> element = [&](size_t level) {
+        std::string tag = name();
+        writer.write_start_tag(tag);
+        for (size_t i = 0; i < shape.attributes; ++i)
+            writer.write_attribute(name(), random.word(8));
+        if (level + 1 < shape.depth) {
+            for (size_t i = 0; i < (level + 2 == shape.depth ? shape.fanout : 1); ++i)
+                element(level + 1);
+        } else {
+            if (shape.blob_size)
+                writer.write_attribute_bytes(name(), blob, true);
+            if (shape.text_length)
+                writer.write_text(text);
+        }
+        writer.write_end_tag(tag);
+    };
+    writer.write_start_document();
+    writer.write_start_tag("shape");
+    do {
+        element(0);
+    } while (static_cast<uint64_t>(out.tellp()) < target_size);
+    writer.write_end_tag("shape");
+    writer.write_end_document();
+    return out.str();
+}
+
+// Sweeps each shape dimension on its own and reports decode, abx2xml and
+// xml2abx throughput, with a bar per row scaled to the dimension's fastest
+// abx2xml run so cliffs stand out.
+void run_shape_benchmarks(const BenchOptions& options, uint64_t target_size) {
+    struct Dimension {
+        const char* name;
+        size_t DocumentShape::*field;
+        std::vector<size_t> values;
+    };
+    std::vector<Dimension> dimensions = {
+        {"depth", &DocumentShape::depth, {1, 4, 16, 64, 256}},
+        {"fanout", &DocumentShape::fanout, {1, 16, 256, 4096}},
+        {"attributes", &DocumentShape::attributes, {0, 1, 4, 16, 64}},
+        {"text_length", &DocumentShape::text_length, {0, 16, 256, 4096, 32768}},
+        {"distinct_names", &DocumentShape::distinct_names, {1, 16, 256, 1024, 4096}},
+        {"blob_size", &DocumentShape::blob_size, {0, 64, 1024, 16384}},
+    };
+    for (const auto& dimension : dimensions) {
+        if (!options.filter.empty() && std::string(dimension.name).find(options.filter) == std::string::npos)
+            continue;
+        struct Row {
+            size_t value;
+            uint64_t abx_bytes;
+            double decode, abx2xml, xml2abx;
+        };
+        std::vector<Row> rows;
+        for (size_t value : dimension.values) {
+            DocumentShape shape;
+            shape.*dimension.field = value;
+            std::string abx = build_shaped_document(shape, target_size);
+            AbxReader reader(abx.data(), abx.size());
+            auto root = reader.read();
+            std::ostringstream xml_out;
+            reader.print_xml(xml_out, root);
+            std::string xml = xml_out.str();
+            auto mb_per_second = [](const BenchResult& result) {
+                return result.seconds > 0 ? result.bytes / result.seconds / 1e6 : 0;
+            };
+            Row row{value, abx.size(), 0, 0, 0};
+            row.decode = mb_per_second(bench_decode(options, "decode", abx));
+            row.abx2xml = mb_per_second(measure(options, "abx2xml", 0, abx.size(), [&] {
+                CountingStreamBuf sink(nullptr);
+                std::ostream out(&sink);
+                AbxReader dom_reader(abx.data(), abx.size());
+                auto dom = dom_reader.read();
+                dom_reader.print_xml(out, dom);
+            }));
+            row.xml2abx = mb_per_second(measure(options, "xml2abx", 0, xml.size(), [&] {
+                CountingStreamBuf sink(nullptr);
+                std::ostream out(&sink);
+                XmlToAbxConverter::convert_content(xml, out);
+            }));
+            rows.push_back(row);
+        }
+        double fastest = 0;
+        for (const auto& row : rows)
+            fastest = std::max(fastest, row.abx2xml);
+        std::cout << dimension.name << "\n"
+                  << std::right << std::setw(10) << "value" << std::setw(10) << "abx"
+                  << std::setw(12) << "decode" << std::setw(12) << "abx2xml" << std::setw(12) << "xml2abx"
+                  << "  abx2xml MB/s\n";
+        for (const auto& row : rows) {
+            int bar = fastest > 0 ? static_cast<int>(row.abx2xml / fastest * 40 + 0.5) : 0;
+            std::cout << std::setw(10) << row.value << std::setw(10) << format_size(row.abx_bytes)
+                      << std::fixed << std::setprecision(1)
+                      << std::setw(12) << row.decode << std::setw(12) << row.abx2xml << std::setw(12) << row.xml2abx
+                      << "  " << std::string(bar, '#') << "\n";
+            std::cout.unsetf(std::ios::fixed);
+        }
+        std::cout << "\n" << std::flush;
+    }
+}
+
+// Exec-to-exit time of the command-line tools on a small packages document,
+// which is where process startup rather than conversion dominates. /bin/true
+// is timed as well, as the floor set by fork and exec.
+void run_startup_benchmarks(const BenchOptions& options, const std::string& bin_dir, int runs) {
+    char dir_template[] = "/tmp/abxbench-XXXXXX";
+    if (!mkdtemp(dir_template))
+        throw std::runtime_error("Cannot create temporary directory");
+    std::string dir = dir_template;
+    std::string abx_path = dir + "/small.abx";
+    std::string xml_path = dir + "/small.xml";
+    std::string out_path = dir + "/out";
+    std::string abx = generate_packages(2048, false);
+    std::string xml = generate_packages(2048, true);
+    write_output_file(abx_path, abx);
+    write_output_file(xml_path, xml);
+
+    struct Command {
+        std::string name;
+        std::vector<std::string> argv;
+    };
+    std::vector<Command> commands = {
+        {"/bin/true", {"/bin/true"}},
+        {"abx2xml", {bin_dir + "/abx2xml", abx_path, out_path}},
+        {"xml2abx", {bin_dir + "/xml2abx", xml_path, out_path}},
+        {"abxtool abx2xml", {bin_dir + "/abxtool", "abx2xml", abx_path, out_path}},
+        {"abxtool xml2abx", {bin_dir + "/abxtool", "xml2abx", xml_path, out_path}},
+    };
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+    std::cout << "Startup on " << format_size(abx.size()) << " ABX / "
+              << format_size(xml.size()) << " XML, " << runs << " runs each\n"
+              << std::left << std::setw(18) << "command" << std::right << std::setw(10) << "min ms"
+              << std::setw(10) << "median" << std::setw(10) << "p99" << std::setw(10) << "mean" << "\n";
+    for (const auto& command : commands) {
+        if (!options.filter.empty() && command.name.find(options.filter) == std::string::npos)
+            continue;
+        if (access(command.argv[0].c_str(), X_OK) != 0) {
+            std::cout << std::left << std::setw(18) << command.name << std::right << "  (not found: "
+                      << command.argv[0] << ")\n";
+            continue;
+        }
+        std::vector<char*> argv;
+        for (const auto& arg : command.argv)
+            argv.push_back(const_cast<char*>(arg.c_str()));
+        argv.push_back(nullptr);
+        BenchSeries series;
+        bool failed = false;
+        for (int i = 0; i <= runs && !failed; ++i) {
+            auto start = std::chrono::steady_clock::now();
+            pid_t pid;
+            if (posix_spawn(&pid, argv[0], &actions, nullptr, argv.data(), environ) != 0) {
+                failed = true;
+                break;
+            }
+            int status = 0;
+            while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+            // The first run warms the page cache and is not counted.
+            if (i > 0)
+                series.latencies.push_back(seconds);
+        }
+        std::cout << std::left << std::setw(18) << command.name << std::right;
+        if (failed || series.latencies.empty()) {
+            std::cout << "  (failed)\n";
+            continue;
+        }
+        double total = 0;
+        for (double latency : series.latencies)
+            total += latency;
+        std::cout << std::fixed << std::setprecision(3)
+                  << std::setw(10) << series.percentile(0) * 1e3 << std::setw(10) << series.percentile(0.5) * 1e3
+                  << std::setw(10) << series.percentile(0.99) * 1e3
+                  << std::setw(10) << total / series.latencies.size() * 1e3 << "\n";
+        std::cout.unsetf(std::ios::fixed);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    unlink(abx_path.c_str());
+    unlink(xml_path.c_str());
+    unlink(out_path.c_str());
+    rmdir(dir.c_str());
+}
+
+void print_bench_usage() {
+    std::cerr << "Usage: abxbench [--elements N] [--min-time MS] [--filter SUBSTRING] [--perf]\n"
+              << "                [--trials N] [--save FILE] [--compare FILE] [--threshold PCT]\n"
+              << "       abxbench --memory [MAX] | --shapes [SIZE] | --startup [DIR] [--runs N]\n"
+              << "  --elements N   : Elements per generated document (default 20000)\n"
+              << "  --min-time MS  : Minimum time spent on each benchmark trial (default 300)\n"
+              << "  --filter TEXT  : Only run benchmarks whose name contains TEXT\n"
+              << "  --perf         : Add cycles/byte, IPC and branch, L1d and LLC misses per\n"
+              << "                   token from perf_event_open, where permitted\n"
+              << "  --trials N     : Measure each benchmark N times (default 1, or 10 with\n"
+              << "                   --save or --compare)\n"
+              << "  --save FILE    : Write per-trial ns/token as a JSON baseline\n"
+              << "  --compare FILE : Compare against a saved baseline with Welch's t-test and\n"
+              << "                   exit with status 2 if any benchmark regressed\n"
+              << "  --threshold PCT: Smallest change flagged by --compare (default 2)\n"
+              << "  --memory [MAX] : Instead, measure peak RSS and heap of the DOM and streaming\n"
+              << "                   paths on generated inputs from 1K up to MAX (default 64M)\n"
+              << "  --shapes [SIZE]: Instead, sweep depth, fanout, attributes, text length,\n"
+              << "                   distinct names and blob size one at a time on SIZE byte\n"
+              << "                   documents (default 1M) and report MB/s per dimension\n"
+              << "  --startup [DIR]: Instead, time exec to exit of abx2xml, xml2abx and abxtool\n"
+              << "                   from DIR (default: abxbench's directory) on a 2K file\n"
+              << "  --runs N       : Runs per command for --startup (default 200)\n";
+}
+
+int main(int argc, char* argv[]) {
+    BenchOptions options;
+    bool use_perf = false;
+    int trials = 0;
+    std::string save_path;
+    std::string compare_path;
+    double threshold = 2;
+    uint64_t memory_max = 0;
+    uint64_t shape_size = 0;
+    bool startup = false;
+    std::string startup_dir;
+    int startup_runs = 200;
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--elements" && i + 1 < argc) {
+                options.elements = std::stoul(argv[++i]);
+            } else if (arg == "--min-time" && i + 1 < argc) {
+                options.min_time_ms = std::stoi(argv[++i]);
+            } else if (arg == "--filter" && i + 1 < argc) {
+                options.filter = argv[++i];
+            } else if (arg == "--perf") {
+                use_perf = true;
+            } else if (arg == "--trials" && i + 1 < argc) {
+                trials = std::stoi(argv[++i]);
+            } else if (arg == "--save" && i + 1 < argc) {
+                save_path = argv[++i];
+            } else if (arg == "--compare" && i + 1 < argc) {
+                compare_path = argv[++i];
+            } else if (arg == "--threshold" && i + 1 < argc) {
+                threshold = std::stod(argv[++i]);
+            } else if (arg == "--shapes") {
+                shape_size = i + 1 < argc && argv[i + 1][0] != '-' ? parse_size(argv[++i]) : 1 << 20;
+            } else if (arg == "--startup") {
+                startup = true;
+                if (i + 1 < argc && argv[i + 1][0] != '-')
+                    startup_dir = argv[++i];
+            } else if (arg == "--runs" && i + 1 < argc) {
+                startup_runs = std::stoi(argv[++i]);
+            } else if (arg == "--memory") {
+                memory_max = i + 1 < argc && argv[i + 1][0] != '-' ? parse_size(argv[++i]) : 64 << 20;
+            } else {
+                print_bench_usage();
+                return 1;
+            }
+        }
+        std::unique_ptr<PerfCounters> counters;
+        if (use_perf) {
+            counters.reset(new PerfCounters());
+            if (counters->available())
+                options.counters = counters.get();
+            else
+                std::cerr << "Hardware counters unavailable: " << counters->error() << std::endl;
+        }
+        if (startup) {
+            if (startup_dir.empty()) {
+                char self[PATH_MAX];
+                ssize_t length = readlink("/proc/self/exe", self, sizeof(self) - 1);
+                std::string exe = length > 0 ? std::string(self, length) : std::string(argv[0]);
+                size_t slash = exe.rfind('/');
+                startup_dir = slash == std::string::npos ? "." : exe.substr(0, slash);
+            }
+            run_startup_benchmarks(options, startup_dir, std::max(startup_runs, 1));
+            return 0;
+        }
+        if (shape_size) {
+            run_shape_benchmarks(options, shape_size);
+            return 0;
+        }
+        if (memory_max) {
+            run_memory_benchmarks(options, memory_max);
+            return 0;
+        }
+        options.trials = trials > 0 ? trials : (save_path.empty() && compare_path.empty() ? 1 : 10);
+        std::vector<BaselineEntry> baseline;
+        if (!compare_path.empty()) {
+            size_t baseline_elements = 0;
+            baseline = load_baseline(compare_path, baseline_elements);
+            if (baseline_elements != options.elements)
+                std::cerr << "Warning: baseline was measured with --elements " << baseline_elements << std::endl;
+        }
+        std::vector<BenchResult> results = run_benchmarks(options);
+        if (!save_path.empty())
+            save_baseline(save_path, options, results);
+        if (!compare_path.empty()) {
+            std::cout << "\n";
+            if (compare_with_baseline(baseline, results, threshold / 100) > 0)
+                return 2;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -19,6 +19,7 @@ This C++ implementation originates from:
 https://github.com/rhythmcache/android-xml-converter/
 */
 
+#define _FILE_OFFSET_BITS 64
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -34,6 +35,64 @@ https://github.com/rhythmcache/android-xml-converter/
 #include <map>
 #include <unordered_map>
 #include <iomanip>
+#include <cmath>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <malloc.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <csignal>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <chrono>
+#include <atomic>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <linux/perf_event.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#ifdef ABX_WITH_ZLIB
+#include <zlib.h>
+#endif
+// USDT probes under provider "abx" for builds with -DABX_WITH_SDT (needs
+// <sys/sdt.h> from systemtap-sdt-dev). Each site is a single nop until a
+// tracer such as bpftrace attaches, e.g.
+//   bpftrace -e 'usdt:./abxtool:abx:batch_file_end { @[arg1] = count(); }'
+// Probes: reader_document_start, reader_token(xml_type, data_type),
+// reader_intern(table_size, length), reader_document_end(table_size), the
+// writer_* equivalents, flush(path, bytes or sync), batch_flush(files) and
+// batch_file_start(path) / batch_file_end(path, 0 converted, 1 failed,
+// 2 skipped). Without the flag the arguments are not evaluated.
+#ifdef ABX_WITH_SDT
+#include <sys/sdt.h>
+#define ABX_PROBE0(name) DTRACE_PROBE(abx, name)
+#define ABX_PROBE1(name, a) DTRACE_PROBE1(abx, name, a)
+#define ABX_PROBE2(name, a, b) DTRACE_PROBE2(abx, name, a, b)
+#else
+#define ABX_PROBE0(name) ((void)0)
+#define ABX_PROBE1(name, a) ((void)0)
+#define ABX_PROBE2(name, a, b) ((void)0)
+#endif
 class AbxReader;
 class AbxWriter;
 class XmlParser;
@@ -61,6 +120,14 @@ enum class DataType : uint8_t {
     TYPE_BOOLEAN_TRUE = 12 << 4,
     TYPE_BOOLEAN_FALSE = 13 << 4
 };
+// Names of the token nibbles, for statistics reports.
+const char* const XML_TYPE_NAMES[16] = {
+    "start_document", "end_document", "start_tag", "end_tag", "text", "cdsect", "entity_ref",
+    "ignorable_whitespace", "processing_instruction", "comment", "docdecl", "type_11", "type_12",
+    "type_13", "type_14", "attribute"};
+const char* const DATA_TYPE_NAMES[16] = {
+    "none", "null", "string", "string_interned", "bytes_hex", "bytes_base64", "int", "int_hex",
+    "long", "long_hex", "float", "double", "boolean_true", "boolean_false", "type_14", "type_15"};
 std::string base64_encode(const unsigned char* data, size_t len) {
     static const char base64_chars[] =
         "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
@@ -103,9 +170,614 @@ class AbxDecodeError : public std::runtime_error {
 public:
     explicit AbxDecodeError(const std::string& msg) : std::runtime_error(msg) {}
 };
+#ifdef ABX_ALLOC_STATS
+// Heap accounting for builds with -DABX_ALLOC_STATS. The replaced global
+// operator new below charges each allocation to the calling thread's current
+// phase, which PhaseProfile::begin() sets; live bytes are tracked with
+// malloc_usable_size() for the high-water mark.
+class AllocationStats {
+public:
+    static constexpr int MAX_PHASES = 32;
+    struct Counters {
+        std::atomic<uint64_t> allocations{0};
+        std::atomic<uint64_t> bytes{0};
+    };
+    static int phase_index(const std::string& name) {
+        std::lock_guard<std::mutex> lock(names_mutex());
+        auto& names = phase_names();
+        for (size_t i = 0; i < names.size(); ++i) {
+            if (names[i] == name)
+                return static_cast<int>(i);
+        }
+        if (names.size() == MAX_PHASES)
+            return 0;
+        names.push_back(name);
+        return static_cast<int>(names.size() - 1);
+    }
+    static int enter(int index) {
+        int previous = current_phase;
+        current_phase = index;
+        return previous;
+    }
+    static void record_allocation(void* ptr, size_t size) {
+        Counters& counters = phase_counters()[current_phase];
+        counters.allocations.fetch_add(1, std::memory_order_relaxed);
+        counters.bytes.fetch_add(size, std::memory_order_relaxed);
+        uint64_t live = live_bytes().fetch_add(malloc_usable_size(ptr), std::memory_order_relaxed) + malloc_usable_size(ptr);
+        uint64_t peak = peak_bytes().load(std::memory_order_relaxed);
+        while (live > peak && !peak_bytes().compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+        }
+    }
+    static void record_free(void* ptr) {
+        live_bytes().fetch_sub(malloc_usable_size(ptr), std::memory_order_relaxed);
+    }
+    static uint64_t total_allocations() {
+        uint64_t total = 0;
+        for (int i = 0; i < MAX_PHASES; ++i)
+            total += phase_counters()[i].allocations.load(std::memory_order_relaxed);
+        return total;
+    }
+    static uint64_t peak() {
+        return peak_bytes().load(std::memory_order_relaxed);
+    }
+    // Restarts the high-water mark from the current live size.
+    static void reset_peak() {
+        peak_bytes().store(live_bytes().load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    // Allocations, bytes and allocations per input byte for every phase that
+    // allocated, then the peak live heap.
+    static void report(std::ostream& out, uint64_t input_bytes, bool json) {
+        std::vector<std::string> names;
+        {
+            std::lock_guard<std::mutex> lock(names_mutex());
+            names = phase_names();
+        }
+        double per = input_bytes ? 1.0 / input_bytes : 0;
+        std::ostringstream text;
+        uint64_t total_count = 0;
+        uint64_t total_bytes = 0;
+        if (json)
+            text << "{\"input_bytes\":" << input_bytes << ",\"phases\":[";
+        else
+            text << std::left << std::setw(10) << "phase" << std::right << std::setw(12) << "allocs"
+                 << std::setw(14) << "bytes" << std::setw(14) << "allocs/byte" << "\n";
+        bool first = true;
+        for (size_t i = 0; i < names.size(); ++i) {
+            uint64_t count = phase_counters()[i].allocations.load(std::memory_order_relaxed);
+            uint64_t bytes = phase_counters()[i].bytes.load(std::memory_order_relaxed);
+            if (count == 0)
+                continue;
+            total_count += count;
+            total_bytes += bytes;
+            if (json) {
+                text << (first ? "" : ",") << "{\"name\":\"" << names[i] << "\",\"allocations\":" << count
+                     << ",\"bytes\":" << bytes << ",\"allocations_per_byte\":" << count * per << "}";
+            } else {
+                text << std::left << std::setw(10) << names[i] << std::right << std::setw(12) << count
+                     << std::setw(14) << bytes << std::setw(14) << std::fixed << std::setprecision(6) << count * per << "\n";
+            }
+            first = false;
+        }
+        if (json) {
+            text << "],\"allocations\":" << total_count << ",\"bytes\":" << total_bytes
+                 << ",\"allocations_per_byte\":" << total_count * per << ",\"peak_live_bytes\":" << peak() << "}\n";
+        } else {
+            text << std::left << std::setw(10) << "total" << std::right << std::setw(12) << total_count
+                 << std::setw(14) << total_bytes << std::setw(14) << std::fixed << std::setprecision(6) << total_count * per << "\n"
+                 << "peak live heap: " << peak() << " bytes\n";
+        }
+        out << text.str() << std::flush;
+    }
+private:
+    static thread_local int current_phase;
+    // Function-local statics so counting works for allocations made before main().
+    static Counters* phase_counters() {
+        static Counters counters[MAX_PHASES];
+        return counters;
+    }
+    static std::vector<std::string>& phase_names() {
+        static std::vector<std::string>* names = new std::vector<std::string>{"other"};
+        return *names;
+    }
+    static std::mutex& names_mutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+    static std::atomic<uint64_t>& live_bytes() {
+        static std::atomic<uint64_t> live(0);
+        return live;
+    }
+    static std::atomic<uint64_t>& peak_bytes() {
+        static std::atomic<uint64_t> peak(0);
+        return peak;
+    }
+};
+thread_local int AllocationStats::current_phase = 0;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void* operator new(size_t size) {
+    void* ptr = malloc(size ? size : 1);
+    if (!ptr)
+        throw std::bad_alloc();
+    AllocationStats::record_allocation(ptr, size);
+    return ptr;
+}
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+void operator delete(void* ptr) noexcept {
+    if (!ptr)
+        return;
+    AllocationStats::record_free(ptr);
+    free(ptr);
+}
+void operator delete[](void* ptr) noexcept {
+    operator delete(ptr);
+}
+void operator delete(void* ptr, size_t) noexcept {
+    operator delete(ptr);
+}
+void operator delete[](void* ptr, size_t) noexcept {
+    operator delete(ptr);
+}
+#pragma GCC diagnostic pop
+#endif
+int allocation_phase_index(const std::string& name) {
+#ifdef ABX_ALLOC_STATS
+    return AllocationStats::phase_index(name);
+#else
+    (void)name;
+    return 0;
+#endif
+}
+// Charges allocations on this thread to a phase until destroyed. Compiles to
+// nothing without ABX_ALLOC_STATS.
+class AllocationPhase {
+public:
+#ifdef ABX_ALLOC_STATS
+    explicit AllocationPhase(int index) : previous(AllocationStats::enter(index)) {}
+    ~AllocationPhase() {
+        AllocationStats::enter(previous);
+    }
+private:
+    int previous;
+#else
+    explicit AllocationPhase(int) {}
+#endif
+};
+// Per-token-type counts, bytes and cycles of AbxReader::read_events and the
+// AbxWriter write_* methods, for builds with -DABX_TOKEN_STATS. TokenTimer is
+// selected by the TOKEN_STATS constant; its disabled form is empty, so the
+// instrumented functions compile to the same code as without it. Counters
+// are plain globals: they are meant for one conversion at a time, and a
+// pipelined decode thread is joined before they are read.
+#ifdef ABX_TOKEN_STATS
+constexpr bool TOKEN_STATS = true;
+#else
+constexpr bool TOKEN_STATS = false;
+#endif
+inline uint64_t cycle_count() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+struct TokenStats {
+    enum Side { READ, WRITE };
+    struct Counter {
+        uint64_t tokens = 0;
+        uint64_t bytes = 0;
+        uint64_t cycles = 0;
+    };
+    // Indexed by side, then by the token byte (XmlType | DataType).
+    static Counter (&counters())[2][256] {
+        static Counter table[2][256];
+        return table;
+    }
+    static void record(Side side, uint8_t token, uint64_t bytes, uint64_t cycles) {
+        Counter& counter = counters()[side][token];
+        counter.tokens++;
+        counter.bytes += bytes;
+        counter.cycles += cycles;
+    }
+    static void report(std::ostream& out) {
+        std::ostringstream text;
+        text << std::fixed << std::setprecision(1);
+        for (int side = READ; side <= WRITE; ++side) {
+            uint64_t total_cycles = 0;
+            std::vector<std::pair<uint8_t, Counter>> rows;
+            for (int token = 0; token < 256; ++token) {
+                const Counter& counter = counters()[side][token];
+                if (counter.tokens) {
+                    rows.emplace_back(static_cast<uint8_t>(token), counter);
+                    total_cycles += counter.cycles;
+                }
+            }
+            if (rows.empty())
+                continue;
+            std::sort(rows.begin(), rows.end(), [](const std::pair<uint8_t, Counter>& a,
+                                                   const std::pair<uint8_t, Counter>& b) {
+                return a.second.cycles > b.second.cycles;
+            });
+            text << (side == READ ? "read" : "write") << "\n"
+                 << std::left << std::setw(40) << "token" << std::right << std::setw(12) << "count"
+                 << std::setw(14) << "bytes" << std::setw(16) << "cycles" << std::setw(14) << "cycles/token"
+                 << std::setw(9) << "cycles%" << "\n";
+            for (const auto& row : rows) {
+                std::string name = std::string(XML_TYPE_NAMES[row.first & 0x0f]) + "/" + DATA_TYPE_NAMES[row.first >> 4];
+                text << std::left << std::setw(40) << name << std::right << std::setw(12) << row.second.tokens
+                     << std::setw(14) << row.second.bytes << std::setw(16) << row.second.cycles
+                     << std::setw(14) << static_cast<double>(row.second.cycles) / row.second.tokens
+                     << std::setw(9) << (total_cycles ? row.second.cycles * 100.0 / total_cycles : 0) << "\n";
+            }
+        }
+        out << text.str() << std::flush;
+    }
+};
+// Times one token from construction to destruction and charges it, with the
+// bytes the stream advanced by, to the token set by set_token(). Streams that
+// cannot report their position (gzip) count no bytes.
+template <bool Enabled, typename Stream>
+class [[maybe_unused]] TokenTimer {
+public:
+    TokenTimer(TokenStats::Side, Stream&) {}
+    void set_token(uint8_t) {}
+};
+template <typename Stream>
+class TokenTimer<true, Stream> {
+public:
+    TokenTimer(TokenStats::Side side, Stream& stream)
+        : side(side), stream(stream), start_position(position()), start_cycles(cycle_count()) {}
+    TokenTimer(const TokenTimer&) = delete;
+    TokenTimer& operator=(const TokenTimer&) = delete;
+    ~TokenTimer() {
+        uint64_t cycles = cycle_count() - start_cycles;
+        int64_t end_position = position();
+        uint64_t bytes = start_position >= 0 && end_position >= start_position ? end_position - start_position : 0;
+        TokenStats::record(side, token, bytes, cycles);
+    }
+    void set_token(uint8_t value) {
+        token = value;
+    }
+private:
+    TokenStats::Side side;
+    Stream& stream;
+    uint8_t token = 0;
+    int64_t start_position;
+    uint64_t start_cycles;
+    int64_t position() {
+        // tellg/tellp fail once the stream hit EOF; that must not leak into the conversion.
+        std::ios_base::iostate state = stream.rdstate();
+        if (state != std::ios_base::goodbit)
+            return -1;
+        return static_cast<int64_t>(position_of(stream));
+    }
+    static std::streamoff position_of(std::istream& in) {
+        return in.tellg();
+    }
+    static std::streamoff position_of(std::ostream& out) {
+        return out.tellp();
+    }
+};
+// Escapes a string for inclusion in a JSON string literal.
+std::string json_escape(const std::string& text) {
+    std::string out;
+    out.reserve(text.size());
+    for (unsigned char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += static_cast<char>(c);
+        } else if (c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        } else {
+            out += static_cast<char>(c);
+        }
+    }
+    return out;
+}
+// Chrome trace-event recorder for --trace. Each thread appends complete ("X")
+// events to its own buffer without locking; the buffers are never freed, so
+// they outlive their threads and are written out by an atexit handler.
+class Trace {
+public:
+    static void enable(const std::string& path) {
+        output_path() = path;
+        epoch();
+        if (!enabled_flag().exchange(true))
+            atexit(write_at_exit);
+    }
+    static bool enabled() {
+        return enabled_flag().load(std::memory_order_relaxed);
+    }
+    // Microseconds since tracing was enabled.
+    static double now() {
+        return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - epoch()).count();
+    }
+    static void name_thread(const std::string& name) {
+        if (enabled())
+            buffer().name = name;
+    }
+    static void complete(const char* category, const std::string& name, double start, double end, const std::string& detail = "") {
+        if (enabled())
+            buffer().events.push_back({category, name, detail, start, end - start});
+    }
+    static bool write(const std::string& path) {
+        std::ofstream out(path, std::ios::trunc);
+        int pid = getpid();
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        bool first = true;
+        std::lock_guard<std::mutex> lock(buffers_mutex());
+        for (const auto& thread : buffers()) {
+            if (!thread->name.empty()) {
+                out << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid
+                    << ",\"tid\":" << thread->tid << ",\"args\":{\"name\":\"" << json_escape(thread->name) << "\"}}";
+                first = false;
+            }
+            for (const auto& event : thread->events) {
+                out << (first ? "" : ",") << "\n{\"name\":\"" << json_escape(event.name) << "\",\"cat\":\"" << event.category
+                    << "\",\"ph\":\"X\",\"ts\":" << std::fixed << std::setprecision(3) << event.start
+                    << ",\"dur\":" << event.duration << ",\"pid\":" << pid << ",\"tid\":" << thread->tid;
+                if (!event.detail.empty())
+                    out << ",\"args\":{\"detail\":\"" << json_escape(event.detail) << "\"}";
+                out << "}";
+                first = false;
+            }
+        }
+        out << "\n]}\n";
+        return static_cast<bool>(out.flush());
+    }
+private:
+    struct Event {
+        const char* category;
+        std::string name;
+        std::string detail;
+        double start;
+        double duration;
+    };
+    struct ThreadBuffer {
+        int tid;
+        std::string name;
+        std::vector<Event> events;
+    };
+    static ThreadBuffer& buffer() {
+        thread_local ThreadBuffer* local = nullptr;
+        if (!local) {
+            std::lock_guard<std::mutex> lock(buffers_mutex());
+            buffers().emplace_back(new ThreadBuffer{static_cast<int>(buffers().size() + 1), "", {}});
+            local = buffers().back();
+        }
+        return *local;
+    }
+    static std::vector<ThreadBuffer*>& buffers() {
+        static auto* all = new std::vector<ThreadBuffer*>();
+        return *all;
+    }
+    static std::mutex& buffers_mutex() {
+        static auto* mutex = new std::mutex();
+        return *mutex;
+    }
+    static std::atomic<bool>& enabled_flag() {
+        static std::atomic<bool> flag(false);
+        return flag;
+    }
+    static std::string& output_path() {
+        static auto* path = new std::string();
+        return *path;
+    }
+    static std::chrono::steady_clock::time_point epoch() {
+        static const auto start = std::chrono::steady_clock::now();
+        return start;
+    }
+    static void write_at_exit() {
+        if (!write(output_path()))
+            std::cerr << "Error: Could not write trace to " << output_path() << std::endl;
+    }
+};
+// Records a trace span from construction to destruction when tracing is on.
+class TraceSpan {
+public:
+    TraceSpan(const char* category, const std::string& name, const std::string& detail = "")
+        : active(Trace::enabled()), category(category) {
+        if (active) {
+            this->name = name;
+            this->detail = detail;
+            start = Trace::now();
+        }
+    }
+    ~TraceSpan() {
+        end();
+    }
+    // Ends the span before the end of its scope.
+    void end() {
+        if (active)
+            Trace::complete(category, name, start, Trace::now(), detail);
+        active = false;
+    }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+private:
+    bool active;
+    const char* category;
+    std::string name;
+    std::string detail;
+    double start = 0;
+};
+// Wall-clock time spent in each phase of a conversion, for --profile. With
+// --trace each phase is also recorded as a trace span.
+// begin() closes the running phase; a phase entered again accumulates.
+class PhaseProfile {
+public:
+    void begin(const std::string& phase) {
+        end();
+        current = phase;
+#ifdef ABX_ALLOC_STATS
+        AllocationStats::enter(AllocationStats::phase_index(phase));
+#endif
+        trace_start = Trace::enabled() ? Trace::now() : 0;
+        started = std::chrono::steady_clock::now();
+    }
+    void end() {
+        if (current.empty())
+            return;
+        add(current, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count());
+        Trace::complete("phase", current, trace_start, Trace::now());
+        current.clear();
+#ifdef ABX_ALLOC_STATS
+        AllocationStats::enter(0);
+#endif
+    }
+    void add(const std::string& phase, double ms) {
+        for (auto& entry : phases) {
+            if (entry.first == phase) {
+                entry.second += ms;
+                return;
+            }
+        }
+        phases.emplace_back(phase, ms);
+    }
+    const std::vector<std::pair<std::string, double>>& totals() {
+        end();
+        return phases;
+    }
+    void report(std::ostream& out, bool json) {
+        end();
+        double total = 0;
+        for (const auto& entry : phases)
+            total += entry.second;
+        std::ostringstream text;
+        text << std::fixed << std::setprecision(3);
+        if (json) {
+            text << "{\"unit\":\"ms\",\"phases\":[";
+            for (size_t i = 0; i < phases.size(); ++i)
+                text << (i ? "," : "") << "{\"name\":\"" << phases[i].first << "\",\"ms\":" << phases[i].second << "}";
+            text << "],\"total_ms\":" << total << "}\n";
+        } else {
+            for (const auto& entry : phases)
+                text << std::left << std::setw(10) << entry.first << std::right << std::setw(12) << entry.second
+                     << " ms " << std::setw(6) << std::setprecision(1)
+                     << (total > 0 ? entry.second * 100 / total : 0) << "%\n" << std::setprecision(3);
+            text << std::left << std::setw(10) << "total" << std::right << std::setw(12) << total << " ms\n";
+        }
+        out << text.str() << std::flush;
+    }
+private:
+    std::vector<std::pair<std::string, double>> phases;
+    std::string current;
+    std::chrono::steady_clock::time_point started;
+    double trace_start = 0;
+};
+// Builds the XMLElement tree from AbxReader events.
+struct DomBuilder {
+    std::shared_ptr<XMLElement> root;
+    std::vector<std::shared_ptr<XMLElement>> element_stack;
+    void start_tag(const std::string& name) {
+        auto element = std::make_shared<XMLElement>(name);
+        if (element_stack.empty())
+            root = element;
+        else
+            element_stack.back()->add_child(element);
+        element_stack.push_back(element);
+    }
+    void end_tag() {
+        element_stack.pop_back();
+    }
+    void text(const std::string& value) {
+        if (element_stack.back()->text.empty())
+            element_stack.back()->text = value;
+        else
+            element_stack.back()->text += value;
+    }
+    void attribute(const std::string& name, const std::string& value) {
+        element_stack.back()->attrib[name] = value;
+    }
+};
+// DomBuilder that also totals the time spent in its callbacks, so --profile can
+// split DOM construction from decoding. The clock reads add to the DOM share.
+// Allocation accounting builds charge the callbacks' allocations to "dom".
+struct TimedDomBuilder : DomBuilder {
+    double seconds = 0;
+    const int dom_phase = allocation_phase_index("dom");
+    void start_tag(const std::string& name) {
+        AllocationPhase phase(dom_phase);
+        auto start = std::chrono::steady_clock::now();
+        DomBuilder::start_tag(name);
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    void end_tag() {
+        AllocationPhase phase(dom_phase);
+        auto start = std::chrono::steady_clock::now();
+        DomBuilder::end_tag();
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    void text(const std::string& value) {
+        AllocationPhase phase(dom_phase);
+        auto start = std::chrono::steady_clock::now();
+        DomBuilder::text(value);
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    void attribute(const std::string& name, const std::string& value) {
+        AllocationPhase phase(dom_phase);
+        auto start = std::chrono::steady_clock::now();
+        DomBuilder::attribute(name, value);
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+};
+// Counts AbxReader events without keeping them.
+struct TokenCounter {
+    uint64_t tokens = 0;
+    void start_tag(const std::string&) {
+        ++tokens;
+    }
+    void end_tag() {
+        ++tokens;
+    }
+    void text(const std::string&) {
+        ++tokens;
+    }
+    void attribute(const std::string&, const std::string&) {
+        ++tokens;
+    }
+};
+// Read-only streambuf over a caller-owned buffer, so already loaded input can be
+// decoded without another copy.
+class MemoryStreamBuf : public std::streambuf {
+public:
+    MemoryStreamBuf(const char* data, size_t size) {
+        char* begin = const_cast<char*>(data);
+        setg(begin, begin, begin + size);
+    }
+protected:
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override {
+        if (!(which & std::ios_base::in))
+            return pos_type(off_type(-1));
+        off_type base = 0;
+        if (dir == std::ios_base::cur)
+            base = gptr() - eback();
+        else if (dir == std::ios_base::end)
+            base = egptr() - eback();
+        off_type target = base + off;
+        if (target < 0 || target > egptr() - eback())
+            return pos_type(off_type(-1));
+        setg(eback(), eback() + target, egptr());
+        return pos_type(target);
+    }
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+        return seekoff(off_type(pos), std::ios_base::beg, which);
+    }
+};
 class AbxReader {
 private:
-    std::ifstream stream;
+    std::unique_ptr<std::streambuf> owned_buffer;
+    std::unique_ptr<std::istream> owned_stream;
+    std::istream& stream;
     std::vector<std::string> interned_strings;
     static constexpr char MAGIC[] = "ABX\0";
     uint8_t read_byte() {
@@ -139,17 +811,21 @@ private:
         return __builtin_bswap64(val);
     }
     float read_float() {
-        float val;
-        if (!stream.read(reinterpret_cast<char*>(&val), 4))
+        uint32_t bits;
+        if (!stream.read(reinterpret_cast<char*>(&bits), 4))
             throw std::runtime_error("Could not read float");
-        val = __builtin_bswap32(*reinterpret_cast<int32_t*>(&val));
+        bits = __builtin_bswap32(bits);
+        float val;
+        memcpy(&val, &bits, 4);
         return val;
     }
     double read_double() {
-        double val;
-        if (!stream.read(reinterpret_cast<char*>(&val), 8))
+        uint64_t bits;
+        if (!stream.read(reinterpret_cast<char*>(&bits), 8))
             throw std::runtime_error("Could not read double");
-        val = __builtin_bswap64(*reinterpret_cast<int64_t*>(&val));
+        bits = __builtin_bswap64(bits);
+        double val;
+        memcpy(&val, &bits, 8);
         return val;
     }
     std::string read_string_raw() {
@@ -164,8 +840,11 @@ private:
         if (reference == -1) {
             std::string value = read_string_raw();
             interned_strings.push_back(value);
+            ABX_PROBE2(reader_intern, interned_strings.size(), value.size());
             return value;
         }
+        if (reference < 0 || static_cast<size_t>(reference) >= interned_strings.size())
+            throw AbxDecodeError("Invalid interned string reference");
         return interned_strings[reference];
     }
     void skip_header_extension() {
@@ -211,34 +890,58 @@ private:
         }
     }
 public:
-    explicit AbxReader(const std::string& filename) {
-        stream.open(filename, std::ios::binary);
+    explicit AbxReader(const std::string& filename)
+        : owned_stream(new std::ifstream(filename, std::ios::binary)), stream(*owned_stream) {
         if (!stream)
             throw std::runtime_error("Could not open file");
     }
-    std::shared_ptr<XMLElement> read(bool is_multi_root = false) {
+    AbxReader(const char* data, size_t size)
+        : owned_buffer(new MemoryStreamBuf(data, size)),
+          owned_stream(new std::istream(owned_buffer.get())), stream(*owned_stream) {}
+    explicit AbxReader(std::istream& input) : stream(input) {}
+    // Offset just past the last byte consumed, e.g. the END_DOCUMENT token.
+    uint64_t position() {
+        return static_cast<uint64_t>(stream.tellg());
+    }
+    // Checks the magic number and skips any header extension, returning the
+    // offset of the first document token, for scanners that walk the raw
+    // tokens themselves.
+    uint64_t skip_header() {
         char magic_check[4];
         if (!stream.read(magic_check, 4) || memcmp(magic_check, MAGIC, 4) != 0)
             throw AbxDecodeError("Invalid magic number");
         skip_header_extension();
-        bool document_opened = true;
-        bool root_closed = false;
-        std::vector<std::shared_ptr<XMLElement>> element_stack;
-        std::shared_ptr<XMLElement> root;
+        return position();
+    }
+    // Decodes the document and reports it to handler as start_tag(name),
+    // attribute(name, value), text(value) and end_tag() calls. With multi-root
+    // processing the handler first sees a synthetic "root" element that stays open.
+    template <typename Handler>
+    void read_events(Handler& handler, bool is_multi_root = false) {
+        char magic_check[4];
+        if (!stream.read(magic_check, 4) || memcmp(magic_check, MAGIC, 4) != 0)
+            throw AbxDecodeError("Invalid magic number");
+        skip_header_extension();
+        ABX_PROBE0(reader_document_start);
+        std::vector<std::string> element_stack;
+        bool has_root = false;
         if (is_multi_root) {
-            root = std::make_shared<XMLElement>("root");
-            element_stack.push_back(root);
+            handler.start_tag("root");
+            element_stack.push_back("root");
+            has_root = true;
         }
         while (true) {
             if (stream.eof())
                 break;
+            TokenTimer<TOKEN_STATS, std::istream> timer(TokenStats::READ, stream);
             uint8_t token = read_byte();
+            timer.set_token(token);
             uint8_t xml_type = token & 0x0f;
             uint8_t data_type = token & 0xf0;
+            ABX_PROBE2(reader_token, xml_type, data_type);
             if (xml_type == static_cast<uint8_t>(XmlType::START_DOCUMENT)) {
                 if (data_type != static_cast<uint8_t>(DataType::TYPE_NULL))
                     throw AbxDecodeError("Invalid START_DOCUMENT data type");
-                document_opened = true;
             }
             else if (xml_type == static_cast<uint8_t>(XmlType::END_DOCUMENT)) {
                 if (data_type != static_cast<uint8_t>(DataType::TYPE_NULL))
@@ -251,14 +954,9 @@ public:
                 if (data_type != static_cast<uint8_t>(DataType::TYPE_STRING_INTERNED))
                     throw AbxDecodeError("Invalid START_TAG data type");
                 std::string tag_name = read_interned_string();
-                auto element = std::make_shared<XMLElement>(tag_name);
-                if (element_stack.empty()) {
-                    root = element;
-                    element_stack.push_back(element);
-                } else {
-                    element_stack.back()->add_child(element);
-                    element_stack.push_back(element);
-                }
+                handler.start_tag(tag_name);
+                element_stack.push_back(std::move(tag_name));
+                has_root = true;
             }
             else if (xml_type == static_cast<uint8_t>(XmlType::END_TAG)) {
                 if (data_type != static_cast<uint8_t>(DataType::TYPE_STRING_INTERNED))
@@ -266,11 +964,10 @@ public:
                 if (element_stack.empty() || (is_multi_root && element_stack.size() == 1))
                     throw AbxDecodeError("Unexpected END_TAG");
                 std::string tag_name = read_interned_string();
-                if (element_stack.back()->tag != tag_name)
+                if (element_stack.back() != tag_name)
                     throw AbxDecodeError("Mismatched END_TAG");
+                handler.end_tag();
                 element_stack.pop_back();
-                if (element_stack.empty())
-                    root_closed = true;
             }
             else if (xml_type == static_cast<uint8_t>(XmlType::TEXT)) {
                 std::string value = read_string_raw();
@@ -278,10 +975,7 @@ public:
                     continue;
                 if (element_stack.empty())
                     throw AbxDecodeError("Unexpected TEXT outside of element");
-                if (element_stack.back()->text.empty())
-                    element_stack.back()->text = value;
-                else
-                    element_stack.back()->text += value;
+                handler.text(value);
             }
             else if (xml_type == static_cast<uint8_t>(XmlType::ATTRIBUTE)) {
                 if (element_stack.empty() || (is_multi_root && element_stack.size() == 1))
@@ -350,7 +1044,7 @@ public:
                     default:
                         throw AbxDecodeError("Unexpected attribute data type");
                 }
-                element_stack.back()->attrib[attribute_name] = value;
+                handler.attribute(attribute_name, value);
             }
             else {
                 if (data_type != 0) {
@@ -368,32 +1062,40 @@ public:
                 }
             }
         }
-        if (!root)
+        if (!has_root)
             throw AbxDecodeError("No root element found");
-        return root;
+        ABX_PROBE1(reader_document_end, interned_strings.size());
+    }
+    std::shared_ptr<XMLElement> read(bool is_multi_root = false) {
+        DomBuilder builder;
+        read_events(builder, is_multi_root);
+        return builder.root;
     }
     void print_xml(const std::shared_ptr<XMLElement>& element, int indent = 0) {
+        print_xml(std::cout, element, indent);
+    }
+    void print_xml(std::ostream& out, const std::shared_ptr<XMLElement>& element, int indent = 0) {
         if (indent == 0) {
-            std::cout << "<?xml version='1.0' encoding='UTF-8' standalone='yes' ?>\n";
+            out << "<?xml version='1.0' encoding='UTF-8' standalone='yes' ?>\n";
         }
         std::string indentation(indent, ' ');
-        std::cout << indentation << "<" << element->tag;
+        out << indentation << "<" << element->tag;
         for (const auto& [key, value] : element->attrib)
-            std::cout << " " << key << "=\"" << value << "\"";
+            out << " " << key << "=\"" << value << "\"";
         if (element->children.empty() && element->text.empty()) {
-            std::cout << "/>" << std::endl;
+            out << "/>\n";
             return;
         }
-        std::cout << ">";
+        out << ">";
         if (!element->text.empty())
-            std::cout << element->text;
+            out << element->text;
         if (!element->children.empty()) {
-            std::cout << std::endl;
+            out << '\n';
             for (const auto& child : element->children)
-                print_xml(child, indent + 2);
-            std::cout << indentation;
+                print_xml(out, child, indent + 2);
+            out << indentation;
         }
-        std::cout << "</" << element->tag << ">" << std::endl;
+        out << "</" << element->tag << ">\n";
     }
 };
 class XmlParser {
@@ -516,9 +1218,9 @@ private:
 public:
     XmlNode parse(const std::string& xml) {
         xml_content = xml;
-        pos = 0;
-        if (xml_content.substr(0, 5) == "<?xml") {
-            size_t decl_end = xml_content.find("?>", 5);
+        pos = xml_content.compare(0, 3, "\xEF\xBB\xBF") == 0 ? 3 : 0;
+        if (xml_content.compare(pos, 5, "<?xml") == 0) {
+            size_t decl_end = xml_content.find("?>", pos + 5);
             if (decl_end != std::string::npos)
                 pos = decl_end + 2;
         }
@@ -527,41 +1229,113 @@ public:
 };
 class AbxWriter {
 public:
-    AbxWriter(const std::string& output_path) : output_stream(output_path, std::ios::binary) {
+    AbxWriter(const std::string& output_path)
+        : owned_stream(new std::ofstream(output_path, std::ios::binary)), output_stream(*owned_stream) {
         if (!output_stream) {
             throw std::runtime_error("Could not open output file");
         }
         const char magic[] = "ABX\0";
         output_stream.write(magic, 4);
     }
+    explicit AbxWriter(std::ostream& out) : output_stream(out) {
+        const char magic[] = "ABX\0";
+        output_stream.write(magic, 4);
+    }
     void write_start_document() {
-        write_token(XmlType::START_DOCUMENT, DataType::TYPE_NULL);
+        ABX_PROBE0(writer_document_start);
+        TokenTimer<TOKEN_STATS, std::ostream> timer(TokenStats::WRITE, output_stream);
+        write_token(XmlType::START_DOCUMENT, DataType::TYPE_NULL, timer);
     }
     void write_end_document() {
-        write_token(XmlType::END_DOCUMENT, DataType::TYPE_NULL);
+        TokenTimer<TOKEN_STATS, std::ostream> timer(TokenStats::WRITE, output_stream);
+        write_token(XmlType::END_DOCUMENT, DataType::TYPE_NULL, timer);
+        ABX_PROBE1(writer_document_end, interned_strings.size());
     }
     void write_start_tag(const std::string& tag_name) {
-        write_token(XmlType::START_TAG, DataType::TYPE_STRING_INTERNED);
+        TokenTimer<TOKEN_STATS, std::ostream> timer(TokenStats::WRITE, output_stream);
+        write_token(XmlType::START_TAG, DataType::TYPE_STRING_INTERNED, timer);
         write_string_interned(tag_name);
     }
     void write_end_tag(const std::string& tag_name) {
-        write_token(XmlType::END_TAG, DataType::TYPE_STRING_INTERNED);
+        TokenTimer<TOKEN_STATS, std::ostream> timer(TokenStats::WRITE, output_stream);
+        write_token(XmlType::END_TAG, DataType::TYPE_STRING_INTERNED, timer);
         write_string_interned(tag_name);
     }
     void write_attribute(const std::string& name, const std::string& value) {
-        write_token(XmlType::ATTRIBUTE, DataType::TYPE_STRING);
+        TokenTimer<TOKEN_STATS, std::ostream> timer(TokenStats::WRITE, output_stream);
+        write_token(XmlType::ATTRIBUTE, DataType::TYPE_STRING, timer);
         write_string_interned(name);
         write_string(value);
     }
     void write_text(const std::string& text) {
-        write_token(XmlType::TEXT, DataType::TYPE_STRING);
+        TokenTimer<TOKEN_STATS, std::ostream> timer(TokenStats::WRITE, output_stream);
+        write_token(XmlType::TEXT, DataType::TYPE_STRING, timer);
         write_string(text);
     }
+    // Typed attributes, as written by Android's BinaryXmlSerializer.
+    void write_attribute_interned(const std::string& name, const std::string& value) {
+        TokenTimer<TOKEN_STATS, std::ostream> timer(TokenStats::WRITE, output_stream);
+        write_token(XmlType::ATTRIBUTE, DataType::TYPE_STRING_INTERNED, timer);
+        write_string_interned(name);
+        write_string_interned(value);
+    }
+    void write_attribute_null(const std::string& name) {
+        TokenTimer<TOKEN_STATS, std::ostream> timer(TokenStats::WRITE, output_stream);
+        write_token(XmlType::ATTRIBUTE, DataType::TYPE_NULL, timer);
+        write_string_interned(name);
+    }
+    void write_attribute_boolean(const std::string& name, bool value) {
+        TokenTimer<TOKEN_STATS, std::ostream> timer(TokenStats::WRITE, output_stream);
+        write_token(XmlType::ATTRIBUTE, value ? DataType::TYPE_BOOLEAN_TRUE : DataType::TYPE_BOOLEAN_FALSE, timer);
+        write_string_interned(name);
+    }
+    void write_attribute_int(const std::string& name, int32_t value, bool hex = false) {
+        TokenTimer<TOKEN_STATS, std::ostream> timer(TokenStats::WRITE, output_stream);
+        write_token(XmlType::ATTRIBUTE, hex ? DataType::TYPE_INT_HEX : DataType::TYPE_INT, timer);
+        write_string_interned(name);
+        uint32_t be_value = __builtin_bswap32(static_cast<uint32_t>(value));
+        output_stream.write(reinterpret_cast<char*>(&be_value), 4);
+    }
+    void write_attribute_long(const std::string& name, int64_t value, bool hex = false) {
+        TokenTimer<TOKEN_STATS, std::ostream> timer(TokenStats::WRITE, output_stream);
+        write_token(XmlType::ATTRIBUTE, hex ? DataType::TYPE_LONG_HEX : DataType::TYPE_LONG, timer);
+        write_string_interned(name);
+        uint64_t be_value = __builtin_bswap64(static_cast<uint64_t>(value));
+        output_stream.write(reinterpret_cast<char*>(&be_value), 8);
+    }
+    void write_attribute_float(const std::string& name, float value) {
+        TokenTimer<TOKEN_STATS, std::ostream> timer(TokenStats::WRITE, output_stream);
+        write_token(XmlType::ATTRIBUTE, DataType::TYPE_FLOAT, timer);
+        write_string_interned(name);
+        uint32_t bits;
+        memcpy(&bits, &value, 4);
+        bits = __builtin_bswap32(bits);
+        output_stream.write(reinterpret_cast<char*>(&bits), 4);
+    }
+    void write_attribute_double(const std::string& name, double value) {
+        TokenTimer<TOKEN_STATS, std::ostream> timer(TokenStats::WRITE, output_stream);
+        write_token(XmlType::ATTRIBUTE, DataType::TYPE_DOUBLE, timer);
+        write_string_interned(name);
+        uint64_t bits;
+        memcpy(&bits, &value, 8);
+        bits = __builtin_bswap64(bits);
+        output_stream.write(reinterpret_cast<char*>(&bits), 8);
+    }
+    void write_attribute_bytes(const std::string& name, const std::string& bytes, bool base64 = false) {
+        TokenTimer<TOKEN_STATS, std::ostream> timer(TokenStats::WRITE, output_stream);
+        write_token(XmlType::ATTRIBUTE, base64 ? DataType::TYPE_BYTES_BASE64 : DataType::TYPE_BYTES_HEX, timer);
+        write_string_interned(name);
+        write_string(bytes);
+    }
 private:
-    std::ofstream output_stream;
+    std::unique_ptr<std::ostream> owned_stream;
+    std::ostream& output_stream;
     std::vector<std::string> interned_strings;
-    void write_token(XmlType xml_type, DataType data_type) {
+    // The caller's timer charges its whole write_* method to this token in
+    // ABX_TOKEN_STATS builds.
+    void write_token(XmlType xml_type, DataType data_type, TokenTimer<TOKEN_STATS, std::ostream>& timer) {
         uint8_t token = static_cast<uint8_t>(xml_type) | static_cast<uint8_t>(data_type);
+        timer.set_token(token);
         output_stream.write(reinterpret_cast<char*>(&token), 1);
     }
     void write_string(const std::string& str) {
@@ -582,6 +1356,7 @@ private:
             output_stream.write(reinterpret_cast<char*>(&be_index), 2);
             write_string(str);
             interned_strings.push_back(str);
+            ABX_PROBE2(writer_intern, interned_strings.size(), str.size());
         }
     }
 };
@@ -606,6 +1381,24 @@ public:
         process_node(writer, root);
         writer.write_end_document();
     }
+    // With a profile, parsing (which builds the node tree), encoding and
+    // freeing the tree are timed as "parse", "encode" and "teardown".
+    static void convert_content(const std::string& xml_content, std::ostream& out, PhaseProfile* profile = nullptr) {
+        if (profile)
+            profile->begin("parse");
+        std::unique_ptr<XmlNode> root(new XmlNode(XmlParser().parse(xml_content)));
+        if (profile)
+            profile->begin("encode");
+        AbxWriter writer(out);
+        writer.write_start_document();
+        process_node(writer, *root);
+        writer.write_end_document();
+        if (profile) {
+            profile->begin("teardown");
+            root.reset();
+            profile->end();
+        }
+    }
 private:
     static std::string read_from_stdin() {
         std::stringstream buffer;
@@ -630,108 +1423,4805 @@ private:
         }
     }
 };
-void print_usage() {
-    std::cerr << "usage: abxtool <command> [options] input [output]\n"
-              << "\n"
-              << "Commands:\n"
-              << "  abx2xml  : Convert Android Binary XML to human-readable XML\n"
-              << "  xml2abx  : Convert human-readable XML to Android Binary XML\n"
-              << "\n"
-              << "Options:\n"
-              << "  -i       : Overwrite input file with output\n"
-              << "  -mr      : Enable Multi-Root Processing (abx2xml only)\n"
-              << "\n"
-              << "Input:\n"
-              << "  Use '-' as input to read from stdin (xml2abx only)\n"
-              << "  When reading from stdin, output path must be specified\n"
-              << "\n"
-              << "Output:\n"
-              << "  Use '-' as output to write to stdout (abx2xml only)\n";
-}
-int main(int argc, char* argv[]) {
-    if (argc < 3) {
-        print_usage();
-        return 1;
+std::string read_input_file(const std::string& path) {
+    if (path == "-") {
+        std::stringstream buffer;
+        buffer << std::cin.rdbuf();
+        return buffer.str();
     }
-    std::string command = argv[1];
-    if (command != "abx2xml" && command != "xml2abx") {
-        std::cerr << "Error: Invalid command. Use 'abx2xml' or 'xml2abx'\n";
-        print_usage();
-        return 1;
+    std::ifstream input_file(path, std::ios::binary | std::ios::ate);
+    if (!input_file) {
+        throw std::runtime_error("Could not open input file");
     }
-    bool is_abx2xml = (command == "abx2xml");
-    std::string input_path;
-    std::string output_path;
-    bool overwrite_input = false;
-    bool multi_root = false;
-    for (int i = 2; i < argc; ++i) {
-        std::string arg = argv[i];
-        if (arg == "-i") {
-            overwrite_input = true;
-        } 
-        else if (arg == "-mr" && is_abx2xml) {
-            multi_root = true;
-        }
-        else if (input_path.empty()) {
-            input_path = arg;
-        } 
-        else if (output_path.empty()) {
-            output_path = arg;
-        } 
-        else {
-            std::cerr << "Error: Too many arguments\n";
-            print_usage();
-            return 1;
+    std::string content(static_cast<size_t>(input_file.tellg()), '\0');
+    input_file.seekg(0);
+    if (!input_file.read(&content[0], content.size())) {
+        throw std::runtime_error("Could not read input file");
+    }
+    return content;
+}
+bool write_all_fd(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
         }
+        data += n;
+        len -= n;
     }
-    if (input_path.empty()) {
-        std::cerr << "Error: Input path is required\n";
-        print_usage();
-        return 1;
+    return true;
+}
+std::string parent_directory(const std::string& path) {
+    size_t slash = path.find_last_of('/');
+    if (slash == std::string::npos)
+        return ".";
+    return slash == 0 ? "/" : path.substr(0, slash);
+}
+void fsync_directory(const std::string& dir) {
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
     }
-    if (input_path == "-" && !is_abx2xml) {
-        if (output_path.empty()) {
-            std::cerr << "Error: Output path is required when reading from stdin\n";
-            return 1;
-        }
-    } else if (overwrite_input) {
-        if (!output_path.empty()) {
-            std::cerr << "Error: Cannot specify output path with -i option\n";
-            return 1;
+}
+// The mode open(O_CREAT, 0666) gives a new file. mkstemp() always creates
+// files 0600, so its callers apply this instead. umask() can only be read by
+// setting it, which would race with other threads creating files, so the
+// mask is taken from /proc where possible and read once.
+mode_t new_file_mode() {
+    static const mode_t mode = [] {
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line)) {
+            if (line.compare(0, 6, "Umask:") == 0)
+                return static_cast<mode_t>(0666 & ~strtoul(line.c_str() + 6, nullptr, 8));
         }
-        output_path = input_path + ".tmp";
-    } else if (output_path.empty()) {
-        output_path = is_abx2xml ? "-" : input_path + ".abx";
+        mode_t mask = umask(0);
+        umask(mask);
+        return static_cast<mode_t>(0666 & ~mask);
+    }();
+    return mode;
+}
+// Replaces a file atomically. Output is written through a single descriptor to
+// an unnamed O_TMPFILE in the target's directory, linked in with linkat() once
+// complete and renamed over the target, so the target is never truncated or
+// missing. Where O_TMPFILE or /proc is unavailable a mkstemp() sibling is used.
+// An uncommitted file leaves no trace.
+class AtomicFile {
+public:
+    explicit AtomicFile(const std::string& target) : target(target) {
+#ifdef O_TMPFILE
+        fd = open(parent_directory(target).c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0666);
+#endif
+        if (fd < 0)
+            fd = create_named_temp();
+        struct stat st;
+        if (stat(target.c_str(), &st) == 0)
+            copy_ownership(fd, st);
     }
-    try {
-        if (is_abx2xml) {
-            AbxReader reader(input_path);
-            auto root = reader.read(multi_root);
-            if (output_path == "-") {
-                reader.print_xml(root);
+    ~AtomicFile() {
+        if (fd >= 0)
+            close(fd);
+        if (!temp_path.empty() && !published)
+            unlink(temp_path.c_str());
+    }
+    AtomicFile(const AtomicFile&) = delete;
+    AtomicFile& operator=(const AtomicFile&) = delete;
+    int descriptor() const {
+        return fd;
+    }
+    const std::string& target_path() const {
+        return target;
+    }
+    void write(const std::string& data) {
+        if (!write_all_fd(fd, data.data(), data.size()))
+            throw std::runtime_error("Could not write '" + target + "': " + strerror(errno));
+    }
+    // Gives the data a directory entry next to the target and releases the
+    // descriptor; publish() then makes it visible under the target's name.
+    void link_temp(bool sync) {
+        if (sync && fsync(fd) != 0)
+            throw std::runtime_error("Could not sync '" + target + "': " + strerror(errno));
+        if (temp_path.empty()) {
+            char proc_path[64];
+            snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+            std::string candidate = unique_temp_name();
+            if (linkat(AT_FDCWD, proc_path, AT_FDCWD, candidate.c_str(), AT_SYMLINK_FOLLOW) == 0) {
+                temp_path = candidate;
             } else {
-                std::ofstream output_file(output_path);
-                if (!output_file) {
-                    throw std::runtime_error("Could not open output file");
-                }
-                auto cout_buf = std::cout.rdbuf(output_file.rdbuf());
-                reader.print_xml(root);
-                std::cout.rdbuf(cout_buf);
+                copy_to_named_temp();
+                if (sync && fsync(fd) != 0)
+                    throw std::runtime_error("Could not sync '" + target + "': " + strerror(errno));
             }
-        } else {
-            XmlToAbxConverter::convert(input_path, output_path);
-        }
-        if (overwrite_input) {
-            std::remove(input_path.c_str());
-            std::rename(output_path.c_str(), input_path.c_str());
         }
-        return 0;
+        close(fd);
+        fd = -1;
     }
-    catch (const std::exception& e) {
-        std::cerr << "Error: " << e.what() << std::endl;
-        if (overwrite_input) {
-            std::remove(output_path.c_str());
-        }
-        return 1;
+    void publish() {
+        if (renameat(AT_FDCWD, temp_path.c_str(), AT_FDCWD, target.c_str()) != 0)
+            throw std::runtime_error("Could not replace '" + target + "': " + strerror(errno));
+        published = true;
     }
-}
\ No newline at end of file
+    void commit(bool sync) {
+        ABX_PROBE2(flush, target.c_str(), sync);
+        link_temp(sync);
+        publish();
+        if (sync)
+            fsync_directory(parent_directory(target));
+    }
+private:
+    std::string target;
+    std::string temp_path;
+    int fd = -1;
+    bool published = false;
+    static void copy_ownership(int fd, const struct stat& st) {
+        fchmod(fd, st.st_mode & 07777);
+        // Keeping the original owner needs privileges; unprivileged runs keep their own.
+        if (fchown(fd, st.st_uid, st.st_gid) != 0)
+            return;
+    }
+    std::string unique_temp_name() const {
+        static std::atomic<unsigned> counter(0);
+        return target + ".tmp" + std::to_string(getpid()) + "." + std::to_string(counter++);
+    }
+    int create_named_temp() {
+        temp_path = target + ".tmpXXXXXX";
+        int temp_fd = mkstemp(&temp_path[0]);
+        if (temp_fd < 0) {
+            temp_path.clear();
+            throw std::runtime_error("Could not create temporary file for '" + target + "': " + strerror(errno));
+        }
+        fcntl(temp_fd, F_SETFD, FD_CLOEXEC);
+        fchmod(temp_fd, new_file_mode());
+        return temp_fd;
+    }
+    void copy_to_named_temp() {
+        int unnamed = fd;
+        fd = create_named_temp();
+        struct stat st;
+        if (fstat(unnamed, &st) == 0)
+            copy_ownership(fd, st);
+        char buffer[65536];
+        off_t offset = 0;
+        while (true) {
+            ssize_t n = pread(unnamed, buffer, sizeof(buffer), offset);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0 || !write_all_fd(fd, buffer, n)) {
+                close(unnamed);
+                if (n == 0)
+                    return;
+                throw std::runtime_error("Could not write '" + target + "': " + strerror(errno));
+            }
+            offset += n;
+        }
+    }
+};
+// True for a regular file with more than one name, such as an output served
+// from the cache with --cache-hardlink. Such a file is replaced by rename
+// rather than rewritten, so the other names keep their content.
+bool is_shared_file(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink > 1;
+}
+// True for an existing path that is not a regular file, such as /dev/null or a
+// FIFO. Such an output is written in place; a rename would replace the node.
+bool is_special_file(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && !S_ISREG(st.st_mode);
+}
+void write_output_file(const std::string& path, const std::string& data) {
+    ABX_PROBE2(flush, path.c_str(), data.size());
+    if (path == "-") {
+        std::cout.write(data.data(), data.size());
+        std::cout.flush();
+        return;
+    }
+    if (is_shared_file(path)) {
+        AtomicFile file(path);
+        file.write(data);
+        file.commit(false);
+        return;
+    }
+    std::ofstream output_file(path, std::ios::binary | std::ios::trunc);
+    if (!output_file) {
+        throw std::runtime_error("Could not open output file");
+    }
+    if (!output_file.write(data.data(), data.size())) {
+        throw std::runtime_error("Could not write output file");
+    }
+}
+bool has_gzip_magic(const std::string& data) {
+    return data.size() >= 2 && static_cast<unsigned char>(data[0]) == 0x1f &&
+           static_cast<unsigned char>(data[1]) == 0x8b;
+}
+// Buffered output to a descriptor, or to a path that is only created on the
+// first flush, so a conversion that fails before producing output leaves no
+// file behind. finish() flushes and reports any write error.
+class FileOutputBuf : public std::streambuf {
+public:
+    explicit FileOutputBuf(int fd) : fd(fd), buffer(65536, '\0') {
+        setp(&buffer[0], &buffer[0] + buffer.size());
+    }
+    explicit FileOutputBuf(const std::string& path) : FileOutputBuf(-1) {
+        this->path = path;
+    }
+    ~FileOutputBuf() override {
+        if (owns_fd && fd >= 0)
+            close(fd);
+    }
+    void finish() {
+        if (!flush_buffer())
+            throw std::runtime_error(error);
+        if (owns_fd) {
+            int rc = close(fd);
+            fd = -1;
+            if (rc != 0)
+                throw std::runtime_error("Could not write output file");
+        }
+    }
+protected:
+    int_type overflow(int_type ch) override {
+        if (!flush_buffer())
+            return traits_type::eof();
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+    int sync() override {
+        return flush_buffer() ? 0 : -1;
+    }
+private:
+    int fd;
+    bool owns_fd = false;
+    std::string path;
+    std::string buffer;
+    std::string error;
+    bool flush_buffer() {
+        if (fd < 0 && !path.empty()) {
+            fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+            if (fd < 0) {
+                error = "Could not open output file";
+                return false;
+            }
+            owns_fd = true;
+        }
+        if (!write_all_fd(fd, pbase(), pptr() - pbase())) {
+            error = "Could not write output file";
+            return false;
+        }
+        setp(&buffer[0], &buffer[0] + buffer.size());
+        return true;
+    }
+};
+#ifdef ABX_WITH_ZLIB
+// Bounded hand-off of byte blocks between a compression thread and the
+// converter. cancel() unblocks both sides when either stops early.
+class BlockQueue {
+public:
+    explicit BlockQueue(size_t capacity) : capacity(capacity) {}
+    bool push(std::string block) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this] { return cancelled || blocks.size() < capacity; });
+        if (cancelled)
+            return false;
+        blocks.push_back(std::move(block));
+        not_empty.notify_one();
+        return true;
+    }
+    bool pop(std::string& block) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this] { return cancelled || closed || !blocks.empty(); });
+        if (blocks.empty())
+            return false;
+        block = std::move(blocks.front());
+        blocks.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_empty.notify_all();
+    }
+    void cancel() {
+        std::lock_guard<std::mutex> lock(mutex);
+        cancelled = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+private:
+    size_t capacity;
+    std::deque<std::string> blocks;
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    bool closed = false;
+    bool cancelled = false;
+};
+// Inflates gzip or zlib data on a separate thread while the consumer decodes
+// the blocks already produced. Concatenated gzip members are accepted.
+class GzipInputBuf : public std::streambuf {
+public:
+    GzipInputBuf(const char* data, size_t size) : data(data), size(size), queue(8) {
+        worker = std::thread([this] { inflate_all(); });
+    }
+    ~GzipInputBuf() override {
+        stop();
+    }
+    // Stops the inflate thread before reading its error, so it is safe to
+    // call whether the consumer reached the end or gave up early.
+    const std::string& error() {
+        stop();
+        return error_message;
+    }
+protected:
+    int_type underflow() override {
+        if (gptr() < egptr())
+            return traits_type::to_int_type(*gptr());
+        block_start += egptr() - eback();
+        if (!queue.pop(current)) {
+            setg(nullptr, nullptr, nullptr);
+            return traits_type::eof();
+        }
+        setg(&current[0], &current[0], &current[0] + current.size());
+        return traits_type::to_int_type(*gptr());
+    }
+    // Supports tellg() and the relative seeks the reader uses: backwards within
+    // the current block and forwards by consuming data.
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override {
+        if (dir != std::ios_base::cur || !(which & std::ios_base::in))
+            return pos_type(off_type(-1));
+        if (off < 0 && -off > gptr() - eback())
+            return pos_type(off_type(-1));
+        while (off > egptr() - gptr()) {
+            off -= egptr() - gptr();
+            setg(eback(), egptr(), egptr());
+            if (traits_type::eq_int_type(underflow(), traits_type::eof()))
+                return pos_type(off_type(-1));
+        }
+        gbump(static_cast<int>(off));
+        return pos_type(static_cast<off_type>(block_start + (gptr() - eback())));
+    }
+private:
+    const char* data;
+    size_t size;
+    BlockQueue queue;
+    std::thread worker;
+    std::string current;
+    std::string error_message;
+    uint64_t block_start = 0;
+    void stop() {
+        queue.cancel();
+        if (worker.joinable())
+            worker.join();
+    }
+    void inflate_all() {
+        z_stream zs = {};
+        if (inflateInit2(&zs, 15 + 32) != Z_OK) {
+            error_message = "Could not initialize zlib";
+            queue.close();
+            return;
+        }
+        size_t fed = 0;
+        int rc = Z_OK;
+        while (true) {
+            if (zs.avail_in == 0 && fed < size) {
+                size_t n = std::min<size_t>(size - fed, 1u << 30);
+                zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data + fed));
+                zs.avail_in = static_cast<uInt>(n);
+                fed += n;
+            }
+            std::string block(65536, '\0');
+            zs.next_out = reinterpret_cast<Bytef*>(&block[0]);
+            zs.avail_out = static_cast<uInt>(block.size());
+            rc = inflate(&zs, Z_NO_FLUSH);
+            block.resize(block.size() - zs.avail_out);
+            if (!block.empty() && !queue.push(std::move(block)))
+                break;
+            if (rc == Z_STREAM_END) {
+                size_t used = fed - zs.avail_in;
+                if (used + 2 <= size && static_cast<unsigned char>(data[used]) == 0x1f &&
+                    static_cast<unsigned char>(data[used + 1]) == 0x8b) {
+                    inflateReset(&zs);
+                    continue;
+                }
+                break;
+            }
+            if (rc != Z_OK && rc != Z_BUF_ERROR) {
+                error_message = std::string("Corrupt compressed input") + (zs.msg ? std::string(": ") + zs.msg : "");
+                break;
+            }
+            if (rc == Z_BUF_ERROR && zs.avail_in == 0 && fed == size) {
+                error_message = "Truncated compressed input";
+                break;
+            }
+        }
+        inflateEnd(&zs);
+        queue.close();
+    }
+};
+// Collects formatted output into blocks and deflates them to gzip on a
+// separate thread, so compression overlaps with formatting.
+class GzipOutputBuf : public std::streambuf {
+public:
+    explicit GzipOutputBuf(std::ostream& sink) : sink(sink), queue(8) {
+        reset_block();
+        worker = std::thread([this] { deflate_all(); });
+    }
+    ~GzipOutputBuf() override {
+        if (worker.joinable()) {
+            queue.cancel();
+            worker.join();
+        }
+    }
+    void finish() {
+        hand_off();
+        queue.close();
+        worker.join();
+        if (!error_message.empty())
+            throw std::runtime_error(error_message);
+    }
+protected:
+    int_type overflow(int_type ch) override {
+        hand_off();
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+private:
+    static constexpr size_t CHUNK_SIZE = 65536;
+    std::ostream& sink;
+    BlockQueue queue;
+    std::thread worker;
+    std::string block;
+    std::string error_message;
+    void reset_block() {
+        block.assign(CHUNK_SIZE, '\0');
+        setp(&block[0], &block[0] + block.size());
+    }
+    void hand_off() {
+        block.resize(pptr() - pbase());
+        if (!block.empty())
+            queue.push(std::move(block));
+        reset_block();
+    }
+    void deflate_all() {
+        z_stream zs = {};
+        if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            error_message = "Could not initialize zlib";
+            queue.cancel();
+            return;
+        }
+        std::string input;
+        char out[65536];
+        bool more = true;
+        while (more) {
+            more = queue.pop(input);
+            if (!more)
+                input.clear();
+            zs.next_in = reinterpret_cast<Bytef*>(&input[0]);
+            zs.avail_in = static_cast<uInt>(input.size());
+            int flush = more ? Z_NO_FLUSH : Z_FINISH;
+            do {
+                zs.next_out = reinterpret_cast<Bytef*>(out);
+                zs.avail_out = sizeof(out);
+                deflate(&zs, flush);
+                sink.write(out, sizeof(out) - zs.avail_out);
+            } while (zs.avail_out == 0);
+        }
+        deflateEnd(&zs);
+        if (!sink)
+            error_message = "Could not write compressed output";
+    }
+};
+#endif
+void convert_stream(bool is_abx2xml, const std::string& input, std::ostream& out, bool multi_root) {
+    if (is_abx2xml) {
+        AbxReader reader(input.data(), input.size());
+        auto root = reader.read(multi_root);
+        reader.print_xml(out, root);
+    } else {
+        XmlToAbxConverter::convert_content(input, out);
+    }
+}
+// Converts a loaded input into out. Gzip input is inflated on the fly and, with
+// compress_output, the output is gzipped as it is produced; both run on their
+// own thread alongside the converter.
+void convert_to(bool is_abx2xml, const std::string& input, std::ostream& out, bool multi_root, bool compress_output = false) {
+#ifdef ABX_WITH_ZLIB
+    std::unique_ptr<GzipOutputBuf> gzip_out;
+    std::unique_ptr<std::ostream> compressed;
+    if (compress_output) {
+        gzip_out.reset(new GzipOutputBuf(out));
+        compressed.reset(new std::ostream(gzip_out.get()));
+    }
+    std::ostream& sink = compress_output ? *compressed : out;
+    if (has_gzip_magic(input)) {
+        GzipInputBuf gzip_in(input.data(), input.size());
+        try {
+            if (is_abx2xml) {
+                std::istream in(&gzip_in);
+                AbxReader reader(in);
+                auto root = reader.read(multi_root);
+                reader.print_xml(sink, root);
+            } else {
+                std::string xml((std::istreambuf_iterator<char>(&gzip_in)), std::istreambuf_iterator<char>());
+                if (!gzip_in.error().empty())
+                    throw std::runtime_error(gzip_in.error());
+                XmlToAbxConverter::convert_content(xml, sink);
+            }
+        } catch (const std::exception&) {
+            if (!gzip_in.error().empty())
+                throw std::runtime_error(gzip_in.error());
+            throw;
+        }
+    } else {
+        convert_stream(is_abx2xml, input, sink, multi_root);
+    }
+    if (gzip_out)
+        gzip_out->finish();
+#else
+    if (has_gzip_magic(input) || compress_output)
+        throw std::runtime_error("Compressed input and output require a build with ABX_WITH_ZLIB");
+    convert_stream(is_abx2xml, input, out, multi_root);
+#endif
+}
+// convert_to for callers that need the output bytes, e.g. to cache them.
+std::string convert_buffer(bool is_abx2xml, const std::string& input, bool multi_root, bool compress_output = false) {
+    std::ostringstream out;
+    convert_to(is_abx2xml, input, out, multi_root, compress_output);
+    return out.str();
+}
+// convert_buffer for --profile, recording read-side phases: "decode" and "dom"
+// (ABX), "parse" and "encode" (XML), "format" and "teardown" for freeing the
+// tree. Compressed input or output is timed as one "convert" phase.
+std::string convert_buffer_profiled(bool is_abx2xml, const std::string& input, bool multi_root, bool compress_output, PhaseProfile& profile) {
+    if (compress_output || has_gzip_magic(input)) {
+        profile.begin("convert");
+        return convert_buffer(is_abx2xml, input, multi_root, compress_output);
+    }
+    std::ostringstream out;
+    if (!is_abx2xml) {
+        XmlToAbxConverter::convert_content(input, out, &profile);
+        profile.begin("encode");
+        return out.str();
+    }
+    std::unique_ptr<AbxReader> reader(new AbxReader(input.data(), input.size()));
+    TimedDomBuilder builder;
+    profile.begin("decode");
+    reader->read_events(builder, multi_root);
+    profile.end();
+    profile.add("decode", -builder.seconds * 1e3);
+    profile.add("dom", builder.seconds * 1e3);
+    profile.begin("format");
+    reader->print_xml(out, builder.root);
+    std::string output = out.str();
+    profile.begin("teardown");
+    builder.root.reset();
+    reader.reset();
+    profile.end();
+    return output;
+}
+// Returns the first bytes of input after decompression, for format sniffing.
+std::string peek_decompressed(const std::string& input, size_t count) {
+#ifdef ABX_WITH_ZLIB
+    if (has_gzip_magic(input)) {
+        std::string head(count, '\0');
+        z_stream zs = {};
+        if (inflateInit2(&zs, 15 + 32) != Z_OK)
+            return "";
+        zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+        zs.avail_in = static_cast<uInt>(std::min<size_t>(input.size(), UINT32_MAX));
+        zs.next_out = reinterpret_cast<Bytef*>(&head[0]);
+        zs.avail_out = static_cast<uInt>(count);
+        inflate(&zs, Z_SYNC_FLUSH);
+        head.resize(count - zs.avail_out);
+        inflateEnd(&zs);
+        return head;
+    }
+#endif
+    return input.substr(0, count);
+}
+bool has_gz_suffix(const std::string& path) {
+    return path.size() > 3 && path.compare(path.size() - 3, 3, ".gz") == 0;
+}
+// Single-file conversion without holding the output in memory: it is formatted
+// or encoded straight into the destination, and plain ABX input is decoded as
+// it is read from the file. XML input is loaded, since the parser works on the
+// whole document, and so are gzip input and stdin, which the reader cannot seek.
+void convert_file_streaming(bool is_abx2xml, const std::string& input_path, const std::string& output_path,
+                            bool multi_root, bool compress_output, bool in_place, bool sync_output) {
+    std::ifstream file;
+    std::istream* in = &std::cin;
+    if (input_path != "-") {
+        file.open(input_path, std::ios::binary);
+        if (!file)
+            throw std::runtime_error("Could not open input file");
+        in = &file;
+    }
+    bool gzip_input = in->peek() == 0x1f;
+    compress_output = compress_output || (in_place && gzip_input) || has_gz_suffix(output_path);
+    std::unique_ptr<AtomicFile> atomic;
+    std::unique_ptr<FileOutputBuf> buffer;
+    if (in_place || (output_path != "-" && is_shared_file(output_path))) {
+        atomic.reset(new AtomicFile(output_path));
+        buffer.reset(new FileOutputBuf(atomic->descriptor()));
+    } else if (output_path != "-") {
+        buffer.reset(new FileOutputBuf(output_path));
+    }
+    std::ostream out(buffer ? buffer.get() : std::cout.rdbuf());
+    if (is_abx2xml && !gzip_input && !compress_output && input_path != "-") {
+        AbxReader reader(*in);
+        auto root = reader.read(multi_root);
+        reader.print_xml(out, root);
+    } else {
+        std::string input((std::istreambuf_iterator<char>(*in)), std::istreambuf_iterator<char>());
+        if (input_path != "-" && !file.good() && !file.eof())
+            throw std::runtime_error("Could not read input file");
+        convert_to(is_abx2xml, input, out, multi_root, compress_output);
+    }
+    out.flush();
+    ABX_PROBE2(flush, output_path.c_str(), sync_output);
+    if (buffer)
+        buffer->finish();
+    if (atomic)
+        atomic->commit(sync_output);
+}
+// Bounded single-producer single-consumer ring. push() and pop() spin briefly
+// and then sleep on a condition variable, which the other side only signals
+// when someone is waiting; close() lets the consumer drain the remaining items,
+// cancel() makes both sides give up immediately.
+template <typename T>
+class SpscRing {
+public:
+    explicit SpscRing(size_t capacity) : slots(capacity) {}
+    bool push(T&& value) {
+        size_t tail = tail_index.load(std::memory_order_relaxed);
+        if (tail - head_index.load(std::memory_order_acquire) == slots.size()) {
+            TraceSpan wait("queue", "wait (ring full)");
+            if (!wait_until([&] { return tail - head_index.load() != slots.size(); }))
+                return false;
+        }
+        slots[tail % slots.size()] = std::move(value);
+        tail_index.store(tail + 1);
+        wake();
+        return true;
+    }
+    bool pop(T& value) {
+        size_t head = head_index.load(std::memory_order_relaxed);
+        if (head == tail_index.load(std::memory_order_acquire)) {
+            TraceSpan wait("queue", "wait (ring empty)");
+            if (!wait_until([&] { return head != tail_index.load() || closed.load(); }))
+                return false;
+            if (head == tail_index.load())
+                return false;
+        }
+        value = std::move(slots[head % slots.size()]);
+        head_index.store(head + 1);
+        wake();
+        return true;
+    }
+    void close() {
+        closed.store(true);
+        wake();
+    }
+    void cancel() {
+        cancelled.store(true);
+        std::lock_guard<std::mutex> lock(mutex);
+        wakeup.notify_all();
+    }
+private:
+    static constexpr int SPIN_LIMIT = 64;
+    std::vector<T> slots;
+    alignas(64) std::atomic<size_t> head_index{0};
+    alignas(64) std::atomic<size_t> tail_index{0};
+    std::atomic<bool> closed{false};
+    std::atomic<bool> cancelled{false};
+    std::atomic<int> waiters{0};
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    // Returns false if the ring was cancelled. The sequentially consistent
+    // index stores and waiter count make sure a wake-up is never missed.
+    template <typename Ready>
+    bool wait_until(Ready ready) {
+        for (int i = 0; i < SPIN_LIMIT; ++i) {
+            if (cancelled.load(std::memory_order_relaxed))
+                return false;
+            if (ready())
+                return true;
+            std::this_thread::yield();
+        }
+        waiters.fetch_add(1);
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wakeup.wait(lock, [&] { return cancelled.load() || ready(); });
+        }
+        waiters.fetch_sub(1);
+        return !cancelled.load();
+    }
+    void wake() {
+        if (waiters.load() > 0) {
+            std::lock_guard<std::mutex> lock(mutex);
+            wakeup.notify_all();
+        }
+    }
+};
+struct AbxEvent {
+    enum class Kind : uint8_t { START_TAG, END_TAG, TEXT, ATTRIBUTE };
+    Kind kind;
+    std::string name;
+    std::string value;
+};
+using AbxEventBatch = std::vector<AbxEvent>;
+// Thrown by the pipeline's decode stage for documents XmlEventFormatter cannot
+// format in order; the conversion then falls back to read() and print_xml.
+class PipelineFallback : public std::runtime_error {
+public:
+    explicit PipelineFallback(const char* reason) : std::runtime_error(reason) {}
+};
+// AbxReader handler that groups events into batches for another thread. It
+// also checks that the document can be streamed (see XmlEventFormatter)
+// before any event of a shape that cannot be streamed is passed on.
+class AbxEventBatcher {
+public:
+    explicit AbxEventBatcher(SpscRing<AbxEventBatch>& ring) : ring(ring) {
+        batch.reserve(BATCH_SIZE);
+    }
+    void start_tag(const std::string& name) {
+        if (has_child.empty()) {
+            if (root_seen)
+                throw PipelineFallback("multiple top-level elements");
+            root_seen = true;
+        } else {
+            has_child.back() = true;
+        }
+        has_child.push_back(false);
+        add(AbxEvent::Kind::START_TAG, name, std::string());
+    }
+    void end_tag() {
+        if (has_child.empty())
+            throw PipelineFallback("end tag outside an element");
+        has_child.pop_back();
+        add(AbxEvent::Kind::END_TAG, std::string(), std::string());
+    }
+    void text(const std::string& value) {
+        check_content();
+        add(AbxEvent::Kind::TEXT, std::string(), value);
+    }
+    void attribute(const std::string& name, const std::string& value) {
+        check_content();
+        add(AbxEvent::Kind::ATTRIBUTE, name, value);
+    }
+    void flush() {
+        if (!batch.empty() && !ring.push(std::move(batch)))
+            throw std::runtime_error("Pipeline cancelled");
+        batch = AbxEventBatch();
+        batch.reserve(BATCH_SIZE);
+    }
+private:
+    static constexpr size_t BATCH_SIZE = 512;
+    SpscRing<AbxEventBatch>& ring;
+    AbxEventBatch batch;
+    std::vector<bool> has_child;
+    bool root_seen = false;
+    // print_xml writes an element's attributes and text before its children.
+    void check_content() {
+        if (has_child.empty())
+            throw PipelineFallback("content outside an element");
+        if (has_child.back())
+            throw PipelineFallback("attribute or text after a child element");
+    }
+    void add(AbxEvent::Kind kind, const std::string& name, const std::string& value) {
+        batch.push_back({kind, name, value});
+        if (batch.size() == BATCH_SIZE)
+            flush();
+    }
+};
+// Formats reader events into exactly the bytes AbxReader::print_xml produces
+// for the same document. print_xml writes an element's attributes and text
+// before its children, so an element is held back until its first child or
+// its end tag. Documents that add attributes or text to an element after one
+// of its children, or that have several top-level elements, cannot be
+// streamed; AbxEventBatcher stops on them before they reach the formatter.
+class XmlEventFormatter {
+public:
+    explicit XmlEventFormatter(std::string*& block) : block(block) {}
+    void handle(AbxEvent& event) {
+        switch (event.kind) {
+            case AbxEvent::Kind::START_TAG:
+                if (!stack.empty() && !stack.back().opened)
+                    open(stack.back(), true);
+                stack.push_back(Frame());
+                stack.back().tag = std::move(event.name);
+                break;
+            case AbxEvent::Kind::ATTRIBUTE:
+                stack.back().attrib[event.name] = std::move(event.value);
+                break;
+            case AbxEvent::Kind::TEXT:
+                stack.back().text += event.value;
+                break;
+            case AbxEvent::Kind::END_TAG:
+                close_top();
+                break;
+        }
+    }
+    // Closes the synthetic multi-root element, which never sees an END_TAG.
+    void finish() {
+        while (!stack.empty())
+            close_top();
+    }
+private:
+    struct Frame {
+        std::string tag;
+        std::string text;
+        std::unordered_map<std::string, std::string> attrib;
+        bool opened = false;
+    };
+    std::string*& block;
+    std::vector<Frame> stack;
+    void start_element(const Frame& frame) {
+        std::string& out = *block;
+        if (stack.size() == 1)
+            out += "<?xml version='1.0' encoding='UTF-8' standalone='yes' ?>\n";
+        out.append((stack.size() - 1) * 2, ' ');
+        out += '<';
+        out += frame.tag;
+        for (const auto& [key, value] : frame.attrib) {
+            out += ' ';
+            out += key;
+            out += "=\"";
+            out += value;
+            out += '"';
+        }
+    }
+    void open(Frame& frame, bool has_children) {
+        start_element(frame);
+        *block += '>';
+        *block += frame.text;
+        if (has_children)
+            *block += '\n';
+        frame.opened = true;
+    }
+    void close_top() {
+        Frame& frame = stack.back();
+        std::string& out = *block;
+        if (frame.opened) {
+            out.append((stack.size() - 1) * 2, ' ');
+        } else if (frame.text.empty()) {
+            start_element(frame);
+            out += "/>\n";
+            stack.pop_back();
+            return;
+        } else {
+            open(frame, false);
+        }
+        out += "</";
+        out += frame.tag;
+        out += ">\n";
+        stack.pop_back();
+    }
+};
+// The DOM conversion of an ABX document written to out_fd.
+void dom_abx_to_xml(const std::string& input, int out_fd, bool multi_root) {
+    AbxReader reader(input.data(), input.size());
+    auto root = reader.read(multi_root);
+    FileOutputBuf buf(out_fd);
+    std::ostream out(&buf);
+    reader.print_xml(out, root);
+    buf.finish();
+}
+// Converts ABX to XML on three threads connected by SPSC rings: one decodes
+// tokens into event batches, one formats them into a pair of output blocks
+// (double buffering) and the calling thread writes full blocks to out_fd.
+// The pipeline needs a regular file, which is truncated back to where it
+// started if the conversion fails; other outputs, and documents the
+// formatter cannot stream, are converted with read() and print_xml, so the
+// result always matches the DOM path and a failure never leaves part of it.
+void pipelined_abx_to_xml(const std::string& input, int out_fd, bool multi_root) {
+    struct stat st;
+    off_t start = lseek(out_fd, 0, SEEK_CUR);
+    if (start < 0 || fstat(out_fd, &st) != 0 || !S_ISREG(st.st_mode))
+        return dom_abx_to_xml(input, out_fd, multi_root);
+    const size_t block_size = 1 << 18;
+    SpscRing<AbxEventBatch> events(64);
+    SpscRing<std::string> full_blocks(2);
+    SpscRing<std::string> free_blocks(2);
+    for (int i = 0; i < 2; ++i) {
+        std::string block;
+        block.reserve(block_size + 4096);
+        free_blocks.push(std::move(block));
+    }
+    std::exception_ptr decode_error;
+    std::exception_ptr format_error;
+    std::atomic<bool> decode_failed(false);
+    bool fallback = false;
+    std::thread decoder([&] {
+        Trace::name_thread("decode");
+        TraceSpan span("pipeline", "decode");
+        try {
+            AbxReader reader(input.data(), input.size());
+            AbxEventBatcher batcher(events);
+            reader.read_events(batcher, multi_root);
+            batcher.flush();
+        } catch (const PipelineFallback&) {
+            fallback = true;
+            decode_failed = true;
+        } catch (...) {
+            decode_error = std::current_exception();
+            decode_failed = true;
+        }
+        events.close();
+    });
+    std::thread formatter([&] {
+        Trace::name_thread("format");
+        TraceSpan span("pipeline", "format");
+        try {
+            std::string current;
+            if (!free_blocks.pop(current))
+                throw std::runtime_error("Pipeline cancelled");
+            std::string* block = &current;
+            XmlEventFormatter format(block);
+            AbxEventBatch batch;
+            while (events.pop(batch)) {
+                for (auto& event : batch) {
+                    format.handle(event);
+                    if (current.size() >= block_size) {
+                        if (!full_blocks.push(std::move(current)) || !free_blocks.pop(current))
+                            throw std::runtime_error("Pipeline cancelled");
+                    }
+                }
+            }
+            if (!decode_failed) {
+                format.finish();
+                full_blocks.push(std::move(current));
+            }
+        } catch (...) {
+            format_error = std::current_exception();
+            events.cancel();
+        }
+        full_blocks.close();
+    });
+    bool write_ok = true;
+    int write_errno = 0;
+    std::string block;
+    while (full_blocks.pop(block)) {
+        TraceSpan span("io", "write block");
+        if (!write_all_fd(out_fd, block.data(), block.size())) {
+            write_errno = errno;
+            write_ok = false;
+            full_blocks.cancel();
+            free_blocks.cancel();
+            break;
+        }
+        block.clear();
+        free_blocks.push(std::move(block));
+    }
+    decoder.join();
+    formatter.join();
+    if (!write_ok || decode_failed || format_error) {
+        if (ftruncate(out_fd, start) != 0 || lseek(out_fd, start, SEEK_SET) < 0)
+            throw std::runtime_error(std::string("Could not rewind output: ") + strerror(errno));
+    }
+    // A failed write cancels the rings, so the other stages then fail with
+    // "Pipeline cancelled"; the write error is the one to report.
+    if (!write_ok)
+        throw std::runtime_error(std::string("Could not write output: ") + strerror(write_errno));
+    if (decode_error)
+        std::rethrow_exception(decode_error);
+    if (format_error)
+        std::rethrow_exception(format_error);
+    if (fallback) {
+        TraceSpan span("pipeline", "fallback");
+        dom_abx_to_xml(input, out_fd, multi_root);
+    }
+}
+// 64-bit hash processing eight bytes per step; only used to key the conversion
+// cache, so speed matters more than cryptographic strength.
+uint64_t hash_bytes(const void* data, size_t len, uint64_t seed) {
+    const uint64_t m = 0x9E3779B97F4A7C15ULL;
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    uint64_t h = seed ^ (len * m);
+    auto mix = [](uint64_t v) {
+        v ^= v >> 33;
+        v *= 0xFF51AFD7ED558CCDULL;
+        v ^= v >> 33;
+        v *= 0xC4CEB9FE1A85EC53ULL;
+        v ^= v >> 33;
+        return v;
+    };
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t k;
+        memcpy(&k, p + i, 8);
+        h = (h ^ mix(k)) * m;
+    }
+    uint64_t tail = 0;
+    for (size_t j = 0; i + j < len; ++j)
+        tail |= static_cast<uint64_t>(p[i + j]) << (8 * j);
+    h = (h ^ mix(tail)) * m;
+    return mix(h);
+}
+uint64_t parse_size(const std::string& text) {
+    size_t end = 0;
+    unsigned long long value = std::stoull(text, &end);
+    std::string suffix = text.substr(end);
+    if (suffix.empty() || suffix == "B")
+        return value;
+    if (suffix == "K" || suffix == "k")
+        return value << 10;
+    if (suffix == "M" || suffix == "m")
+        return value << 20;
+    if (suffix == "G" || suffix == "g")
+        return value << 30;
+    throw std::runtime_error("Invalid size: " + text);
+}
+// On-disk conversion cache. Entries live under <dir>/<2 hex>/<rest of key> and
+// hold the converted output for an input identified by content hash and options.
+// Hits touch the entry's mtime, which eviction uses as an LRU clock. A cache
+// may be shared by the worker threads of a batch run.
+class ConversionCache {
+public:
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t stores = 0;
+        uint64_t evictions = 0;
+        uint64_t evicted_bytes = 0;
+    };
+    struct Usage {
+        uint64_t entries = 0;
+        uint64_t bytes = 0;
+    };
+    ConversionCache(const std::string& dir, uint64_t max_bytes, bool allow_hardlink = false)
+        : dir(dir), max_bytes(max_bytes), allow_hardlink(allow_hardlink) {
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+            throw std::runtime_error("Could not create cache directory '" + dir + "'");
+    }
+    static std::string key_for(const std::string& input, const std::string& options) {
+        char key[64];
+        uint64_t h1 = hash_bytes(input.data(), input.size(), 0x243F6A8885A308D3ULL);
+        uint64_t h2 = hash_bytes(input.data(), input.size(), hash_bytes(options.data(), options.size(), 0x13198A2E03707344ULL));
+        snprintf(key, sizeof(key), "%016llx%016llx", static_cast<unsigned long long>(h1), static_cast<unsigned long long>(h2));
+        return key;
+    }
+    // The converter options that change the output, as hashed into the key.
+    static std::string options_for(bool is_abx2xml, bool multi_root, bool compress_output) {
+        return std::string(is_abx2xml ? "abx2xml" : "xml2abx") + (multi_root ? ":mr" : "") + (compress_output ? ":gz" : "");
+    }
+    // Serves a cached entry to output_path ('-' for stdout) without decoding.
+    // The output is replaced by rename, never rewritten in place: with a hard
+    // link when allowed, otherwise with a reflink clone or a copy. A device or
+    // FIFO is written in place instead, since a rename would replace the node.
+    bool fetch(const std::string& key, const std::string& output_path) {
+        std::string entry = entry_path(key);
+        bool special = output_path != "-" && is_special_file(output_path);
+        if (output_path != "-" && !special && allow_hardlink && link_to(entry, output_path)) {
+            // The entry's inode is now shared with the output, so its mtime is
+            // left alone; a hard-linked hit does not refresh its LRU position.
+            record(&Stats::hits);
+            return true;
+        }
+        int src = open(entry.c_str(), O_RDONLY | O_CLOEXEC);
+        if (src < 0) {
+            record(&Stats::misses);
+            return false;
+        }
+        bool ok = false;
+        if (output_path == "-") {
+            std::cout.flush();
+            ok = copy_fd(src, STDOUT_FILENO);
+        } else if (special) {
+            int dst = open(output_path.c_str(), O_WRONLY | O_CLOEXEC);
+            ok = dst >= 0 && copy_fd(src, dst);
+            if (dst >= 0)
+                close(dst);
+        } else {
+            AtomicFile output(output_path);
+            ok = clone_or_copy(src, output.descriptor());
+            if (ok)
+                output.commit(false);
+        }
+        close(src);
+        return finish_fetch(entry, ok);
+    }
+    // Serves a cached entry into an already open descriptor, e.g. an AtomicFile.
+    bool fetch_to_fd(const std::string& key, int dst) {
+        std::string entry = entry_path(key);
+        int src = open(entry.c_str(), O_RDONLY | O_CLOEXEC);
+        if (src < 0) {
+            record(&Stats::misses);
+            return false;
+        }
+        bool ok = clone_or_copy(src, dst);
+        close(src);
+        if (!ok && ftruncate(dst, 0) == 0)
+            lseek(dst, 0, SEEK_SET);
+        return finish_fetch(entry, ok);
+    }
+    // Reads a cached entry without counting a hit, e.g. to report on an output
+    // that went to stdout. Returns false if the entry is gone.
+    bool peek(const std::string& key, std::string& data) const {
+        try {
+            data = read_input_file(entry_path(key));
+            return true;
+        } catch (const std::exception&) {
+            return false;
+        }
+    }
+    void store(const std::string& key, const std::string& data) {
+        std::string entry = entry_path(key);
+        std::string subdir = entry.substr(0, entry.find_last_of('/'));
+        if (mkdir(subdir.c_str(), 0755) != 0 && errno != EEXIST)
+            return;
+        struct stat old;
+        uint64_t replaced = stat(entry.c_str(), &old) == 0 ? old.st_size : 0;
+        try {
+            AtomicFile file(entry);
+            file.write(data);
+            file.commit(false);
+        } catch (const std::exception&) {
+            return;
+        }
+        bool over_limit = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stats.stores++;
+            if (max_bytes > 0) {
+                if (!total_known) {
+                    total_bytes = usage().bytes;
+                    total_known = true;
+                } else {
+                    total_bytes += data.size();
+                    total_bytes -= std::min(replaced, total_bytes);
+                }
+                over_limit = total_bytes > max_bytes;
+            }
+        }
+        if (over_limit)
+            evict();
+    }
+    Usage usage() const {
+        Usage total;
+        for (const auto& entry : list_entries()) {
+            total.entries++;
+            total.bytes += entry.size;
+        }
+        return total;
+    }
+    // Removes least recently used entries until the cache is within max_bytes
+    // less some headroom. Stores only keep a running total of the cache size,
+    // so the directory is scanned once the total passes max_bytes, not on
+    // every store; the scan also picks up entries written by other processes.
+    void evict() {
+        std::lock_guard<std::mutex> evict_lock(evict_mutex);
+        auto entries = list_entries();
+        uint64_t total = 0;
+        for (const auto& entry : entries)
+            total += entry.size;
+        if (total > max_bytes) {
+            std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+                return a.mtime < b.mtime;
+            });
+            uint64_t target = max_bytes - max_bytes / 10;
+            for (const auto& entry : entries) {
+                if (total <= target)
+                    break;
+                if (unlink(entry.path.c_str()) == 0) {
+                    total -= entry.size;
+                    std::lock_guard<std::mutex> lock(mutex);
+                    stats.evictions++;
+                    stats.evicted_bytes += entry.size;
+                }
+            }
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        total_bytes = total;
+        total_known = true;
+    }
+    void print_stats(std::ostream& out) const {
+        Usage current = usage();
+        Stats counts = snapshot();
+        out << "cache: " << counts.hits << " hits, " << counts.misses << " misses, "
+            << counts.stores << " stores, " << counts.evictions << " evictions ("
+            << counts.evicted_bytes << " bytes), " << current.entries << " entries, "
+            << current.bytes << " bytes";
+        if (max_bytes > 0)
+            out << " of " << max_bytes;
+        out << "\n";
+    }
+    Stats snapshot() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats;
+    }
+private:
+    struct Entry {
+        std::string path;
+        uint64_t size;
+        int64_t mtime;
+    };
+    std::string dir;
+    uint64_t max_bytes;
+    bool allow_hardlink;
+    mutable std::mutex mutex;
+    std::mutex evict_mutex;
+    Stats stats;
+    uint64_t total_bytes = 0;
+    bool total_known = false;
+    void record(uint64_t Stats::*counter) {
+        std::lock_guard<std::mutex> lock(mutex);
+        stats.*counter += 1;
+    }
+    bool finish_fetch(const std::string& entry, bool ok) {
+        if (!ok) {
+            record(&Stats::misses);
+            return false;
+        }
+        utimensat(AT_FDCWD, entry.c_str(), nullptr, 0);
+        record(&Stats::hits);
+        return true;
+    }
+    std::string entry_path(const std::string& key) const {
+        return dir + "/" + key.substr(0, 2) + "/" + key.substr(2);
+    }
+    std::vector<Entry> list_entries() const {
+        std::vector<Entry> entries;
+        DIR* top = opendir(dir.c_str());
+        if (!top)
+            return entries;
+        while (dirent* sub = readdir(top)) {
+            if (sub->d_name[0] == '.' || strlen(sub->d_name) != 2)
+                continue;
+            std::string subdir = dir + "/" + sub->d_name;
+            DIR* inner = opendir(subdir.c_str());
+            if (!inner)
+                continue;
+            while (dirent* file = readdir(inner)) {
+                if (file->d_name[0] == '.' || strstr(file->d_name, ".tmp") || strstr(file->d_name, ".lnk"))
+                    continue;
+                std::string path = subdir + "/" + file->d_name;
+                struct stat st;
+                if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+                    entries.push_back({path, static_cast<uint64_t>(st.st_size), static_cast<int64_t>(st.st_mtime)});
+            }
+            closedir(inner);
+        }
+        closedir(top);
+        return entries;
+    }
+    static bool copy_fd(int src, int dst) {
+        char buffer[65536];
+        if (lseek(src, 0, SEEK_SET) < 0)
+            return false;
+        while (true) {
+            ssize_t n = read(src, buffer, sizeof(buffer));
+            if (n == 0)
+                return true;
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            if (!write_all_fd(dst, buffer, n))
+                return false;
+        }
+    }
+    static bool clone_or_copy(int src, int dst) {
+#ifdef FICLONE
+        if (ioctl(dst, FICLONE, src) == 0)
+            return true;
+#endif
+        return copy_fd(src, dst);
+    }
+    static bool link_to(const std::string& entry, const std::string& output_path) {
+        static std::atomic<unsigned> counter(0);
+        std::string tmp = output_path + ".lnk" + std::to_string(getpid()) + "." + std::to_string(counter++);
+        if (link(entry.c_str(), tmp.c_str()) != 0)
+            return false;
+        if (std::rename(tmp.c_str(), output_path.c_str()) != 0) {
+            unlink(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+};
+class WorkerPool {
+public:
+    explicit WorkerPool(size_t threads) {
+        if (threads == 0)
+            threads = 1;
+        for (size_t i = 0; i < threads; ++i)
+            workers.emplace_back([this, i] { run(i); });
+    }
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        work_ready.notify_all();
+        for (auto& worker : workers)
+            worker.join();
+    }
+    // With tracing, the time a job spends queued is recorded when it starts.
+    void submit(std::function<void()> job) {
+        if (Trace::enabled()) {
+            double queued = Trace::now();
+            job = [job = std::move(job), queued] {
+                Trace::complete("queue", "queued", queued, Trace::now());
+                job();
+            };
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(std::move(job));
+        }
+        work_ready.notify_one();
+    }
+    void wait_idle() {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this] { return jobs.empty() && active == 0; });
+    }
+    size_t size() const {
+        return workers.size();
+    }
+    static size_t default_threads() {
+        unsigned n = std::thread::hardware_concurrency();
+        return n > 0 ? n : 1;
+    }
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable idle;
+    size_t active = 0;
+    bool stopping = false;
+    void run(size_t index) {
+        Trace::name_thread("worker " + std::to_string(index));
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                TraceSpan idle_span("queue", "idle");
+                work_ready.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (jobs.empty())
+                    return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+                active++;
+            }
+            try {
+                job();
+            } catch (const std::exception& e) {
+                std::cerr << "Error: " << e.what() << std::endl;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                active--;
+                if (jobs.empty() && active == 0)
+                    idle.notify_all();
+            }
+        }
+    }
+};
+// HDR-style histogram of non-negative integers: 16 linear sub-buckets per power
+// of two, so a reported percentile is within about 6% of the recorded value.
+class LogHistogram {
+public:
+    void record(uint64_t value) {
+        counts[bucket_of(value)]++;
+        total++;
+        largest = std::max(largest, value);
+        smallest = std::min(smallest, value);
+    }
+    uint64_t count() const {
+        return total;
+    }
+    uint64_t max() const {
+        return largest;
+    }
+    uint64_t min() const {
+        return total ? smallest : 0;
+    }
+    // Upper bound of the bucket holding the given fraction of values, capped
+    // at the largest value seen.
+    uint64_t percentile(double fraction) const {
+        if (total == 0)
+            return 0;
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(fraction * total)));
+        uint64_t seen = 0;
+        for (size_t bucket = 0; bucket < BUCKETS; ++bucket) {
+            seen += counts[bucket];
+            if (seen >= rank)
+                return std::min(largest, std::max(smallest, bucket_upper(bucket)));
+        }
+        return largest;
+    }
+private:
+    static constexpr int SUB_BITS = 4;
+    static constexpr size_t BUCKETS = 61 << SUB_BITS;
+    std::vector<uint64_t> counts = std::vector<uint64_t>(BUCKETS);
+    uint64_t total = 0;
+    uint64_t largest = 0;
+    uint64_t smallest = UINT64_MAX;
+    static size_t bucket_of(uint64_t value) {
+        if (value < (1u << SUB_BITS))
+            return value;
+        int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+        return (static_cast<size_t>(shift + 1) << SUB_BITS) + ((value >> shift) & ((1u << SUB_BITS) - 1));
+    }
+    static uint64_t bucket_upper(size_t bucket) {
+        if (bucket < (1u << SUB_BITS))
+            return bucket;
+        int shift = static_cast<int>(bucket >> SUB_BITS) - 1;
+        uint64_t sub = bucket & ((1u << SUB_BITS) - 1);
+        return (((1u << SUB_BITS) + sub + 1) << shift) - 1;
+    }
+};
+// Per-file latency and throughput of a batch run, by input size class, with
+// the slowest files kept for the end-of-run report. "MB/s min1%" is the
+// throughput that only the slowest 1% of files fall below.
+class BatchLatencyStats {
+public:
+    explicit BatchLatencyStats(size_t slowest_count) : slowest_count(slowest_count) {}
+    void record(const std::string& path, uint64_t input_bytes, double seconds) {
+        uint64_t micros = static_cast<uint64_t>(seconds * 1e6);
+        uint64_t kb_per_second = seconds > 0 ? static_cast<uint64_t>(input_bytes / seconds / 1e3) : 0;
+        std::lock_guard<std::mutex> lock(mutex);
+        for (SizeClass* size_class : {&classes[class_of(input_bytes)], &all}) {
+            size_class->latency_us.record(micros);
+            size_class->throughput_kbps.record(kb_per_second);
+        }
+        if (slowest_count == 0)
+            return;
+        slowest.push_back({seconds, input_bytes, path});
+        std::sort(slowest.begin(), slowest.end(), [](const SlowFile& a, const SlowFile& b) {
+            return a.seconds > b.seconds;
+        });
+        if (slowest.size() > slowest_count)
+            slowest.pop_back();
+    }
+    void print(std::ostream& out) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ostringstream text;
+        text << std::fixed << std::setprecision(2);
+        text << std::left << std::setw(10) << "size" << std::right << std::setw(8) << "files"
+             << std::setw(11) << "p50 ms" << std::setw(11) << "p90 ms" << std::setw(11) << "p99 ms"
+             << std::setw(11) << "max ms" << std::setw(11) << "MB/s p50" << std::setw(11) << "MB/s min1%" << "\n";
+        for (size_t i = 0; i <= CLASS_COUNT; ++i) {
+            const SizeClass& size_class = i < CLASS_COUNT ? classes[i] : all;
+            if (size_class.latency_us.count() == 0)
+                continue;
+            text << std::left << std::setw(10) << (i < CLASS_COUNT ? CLASS_NAMES[i] : "all") << std::right
+                 << std::setw(8) << size_class.latency_us.count()
+                 << std::setw(11) << size_class.latency_us.percentile(0.5) / 1e3
+                 << std::setw(11) << size_class.latency_us.percentile(0.9) / 1e3
+                 << std::setw(11) << size_class.latency_us.percentile(0.99) / 1e3
+                 << std::setw(11) << size_class.latency_us.max() / 1e3
+                 << std::setw(11) << size_class.throughput_kbps.percentile(0.5) / 1e3
+                 << std::setw(11) << size_class.throughput_kbps.percentile(0.01) / 1e3 << "\n";
+        }
+        if (!slowest.empty()) {
+            text << "slowest files:\n";
+            for (const auto& file : slowest)
+                text << std::setw(11) << file.seconds * 1e3 << " ms " << std::setw(12) << file.bytes << " bytes  "
+                     << file.path << "\n";
+        }
+        out << text.str() << std::flush;
+    }
+private:
+    static constexpr size_t CLASS_COUNT = 5;
+    static constexpr const char* CLASS_NAMES[CLASS_COUNT] = {"<4K", "4K-64K", "64K-1M", "1M-16M", ">=16M"};
+    struct SizeClass {
+        LogHistogram latency_us;
+        LogHistogram throughput_kbps;
+    };
+    struct SlowFile {
+        double seconds;
+        uint64_t bytes;
+        std::string path;
+    };
+    std::mutex mutex;
+    SizeClass classes[CLASS_COUNT];
+    SizeClass all;
+    size_t slowest_count;
+    std::vector<SlowFile> slowest;
+    static size_t class_of(uint64_t bytes) {
+        if (bytes < (4u << 10))
+            return 0;
+        if (bytes < (64u << 10))
+            return 1;
+        if (bytes < (1u << 20))
+            return 2;
+        if (bytes < (16u << 20))
+            return 3;
+        return 4;
+    }
+};
+bool is_directory(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+void make_dirs(const std::string& path) {
+    for (size_t pos = path.find('/', 1); ; pos = path.find('/', pos + 1)) {
+        std::string prefix = path.substr(0, pos);
+        if (!prefix.empty() && mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST)
+            throw std::runtime_error("Could not create directory '" + prefix + "'");
+        if (pos == std::string::npos)
+            break;
+    }
+}
+// Calls fn with the path of every regular file below root, relative to root.
+void walk_files(const std::string& root, const std::string& rel, const std::function<void(const std::string&)>& fn) {
+    std::string dir_path = rel.empty() ? root : root + "/" + rel;
+    DIR* dir = opendir(dir_path.c_str());
+    if (!dir)
+        return;
+    while (dirent* entry = readdir(dir)) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        std::string child = rel.empty() ? entry->d_name : rel + "/" + entry->d_name;
+        struct stat st;
+        if (lstat((root + "/" + child).c_str(), &st) != 0)
+            continue;
+        if (S_ISDIR(st.st_mode))
+            walk_files(root, child, fn);
+        else if (S_ISREG(st.st_mode))
+            fn(child);
+    }
+    closedir(dir);
+}
+// Defers durability work for bulk in-place runs: every file is written and
+// linked under a temporary name, then one syncfs() per filesystem makes all
+// of them durable before they are renamed over their targets.
+class FsyncBatch {
+public:
+    void add(std::unique_ptr<AtomicFile> file) {
+        file->link_temp(false);
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back(std::move(file));
+    }
+    void flush() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (pending.empty())
+            return;
+        ABX_PROBE1(batch_flush, pending.size());
+        std::vector<std::string> dirs;
+        for (auto& file : pending)
+            dirs.push_back(parent_directory(file->target_path()));
+        std::sort(dirs.begin(), dirs.end());
+        dirs.erase(std::unique(dirs.begin(), dirs.end()), dirs.end());
+        sync_filesystems(dirs);
+        for (auto& file : pending)
+            file->publish();
+        for (const auto& dir : dirs)
+            fsync_directory(dir);
+        pending.clear();
+    }
+private:
+    std::mutex mutex;
+    std::vector<std::unique_ptr<AtomicFile>> pending;
+    // Output trees can cross mount points, so every distinct device gets its
+    // own syncfs(); any failure falls back to a full sync().
+    static void sync_filesystems(const std::vector<std::string>& dirs) {
+#if defined(__ANDROID__) && __ANDROID_API__ < 28
+        (void)dirs;
+        sync();
+#else
+        std::vector<dev_t> devices;
+        for (const auto& dir : dirs) {
+            int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            struct stat st;
+            bool ok = dir_fd >= 0 && fstat(dir_fd, &st) == 0;
+            if (ok && std::find(devices.begin(), devices.end(), st.st_dev) == devices.end()) {
+                ok = syncfs(dir_fd) == 0;
+                devices.push_back(st.st_dev);
+            }
+            if (dir_fd >= 0)
+                close(dir_fd);
+            if (!ok) {
+                sync();
+                return;
+            }
+        }
+#endif
+    }
+};
+void write_file_replace(const std::string& path, const std::string& data) {
+    AtomicFile file(path);
+    file.write(data);
+    file.commit(false);
+}
+volatile sig_atomic_t stop_requested = 0;
+// Write end of a self-pipe that request_stop() also signals, so a loop that
+// polls the read end cannot miss a stop that arrives just before poll() or
+// is delivered to another thread.
+int stop_wake_fd = -1;
+void request_stop(int) {
+    stop_requested = 1;
+    if (stop_wake_fd >= 0) {
+        int saved_errno = errno;
+        ssize_t ignored = write(stop_wake_fd, "", 1);
+        (void)ignored;
+        errno = saved_errno;
+    }
+}
+// Keeps mirror_dir in sync with source_dir using inotify. Changes are debounced
+// per file so a burst of rewrites (including Android's AtomicFile write to
+// ".new" then rename) results in a single conversion, which runs on the pool.
+class DirectoryMirror {
+public:
+    DirectoryMirror(const std::string& source_dir, const std::string& mirror_dir, bool is_abx2xml,
+                    bool multi_root, int debounce_ms, bool verbose, WorkerPool& pool, ConversionCache* cache = nullptr)
+        : source_dir(source_dir), mirror_dir(mirror_dir), is_abx2xml(is_abx2xml), multi_root(multi_root),
+          debounce(debounce_ms), verbose(verbose), pool(pool), cache(cache) {}
+    int run() {
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd < 0)
+            throw std::runtime_error(std::string("inotify_init1 failed: ") + strerror(errno));
+        make_dirs(mirror_dir);
+        add_watches("");
+        initial_sync();
+        struct sigaction sa = {};
+        sa.sa_handler = request_stop;
+        sigaction(SIGINT, &sa, nullptr);
+        sigaction(SIGTERM, &sa, nullptr);
+        while (!stop_requested) {
+            int timeout = -1;
+            if (!pending.empty()) {
+                auto next = std::min_element(pending.begin(), pending.end(), [](const auto& a, const auto& b) {
+                    return a.second < b.second;
+                })->second;
+                auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next - Clock::now()).count();
+                timeout = wait > 0 ? static_cast<int>(wait) : 0;
+            }
+            pollfd pfd = {inotify_fd, POLLIN, 0};
+            int ready = poll(&pfd, 1, timeout);
+            if (ready < 0 && errno != EINTR)
+                throw std::runtime_error(std::string("poll failed: ") + strerror(errno));
+            if (ready > 0)
+                drain_events();
+            dispatch_due();
+        }
+        pool.wait_idle();
+        close(inotify_fd);
+        return 0;
+    }
+private:
+    using Clock = std::chrono::steady_clock;
+    std::string source_dir;
+    std::string mirror_dir;
+    bool is_abx2xml;
+    bool multi_root;
+    std::chrono::milliseconds debounce;
+    bool verbose;
+    WorkerPool& pool;
+    ConversionCache* cache;
+    int inotify_fd = -1;
+    std::unordered_map<int, std::string> watch_dirs;
+    std::unordered_map<std::string, Clock::time_point> pending;
+    std::mutex in_flight_mutex;
+    std::unordered_map<std::string, bool> in_flight;
+    // True for the temporary names writers here produce: a plain ".tmp"
+    // suffix, ".tmp<pid>" and ".tmp<pid>.<n>" (AtomicFile, the standalone
+    // tools) and mkstemp's ".tmpXXXXXX". Names such as "foo.tmpl.xml" are real.
+    static bool is_temp_name(const std::string& name) {
+        size_t at = name.rfind(".tmp");
+        if (at == std::string::npos)
+            return false;
+        std::string rest = name.substr(at + 4);
+        auto all_digits = [](const std::string& text) {
+            return !text.empty() && std::all_of(text.begin(), text.end(), [](unsigned char c) { return isdigit(c); });
+        };
+        size_t dot = rest.find('.');
+        if (dot != std::string::npos)
+            return all_digits(rest.substr(0, dot)) && all_digits(rest.substr(dot + 1));
+        return rest.empty() || all_digits(rest) ||
+               (rest.size() == 6 && std::all_of(rest.begin(), rest.end(), [](unsigned char c) { return isalnum(c); }));
+    }
+    static bool is_transient_name(const std::string& name) {
+        auto ends_with = [&](const char* suffix) {
+            size_t n = strlen(suffix);
+            return name.size() >= n && name.compare(name.size() - n, n, suffix) == 0;
+        };
+        return name.empty() || name[0] == '.' || ends_with(".new") || ends_with(".bak") || is_temp_name(name);
+    }
+    // Removes a mirrored file, or a mirrored directory with everything below it.
+    static bool remove_tree(const std::string& path) {
+        struct stat st;
+        if (lstat(path.c_str(), &st) != 0)
+            return false;
+        if (!S_ISDIR(st.st_mode))
+            return unlink(path.c_str()) == 0;
+        if (DIR* dir = opendir(path.c_str())) {
+            std::vector<std::string> children;
+            while (dirent* entry = readdir(dir)) {
+                if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+                    children.push_back(path + "/" + entry->d_name);
+            }
+            closedir(dir);
+            for (const auto& child : children)
+                remove_tree(child);
+        }
+        return rmdir(path.c_str()) == 0;
+    }
+    // Forgets the watches on rel and every directory below it, once it has
+    // been moved away; a move within the tree adds them again under the new name.
+    void drop_watches(const std::string& rel) {
+        for (auto it = watch_dirs.begin(); it != watch_dirs.end();) {
+            const std::string& dir = it->second;
+            if (dir == rel || dir.compare(0, rel.size() + 1, rel + "/") == 0) {
+                inotify_rm_watch(inotify_fd, it->first);
+                it = watch_dirs.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    void add_watches(const std::string& rel) {
+        std::string path = rel.empty() ? source_dir : source_dir + "/" + rel;
+        int wd = inotify_add_watch(inotify_fd, path.c_str(),
+                                   IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CREATE | IN_ONLYDIR);
+        if (wd < 0) {
+            std::cerr << "Error: Could not watch '" << path << "': " << strerror(errno) << std::endl;
+            return;
+        }
+        watch_dirs[wd] = rel;
+        DIR* dir = opendir(path.c_str());
+        if (!dir)
+            return;
+        std::vector<std::string> subdirs;
+        while (dirent* entry = readdir(dir)) {
+            if (entry->d_name[0] == '.')
+                continue;
+            std::string child = rel.empty() ? entry->d_name : rel + "/" + entry->d_name;
+            if (is_directory(source_dir + "/" + child))
+                subdirs.push_back(child);
+        }
+        closedir(dir);
+        for (const auto& child : subdirs)
+            add_watches(child);
+    }
+    void initial_sync() {
+        walk_files(source_dir, "", [this](const std::string& rel) {
+            if (is_transient_name(rel.substr(rel.find_last_of('/') + 1)))
+                return;
+            struct stat src, dst;
+            if (stat((source_dir + "/" + rel).c_str(), &src) != 0)
+                return;
+            if (stat((mirror_dir + "/" + rel).c_str(), &dst) == 0 &&
+                (dst.st_mtim.tv_sec > src.st_mtim.tv_sec ||
+                 (dst.st_mtim.tv_sec == src.st_mtim.tv_sec && dst.st_mtim.tv_nsec >= src.st_mtim.tv_nsec)))
+                return;
+            pending[rel] = Clock::now();
+        });
+    }
+    void drain_events() {
+        alignas(inotify_event) char buffer[16384];
+        while (true) {
+            ssize_t len = read(inotify_fd, buffer, sizeof(buffer));
+            if (len <= 0)
+                return;
+            for (char* p = buffer; p < buffer + len;) {
+                auto* event = reinterpret_cast<inotify_event*>(p);
+                p += sizeof(inotify_event) + event->len;
+                if (event->mask & IN_Q_OVERFLOW) {
+                    initial_sync();
+                    continue;
+                }
+                if (event->mask & IN_IGNORED) {
+                    watch_dirs.erase(event->wd);
+                    continue;
+                }
+                auto dir = watch_dirs.find(event->wd);
+                if (dir == watch_dirs.end() || event->len == 0)
+                    continue;
+                std::string name = event->name;
+                std::string rel = dir->second.empty() ? name : dir->second + "/" + name;
+                if (event->mask & IN_ISDIR) {
+                    if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                        add_watches(rel);
+                        walk_files(source_dir, rel, [this](const std::string& file) {
+                            if (!is_transient_name(file.substr(file.find_last_of('/') + 1)))
+                                pending[file] = Clock::now() + debounce;
+                        });
+                    } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                        if (event->mask & IN_MOVED_FROM)
+                            drop_watches(rel);
+                        pending[rel] = Clock::now() + debounce;
+                    }
+                    continue;
+                }
+                if (is_transient_name(name))
+                    continue;
+                // Removals are debounced like writes, so a file that is renamed
+                // away and replaced (the .bak save pattern) stays in the mirror.
+                if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM))
+                    pending[rel] = Clock::now() + debounce;
+            }
+        }
+    }
+    void dispatch_due() {
+        auto now = Clock::now();
+        for (auto it = pending.begin(); it != pending.end();) {
+            if (it->second > now) {
+                ++it;
+                continue;
+            }
+            std::string rel = it->first;
+            {
+                std::lock_guard<std::mutex> lock(in_flight_mutex);
+                if (in_flight.count(rel)) {
+                    // Still converting an older version; retry once it has finished.
+                    it->second = now + debounce;
+                    ++it;
+                    continue;
+                }
+                in_flight[rel] = true;
+            }
+            it = pending.erase(it);
+            pool.submit([this, rel] {
+                convert_one(rel);
+                std::lock_guard<std::mutex> lock(in_flight_mutex);
+                in_flight.erase(rel);
+            });
+        }
+    }
+    // Brings the mirror of rel up to date with whatever the source holds once
+    // the debounce has passed: a file is converted, a missing path is removed.
+    void convert_one(const std::string& rel) {
+        std::string src = source_dir + "/" + rel;
+        std::string dst = mirror_dir + "/" + rel;
+        struct stat st;
+        if (lstat(src.c_str(), &st) != 0) {
+            if (errno == ENOENT && remove_tree(dst) && verbose)
+                std::cerr << "removed " << rel << std::endl;
+            return;
+        }
+        if (S_ISDIR(st.st_mode))
+            return;
+        try {
+            std::string input = read_input_file(src);
+            size_t slash = dst.find_last_of('/');
+            make_dirs(dst.substr(0, slash));
+            std::string cache_key;
+            if (cache) {
+                cache_key = ConversionCache::key_for(input, ConversionCache::options_for(is_abx2xml, multi_root, false));
+                if (cache->fetch(cache_key, dst)) {
+                    if (verbose)
+                        std::cerr << "converted " << rel << " (cached)" << std::endl;
+                    return;
+                }
+            }
+            std::string output = convert_buffer(is_abx2xml, input, multi_root);
+            write_file_replace(dst, output);
+            if (cache)
+                cache->store(cache_key, output);
+            if (verbose)
+                std::cerr << "converted " << rel << std::endl;
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << rel << ": " << e.what() << std::endl;
+        }
+    }
+};
+// Minimal ustar/GNU/pax reader. Each entry keeps its raw header blocks so that
+// a rewritten archive can reproduce members it does not touch byte for byte.
+// next() reads only the first bytes of a member body into data, enough to tell
+// ABX by its magic; read_body() then buffers the rest, while copy_body()
+// streams it through, so large non-ABX members are never held in memory.
+struct TarEntry {
+    std::string name;
+    char type = '0';
+    std::string headers;
+    std::string data;
+    uint64_t size = 0;
+    // Offset in headers of a pax header carrying a size record, or npos.
+    size_t pax_size_header = std::string::npos;
+    bool is_regular() const {
+        return type == '0' || type == '\0' || type == '7';
+    }
+};
+class TarReader {
+public:
+    static constexpr size_t PEEK_SIZE = 4;
+    explicit TarReader(std::istream& input) : input(input) {}
+    bool next(TarEntry& entry) {
+        skip_body();
+        entry = TarEntry();
+        std::string long_name;
+        std::string pax_size;
+        while (true) {
+            char block[512];
+            if (!read_exact(block, sizeof(block)))
+                return false;
+            if (std::all_of(block, block + sizeof(block), [](char c) { return c == 0; }))
+                return false;
+            if (!checksum_ok(block))
+                throw std::runtime_error("Invalid tar header checksum");
+            size_t header_offset = entry.headers.size();
+            entry.headers.append(block, sizeof(block));
+            uint64_t size = parse_number(block + 124, 12);
+            char type = block[156];
+            if (type == 'L' || type == 'x' || type == 'g') {
+                if (size > (1u << 20))
+                    throw std::runtime_error("Tar extended header too large");
+                std::string payload = read_payload(size);
+                entry.headers += payload;
+                entry.headers.append(padding(size), '\0');
+                if (type == 'L') {
+                    long_name.assign(payload.c_str());
+                } else if (type == 'x') {
+                    std::string path = pax_value(payload, "path");
+                    if (!path.empty())
+                        long_name = path;
+                    pax_size = pax_value(payload, "size");
+                    if (!pax_size.empty())
+                        entry.pax_size_header = header_offset;
+                }
+                continue;
+            }
+            // A pax size record overrides the header field, which cannot hold
+            // sizes of 8 GB and more.
+            if (!pax_size.empty()) {
+                char* end = nullptr;
+                size = std::strtoull(pax_size.c_str(), &end, 10);
+                if (end == pax_size.c_str() || *end != '\0')
+                    throw std::runtime_error("Invalid pax size record");
+            }
+            entry.type = type;
+            entry.size = size;
+            if (!long_name.empty()) {
+                entry.name = long_name;
+            } else {
+                std::string name(block, strnlen(block, 100));
+                if (memcmp(block + 257, "ustar", 5) == 0 && block[345] != '\0')
+                    name = std::string(block + 345, strnlen(block + 345, 155)) + "/" + name;
+                entry.name = name;
+            }
+            remaining = size;
+            body_padding = padding(size);
+            entry.data.resize(static_cast<size_t>(std::min<uint64_t>(size, PEEK_SIZE)));
+            read_body_bytes(&entry.data[0], entry.data.size());
+            return true;
+        }
+    }
+    // Appends the rest of the current member's body to entry.data.
+    void read_body(TarEntry& entry) {
+        size_t start = entry.data.size();
+        entry.data.resize(start + static_cast<size_t>(remaining));
+        read_body_bytes(&entry.data[start], entry.data.size() - start);
+    }
+    // Passes the rest of the current member's body to out (or discards it).
+    void copy_body(std::ostream* out) {
+        char buffer[65536];
+        while (remaining > 0) {
+            size_t n = static_cast<size_t>(std::min<uint64_t>(remaining, sizeof(buffer)));
+            read_body_bytes(buffer, n);
+            if (out)
+                out->write(buffer, n);
+        }
+    }
+    static size_t padding(uint64_t size) {
+        return static_cast<size_t>((512 - size % 512) % 512);
+    }
+    static uint64_t parse_number(const char* field, size_t len) {
+        if (static_cast<unsigned char>(field[0]) & 0x80) {
+            // GNU base-256 encoding for sizes that do not fit in octal.
+            uint64_t value = static_cast<unsigned char>(field[0]) & 0x7f;
+            for (size_t i = 1; i < len; ++i)
+                value = (value << 8) | static_cast<unsigned char>(field[i]);
+            return value;
+        }
+        uint64_t value = 0;
+        for (size_t i = 0; i < len && field[i]; ++i) {
+            if (field[i] >= '0' && field[i] <= '7')
+                value = value * 8 + (field[i] - '0');
+        }
+        return value;
+    }
+private:
+    std::istream& input;
+    uint64_t remaining = 0;
+    size_t body_padding = 0;
+    bool read_exact(char* buffer, size_t size) {
+        input.read(buffer, size);
+        if (static_cast<size_t>(input.gcount()) == size)
+            return true;
+        if (input.gcount() == 0)
+            return false;
+        throw std::runtime_error("Truncated tar stream");
+    }
+    void read_body_bytes(char* buffer, size_t size) {
+        if (size > 0 && !read_exact(buffer, size))
+            throw std::runtime_error("Truncated tar stream");
+        remaining -= size;
+        if (remaining == 0 && body_padding > 0) {
+            char pad[512];
+            if (!read_exact(pad, body_padding))
+                throw std::runtime_error("Truncated tar stream");
+            body_padding = 0;
+        }
+    }
+    void skip_body() {
+        if (remaining > 0)
+            copy_body(nullptr);
+    }
+    std::string read_payload(uint64_t size) {
+        std::string payload(static_cast<size_t>(size), '\0');
+        if (size > 0 && !read_exact(&payload[0], payload.size()))
+            throw std::runtime_error("Truncated tar stream");
+        char pad[512];
+        size_t pad_size = padding(size);
+        if (pad_size > 0 && !read_exact(pad, pad_size))
+            throw std::runtime_error("Truncated tar stream");
+        return payload;
+    }
+    static bool checksum_ok(const char* block) {
+        uint64_t stored = parse_number(block + 148, 8);
+        uint64_t sum = 0;
+        for (size_t i = 0; i < 512; ++i)
+            sum += (i >= 148 && i < 156) ? ' ' : static_cast<unsigned char>(block[i]);
+        return sum == stored;
+    }
+public:
+    // Splits pax records ("<len> key=value\n") and calls fn(key, record).
+    template <typename Fn>
+    static void for_each_pax_record(const std::string& records, Fn fn) {
+        size_t pos = 0;
+        while (pos < records.size()) {
+            size_t space = records.find(' ', pos);
+            if (space == std::string::npos)
+                break;
+            size_t len = std::strtoul(records.c_str() + pos, nullptr, 10);
+            if (len == 0 || pos + len > records.size() || space >= pos + len)
+                break;
+            std::string record = records.substr(space + 1, pos + len - space - 2);
+            fn(record.substr(0, record.find('=')), records.substr(pos, len));
+            pos += len;
+        }
+    }
+private:
+    static std::string pax_value(const std::string& records, const std::string& key) {
+        std::string value;
+        for_each_pax_record(records, [&](const std::string& record_key, const std::string& record) {
+            if (record_key == key) {
+                size_t equals = record.find('=');
+                value = record.substr(equals + 1, record.size() - equals - 2);
+            }
+        });
+        return value;
+    }
+};
+class TarWriter {
+public:
+    explicit TarWriter(std::ostream& output) : output(output) {}
+    // Writes a member whose whole body has been read with read_body().
+    void write(const TarEntry& entry) {
+        output.write(entry.headers.data(), entry.headers.size());
+        write_data(entry.data);
+    }
+    // Copies the current member of reader, whose first bytes next() has
+    // already read into entry.data, without buffering its body.
+    void write_streamed(const TarEntry& entry, TarReader& reader) {
+        static const char zeros[512] = {};
+        output.write(entry.headers.data(), entry.headers.size());
+        output.write(entry.data.data(), entry.data.size());
+        reader.copy_body(&output);
+        output.write(zeros, TarReader::padding(entry.size));
+    }
+    // Writes entry with data replacing its original body; only the size and
+    // checksum of the main header change. A pax size record, which would
+    // override the new size, is dropped from its extended header.
+    void write_replaced(const TarEntry& entry, const std::string& data) {
+        if (data.size() >= (1ULL << 33))
+            throw std::runtime_error("Converted member too large for a tar size field");
+        std::string headers = entry.headers;
+        if (entry.pax_size_header != std::string::npos)
+            headers = drop_pax_size(headers, entry.pax_size_header);
+        set_size(&headers[headers.size() - 512], data.size());
+        output.write(headers.data(), headers.size());
+        write_data(data);
+    }
+    void finish() {
+        static const char zeros[1024] = {};
+        output.write(zeros, sizeof(zeros));
+        output.flush();
+        if (!output)
+            throw std::runtime_error("Could not write tar stream");
+    }
+private:
+    std::ostream& output;
+    void write_data(const std::string& data) {
+        static const char zeros[512] = {};
+        output.write(data.data(), data.size());
+        output.write(zeros, TarReader::padding(data.size()));
+    }
+    static void set_size(char* block, uint64_t size) {
+        snprintf(block + 124, 12, "%011llo", static_cast<unsigned long long>(size));
+        memset(block + 148, ' ', 8);
+        uint64_t sum = 0;
+        for (size_t i = 0; i < 512; ++i)
+            sum += static_cast<unsigned char>(block[i]);
+        snprintf(block + 148, 8, "%06llo", static_cast<unsigned long long>(sum));
+        block[155] = ' ';
+    }
+    static std::string drop_pax_size(const std::string& headers, size_t offset) {
+        uint64_t size = TarReader::parse_number(headers.data() + offset + 124, 12);
+        size_t records_end = offset + 512 + static_cast<size_t>(size);
+        std::string records;
+        TarReader::for_each_pax_record(headers.substr(offset + 512, static_cast<size_t>(size)),
+                                       [&](const std::string& key, const std::string& record) {
+            if (key != "size")
+                records += record;
+        });
+        std::string block = headers.substr(offset, 512);
+        set_size(&block[0], records.size());
+        return headers.substr(0, offset) + block + records + std::string(TarReader::padding(records.size()), '\0') +
+               headers.substr(records_end + TarReader::padding(size));
+    }
+};
+bool has_abx_magic(const std::string& data) {
+    return data.size() >= 4 && memcmp(data.data(), "ABX\0", 4) == 0;
+}
+// Rejects absolute member names and ".." components so a crafted archive
+// cannot write outside the output directory.
+bool is_safe_member_path(const std::string& name) {
+    if (name.empty() || name[0] == '/')
+        return false;
+    size_t start = 0;
+    while (start <= name.size()) {
+        size_t end = name.find('/', start);
+        if (end == std::string::npos)
+            end = name.size();
+        if (name.compare(start, end - start, "..") == 0 && end - start == 2)
+            return false;
+        start = end + 1;
+    }
+    return true;
+}
+// Returns the first "ABX\0" at or after p whose four bytes lie before end, or
+// end if there is none.
+const char* find_abx_magic(const char* p, const char* end) {
+#ifdef __SSE2__
+    const __m128i a = _mm_set1_epi8('A');
+    const __m128i b = _mm_set1_epi8('B');
+    const __m128i x = _mm_set1_epi8('X');
+    const __m128i z = _mm_setzero_si128();
+    for (; end - p >= 19; p += 16) {
+        __m128i m = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), a);
+        m = _mm_and_si128(m, _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 1)), b));
+        m = _mm_and_si128(m, _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 2)), x));
+        m = _mm_and_si128(m, _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 3)), z));
+        int mask = _mm_movemask_epi8(m);
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+#endif
+    while (end - p >= 4) {
+        const char* hit = static_cast<const char*>(memchr(p, 'A', end - p - 3));
+        if (!hit)
+            break;
+        if (memcmp(hit, "ABX\0", 4) == 0)
+            return hit;
+        p = hit + 1;
+    }
+    return end;
+}
+// Scans a raw image for ABX documents. The image is split into windows that are
+// mapped and searched in parallel; each mapping extends max_doc bytes past its
+// window so a document starting near the end of a window is still decoded in
+// full, while candidates are only taken from the window's own range.
+class AbxCarver {
+public:
+    struct Found {
+        uint64_t offset;
+        uint64_t length;
+        std::string root_tag;
+    };
+    AbxCarver(const std::string& image_path, const std::string& output_dir, uint64_t window_size, uint64_t max_doc)
+        : image_path(image_path), output_dir(output_dir), window_size(window_size), max_doc(max_doc) {}
+    std::vector<Found> run(WorkerPool& pool) {
+        fd = open(image_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            throw std::runtime_error("Could not open image '" + image_path + "'");
+        off_t end = lseek(fd, 0, SEEK_END);
+        if (end < 0) {
+            close(fd);
+            throw std::runtime_error("Could not determine image size");
+        }
+        image_size = static_cast<uint64_t>(end);
+        uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+        window_size = std::max(page, window_size / page * page);
+        make_dirs(output_dir);
+        for (uint64_t start = 0; start < image_size; start += window_size)
+            pool.submit([this, start] { scan_window(start); });
+        pool.wait_idle();
+        close(fd);
+        std::sort(found.begin(), found.end(), [](const Found& a, const Found& b) {
+            return a.offset < b.offset;
+        });
+        std::ofstream index(output_dir + "/index.tsv", std::ios::trunc);
+        index << "offset\tlength\troot\n";
+        for (const auto& doc : found)
+            index << doc.offset << "\t" << doc.length << "\t" << doc.root_tag << "\n";
+        return found;
+    }
+private:
+    std::string image_path;
+    std::string output_dir;
+    uint64_t window_size;
+    uint64_t max_doc;
+    uint64_t image_size = 0;
+    int fd = -1;
+    std::mutex found_mutex;
+    std::vector<Found> found;
+    void scan_window(uint64_t start) {
+        uint64_t own_end = std::min(image_size, start + window_size);
+        uint64_t map_end = std::min(image_size, own_end + max_doc);
+        size_t map_len = static_cast<size_t>(map_end - start);
+        void* mapping = mmap(nullptr, map_len, PROT_READ, MAP_PRIVATE, fd, static_cast<off_t>(start));
+        if (mapping == MAP_FAILED) {
+            std::cerr << "Error: Could not map image at offset " << start << ": " << strerror(errno) << std::endl;
+            return;
+        }
+        madvise(mapping, map_len, MADV_SEQUENTIAL);
+        const char* base = static_cast<const char*>(mapping);
+        const char* own = base + (own_end - start);
+        const char* search_end = base + std::min<uint64_t>(map_len, own_end - start + 3);
+        for (const char* p = find_abx_magic(base, search_end); p < own; p = find_abx_magic(p, search_end)) {
+            size_t available = static_cast<size_t>(base + map_len - p);
+            size_t length = 0;
+            if (validate(p, std::min<uint64_t>(available, max_doc), start + (p - base), length))
+                p += length;
+            else
+                p += 1;
+        }
+        munmap(mapping, map_len);
+    }
+    bool validate(const char* data, size_t size, uint64_t offset, size_t& length) {
+        std::shared_ptr<XMLElement> root;
+        AbxReader reader(data, size);
+        try {
+            root = reader.read();
+        } catch (const std::exception&) {
+            return false;
+        }
+        length = static_cast<size_t>(reader.position());
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(offset));
+        std::string prefix = output_dir + "/" + name;
+        try {
+            write_output_file(prefix + ".abx", std::string(data, length));
+            std::ostringstream xml;
+            reader.print_xml(xml, root);
+            write_output_file(prefix + ".xml", xml.str());
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << prefix << ": " << e.what() << std::endl;
+        }
+        std::lock_guard<std::mutex> lock(found_mutex);
+        found.push_back({offset, length, root->tag});
+        return true;
+    }
+};
+// Wire format of the conversion daemon. A request header is followed by the
+// input path, output path and inline payload; when FLAG_FDS is set the client
+// passes its input and output descriptors with SCM_RIGHTS on the header.
+struct ServeRequestHeader {
+    char magic[4];
+    uint32_t command;
+    uint32_t flags;
+    uint32_t input_path_len;
+    uint32_t output_path_len;
+    uint64_t payload_len;
+};
+struct ServeResponseHeader {
+    char magic[4];
+    int32_t status;
+    uint32_t message_len;
+    uint64_t payload_len;
+};
+enum ServeFlags : uint32_t {
+    SERVE_FLAG_MULTI_ROOT = 1 << 0,
+    SERVE_FLAG_INLINE = 1 << 1,
+    SERVE_FLAG_FDS = 1 << 2
+};
+bool send_all(int fd, const void* data, size_t len) {
+    const char* p = static_cast<const char*>(data);
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+bool recv_all(int fd, void* data, size_t len) {
+    char* p = static_cast<char*>(data);
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n == 0)
+            return false;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+std::string read_all_fd(int fd) {
+    std::string content;
+    char buffer[65536];
+    while (true) {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n == 0)
+            return content;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error(std::string("Could not read input: ") + strerror(errno));
+        }
+        content.append(buffer, n);
+    }
+}
+sockaddr_un make_unix_address(const std::string& path) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+        throw std::runtime_error("Socket path too long");
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return addr;
+}
+// Owns a descriptor and closes it on every exit path.
+class ScopedFd {
+public:
+    explicit ScopedFd(int fd = -1) : fd(fd) {}
+    ~ScopedFd() {
+        reset();
+    }
+    ScopedFd(const ScopedFd&) = delete;
+    ScopedFd& operator=(const ScopedFd&) = delete;
+    int get() const {
+        return fd;
+    }
+    void reset(int value = -1) {
+        if (fd >= 0)
+            close(fd);
+        fd = value;
+    }
+private:
+    int fd;
+};
+// Largest inline payload the daemon accepts; bigger inputs should be passed
+// as descriptors or paths.
+constexpr uint64_t SERVE_MAX_PAYLOAD = 256ull << 20;
+// Most connections the daemon serves at once; further clients wait in the
+// listen backlog until one closes.
+constexpr size_t SERVE_MAX_CONNECTIONS = 256;
+// Long-running conversion service. Each accepted connection gets a thread that
+// reads its requests, and only decoded requests are converted on the worker
+// pool, so idle connections never hold a worker. A connection may carry any
+// number of requests, so callers that keep it open pay neither process
+// startup nor a new connection per file. At most SERVE_MAX_CONNECTIONS are
+// open at a time. A self-pipe wakes the accept loop on SIGINT or SIGTERM and
+// whenever a connection closes; on stop, open connections are shut down,
+// which wakes threads blocked in recv.
+class ConversionServer {
+public:
+    ConversionServer(const std::string& socket_path, WorkerPool& pool) : socket_path(socket_path), pool(pool) {}
+    int run() {
+        sockaddr_un addr = make_unix_address(socket_path);
+        ScopedFd listen_fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+        if (listen_fd.get() < 0)
+            throw std::runtime_error(std::string("socket failed: ") + strerror(errno));
+        unlink(socket_path.c_str());
+        mode_t old_mask = umask(077);
+        int rc = bind(listen_fd.get(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        umask(old_mask);
+        if (rc != 0 || listen(listen_fd.get(), 128) != 0)
+            throw std::runtime_error("Could not listen on '" + socket_path + "': " + strerror(errno));
+        int wake[2];
+        if (pipe2(wake, O_NONBLOCK | O_CLOEXEC) != 0)
+            throw std::runtime_error(std::string("pipe2 failed: ") + strerror(errno));
+        ScopedFd wake_read(wake[0]);
+        ScopedFd wake_write(wake[1]);
+        wake_fd = wake[1];
+        stop_wake_fd = wake[1];
+        struct sigaction sa = {};
+        sa.sa_handler = request_stop;
+        sigaction(SIGINT, &sa, nullptr);
+        sigaction(SIGTERM, &sa, nullptr);
+        while (!stop_requested) {
+            bool can_accept;
+            {
+                std::lock_guard<std::mutex> lock(connections_mutex);
+                can_accept = connections.size() < SERVE_MAX_CONNECTIONS;
+            }
+            pollfd pfds[2] = {{wake_read.get(), POLLIN, 0}, {listen_fd.get(), POLLIN, 0}};
+            if (poll(pfds, can_accept ? 2 : 1, -1) <= 0)
+                continue;
+            if (pfds[0].revents & POLLIN) {
+                char drain[64];
+                while (read(wake_read.get(), drain, sizeof(drain)) > 0) {
+                }
+            }
+            if (!can_accept || !(pfds[1].revents & POLLIN))
+                continue;
+            int client = accept4(listen_fd.get(), nullptr, nullptr, SOCK_CLOEXEC);
+            if (client < 0)
+                continue;
+            std::lock_guard<std::mutex> lock(connections_mutex);
+            connections.push_back(client);
+            std::thread([this, client] { serve_connection(client); }).detach();
+        }
+        stop_wake_fd = -1;
+        listen_fd.reset();
+        unlink(socket_path.c_str());
+        std::unique_lock<std::mutex> lock(connections_mutex);
+        for (int client : connections)
+            shutdown(client, SHUT_RDWR);
+        connections_closed.wait(lock, [this] { return connections.empty(); });
+        wake_fd = -1;
+        return 0;
+    }
+private:
+    struct Request {
+        ServeRequestHeader header;
+        ScopedFd input_fd;
+        ScopedFd output_fd;
+        std::string input_path;
+        std::string output_path;
+        std::string payload;
+    };
+    struct Response {
+        int status = 0;
+        std::string message;
+        std::string payload;
+    };
+    std::string socket_path;
+    WorkerPool& pool;
+    std::mutex connections_mutex;
+    std::condition_variable connections_closed;
+    std::vector<int> connections;
+    int wake_fd = -1;
+    static bool receive_header(int fd, Request& request) {
+        ServeRequestHeader& header = request.header;
+        char control[CMSG_SPACE(2 * sizeof(int))];
+        iovec iov = {&header, sizeof(header)};
+        msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t n;
+        do {
+            n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0)
+            return false;
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+                cmsg->cmsg_len == CMSG_LEN(2 * sizeof(int))) {
+                int fds[2];
+                memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+                request.input_fd.reset(fds[0]);
+                request.output_fd.reset(fds[1]);
+            }
+        }
+        return recv_all(fd, reinterpret_cast<char*>(&header) + n, sizeof(header) - n);
+    }
+    static void respond(int fd, const Response& response) {
+        ServeResponseHeader header = {{'A', 'B', 'X', 'R'}, response.status,
+                                      static_cast<uint32_t>(response.message.size()), response.payload.size()};
+        send_all(fd, &header, sizeof(header)) && send_all(fd, response.message.data(), response.message.size()) &&
+            send_all(fd, response.payload.data(), response.payload.size());
+    }
+    static Response convert(Request& request) {
+        const ServeRequestHeader& header = request.header;
+        Response response;
+        try {
+            bool is_abx2xml = header.command == 0;
+            bool multi_root = header.flags & SERVE_FLAG_MULTI_ROOT;
+            if (header.flags & SERVE_FLAG_FDS) {
+                int input_fd = request.input_fd.get();
+                int output_fd = request.output_fd.get();
+                if (input_fd < 0 || output_fd < 0)
+                    throw std::runtime_error("Missing file descriptors");
+                // The descriptor belongs to the client: it is written at its
+                // current offset and never truncated, so ">>" redirects and
+                // O_APPEND outputs keep their existing content.
+                std::string result = convert_buffer(is_abx2xml, read_all_fd(input_fd), multi_root);
+                if (!write_all_fd(output_fd, result.data(), result.size()))
+                    throw std::runtime_error("Could not write output");
+            } else if (header.flags & SERVE_FLAG_INLINE) {
+                response.payload = convert_buffer(is_abx2xml, request.payload, multi_root);
+            } else {
+                const std::string& input_path = request.input_path;
+                const std::string& output_path = request.output_path;
+                if (input_path.empty() || input_path[0] != '/' || output_path.empty() || output_path[0] != '/')
+                    throw std::runtime_error("Paths must be absolute");
+                write_output_file(output_path, convert_buffer(is_abx2xml, read_input_file(input_path), multi_root));
+            }
+        } catch (const std::exception& e) {
+            response.status = 1;
+            response.message = e.what();
+            response.payload.clear();
+        }
+        return response;
+    }
+    // Runs one conversion on the pool and waits for it on this thread.
+    Response convert_on_pool(Request& request) {
+        std::mutex done_mutex;
+        std::condition_variable done_changed;
+        bool done = false;
+        Response response;
+        pool.submit([&] {
+            Response result = convert(request);
+            std::lock_guard<std::mutex> lock(done_mutex);
+            response = std::move(result);
+            done = true;
+            done_changed.notify_one();
+        });
+        std::unique_lock<std::mutex> lock(done_mutex);
+        done_changed.wait(lock, [&] { return done; });
+        return response;
+    }
+    void handle_requests(int fd) {
+        while (true) {
+            Request request;
+            if (!receive_header(fd, request) || memcmp(request.header.magic, "ABXQ", 4) != 0 ||
+                request.header.input_path_len > 4096 || request.header.output_path_len > 4096)
+                return;
+            // The oversized payload is still in flight, so the connection
+            // cannot be resynchronized and is closed after the answer.
+            if (request.header.payload_len > SERVE_MAX_PAYLOAD) {
+                Response response;
+                response.status = 1;
+                response.message = "Inline payload exceeds " + std::to_string(SERVE_MAX_PAYLOAD >> 20) + " MB";
+                respond(fd, response);
+                return;
+            }
+            request.input_path.resize(request.header.input_path_len);
+            request.output_path.resize(request.header.output_path_len);
+            request.payload.resize(static_cast<size_t>(request.header.payload_len));
+            if (!recv_all(fd, &request.input_path[0], request.input_path.size()) ||
+                !recv_all(fd, &request.output_path[0], request.output_path.size()) ||
+                !recv_all(fd, &request.payload[0], request.payload.size()))
+                return;
+            respond(fd, convert_on_pool(request));
+        }
+    }
+    void serve_connection(int fd) {
+        try {
+            handle_requests(fd);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+        }
+        std::lock_guard<std::mutex> lock(connections_mutex);
+        connections.erase(std::find(connections.begin(), connections.end(), fd));
+        close(fd);
+        connections_closed.notify_all();
+        // Lets the accept loop take new clients again if it was at the limit.
+        if (wake_fd >= 0 && write(wake_fd, "", 1) < 0) {
+            // A full pipe already holds a pending wake-up.
+        }
+    }
+};
+// Sends one conversion request to a running server. By default the caller's
+// input and output are passed as descriptors so the server touches no paths.
+enum class ServeTransport { FDS, INLINE, PATHS };
+std::string absolute_path(const std::string& path) {
+    if (path.empty() || path[0] == '/')
+        return path;
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd)))
+        throw std::runtime_error("Could not resolve current directory");
+    return std::string(cwd) + "/" + path;
+}
+int serve_client_request(const std::string& socket_path, bool is_abx2xml, bool multi_root, ServeTransport transport,
+                         const std::string& input_path, const std::string& output_path) {
+    sockaddr_un addr = make_unix_address(socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+        throw std::runtime_error("Could not connect to '" + socket_path + "': " + strerror(errno));
+    ServeRequestHeader header = {{'A', 'B', 'X', 'Q'}, is_abx2xml ? 0u : 1u, 0, 0, 0, 0};
+    if (multi_root)
+        header.flags |= SERVE_FLAG_MULTI_ROOT;
+    bool send_inline = transport == ServeTransport::INLINE;
+    bool send_fds = transport == ServeTransport::FDS;
+    std::string payload;
+    std::string paths;
+    int fds[2] = {-1, -1};
+    if (send_inline) {
+        header.flags |= SERVE_FLAG_INLINE;
+        payload = read_input_file(input_path);
+        header.payload_len = payload.size();
+    } else if (transport == ServeTransport::PATHS) {
+        std::string input = absolute_path(input_path);
+        std::string output = absolute_path(output_path);
+        header.input_path_len = input.size();
+        header.output_path_len = output.size();
+        paths = input + output;
+    } else {
+        header.flags |= SERVE_FLAG_FDS;
+        fds[0] = input_path == "-" ? STDIN_FILENO : open(input_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fds[0] < 0)
+            throw std::runtime_error("Could not open input file");
+        fds[1] = output_path == "-" ? STDOUT_FILENO : open(output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fds[1] < 0)
+            throw std::runtime_error("Could not open output file");
+    }
+    char control[CMSG_SPACE(2 * sizeof(int))] = {};
+    iovec iov = {&header, sizeof(header)};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (send_fds) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, 2 * sizeof(int));
+    }
+    ssize_t sent;
+    do {
+        sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    if (sent > 0 && send_all(fd, reinterpret_cast<char*>(&header) + sent, sizeof(header) - sent))
+        send_all(fd, paths.data(), paths.size()) && send_all(fd, payload.data(), payload.size());
+    // A rejected request is answered before the server closes the connection,
+    // so the response is read even when the rest of the request was not sent.
+    ServeResponseHeader response;
+    bool ok = sent > 0 && recv_all(fd, &response, sizeof(response)) && memcmp(response.magic, "ABXR", 4) == 0;
+    std::string message;
+    std::string output;
+    if (ok) {
+        message.resize(response.message_len);
+        output.resize(static_cast<size_t>(response.payload_len));
+        ok = recv_all(fd, &message[0], message.size()) && recv_all(fd, &output[0], output.size());
+    }
+    close(fd);
+    if (fds[0] > STDIN_FILENO)
+        close(fds[0]);
+    if (fds[1] > STDOUT_FILENO)
+        close(fds[1]);
+    if (!ok)
+        throw std::runtime_error("Lost connection to server");
+    if (response.status != 0)
+        throw std::runtime_error(message);
+    if (send_inline)
+        write_output_file(output_path, output);
+    return 0;
+}
+// Stream buffer that forwards to another and counts the bytes written. With a
+// null target the bytes are only counted.
+class CountingStreamBuf : public std::streambuf {
+public:
+    explicit CountingStreamBuf(std::streambuf* target) : target(target) {}
+    uint64_t count() const {
+        return written;
+    }
+protected:
+    int overflow(int c) override {
+        if (c == traits_type::eof())
+            return traits_type::not_eof(c);
+        if (target && target->sputc(static_cast<char>(c)) == traits_type::eof())
+            return traits_type::eof();
+        ++written;
+        return c;
+    }
+    std::streamsize xsputn(const char* data, std::streamsize size) override {
+        std::streamsize done = target ? target->sputn(data, size) : size;
+        written += done;
+        return done;
+    }
+    int sync() override {
+        return target ? target->pubsync() : 0;
+    }
+private:
+    std::streambuf* target;
+    uint64_t written = 0;
+};
+// Writes XML in the layout print_xml produces, with the same method names as
+// AbxWriter so a generator can target either format. Typed attribute values
+// are formatted the way AbxReader renders them.
+class XmlTextWriter {
+public:
+    explicit XmlTextWriter(std::ostream& out) : out(out) {}
+    void write_start_document() {
+        out << "<?xml version='1.0' encoding='UTF-8' standalone='yes' ?>\n";
+    }
+    void write_end_document() {
+        out.flush();
+    }
+    void write_start_tag(const std::string& tag_name) {
+        if (!open_elements.empty())
+            finish_start_tag(true);
+        out << std::string(open_elements.size() * 2, ' ') << '<' << tag_name;
+        open_elements.push_back({tag_name, true, false});
+    }
+    void write_end_tag(const std::string& tag_name) {
+        OpenElement& element = open_elements.back();
+        if (element.start_pending) {
+            out << "/>\n";
+        } else {
+            if (element.has_children)
+                out << std::string((open_elements.size() - 1) * 2, ' ');
+            out << "</" << tag_name << ">\n";
+        }
+        open_elements.pop_back();
+    }
+    void write_attribute(const std::string& name, const std::string& value) {
+        out << ' ' << name << "=\"" << value << '"';
+    }
+    void write_attribute_interned(const std::string& name, const std::string& value) {
+        write_attribute(name, value);
+    }
+    void write_attribute_null(const std::string& name) {
+        write_attribute(name, "null");
+    }
+    void write_attribute_boolean(const std::string& name, bool value) {
+        write_attribute(name, value ? "true" : "false");
+    }
+    void write_attribute_int(const std::string& name, int32_t value, bool hex = false) {
+        if (!hex) {
+            write_attribute(name, std::to_string(value));
+            return;
+        }
+        std::stringstream ss;
+        ss << std::hex << value;
+        write_attribute(name, ss.str());
+    }
+    void write_attribute_long(const std::string& name, int64_t value, bool hex = false) {
+        if (!hex) {
+            write_attribute(name, std::to_string(value));
+            return;
+        }
+        std::stringstream ss;
+        ss << std::hex << value;
+        write_attribute(name, ss.str());
+    }
+    void write_attribute_float(const std::string& name, float value) {
+        write_attribute(name, std::to_string(value));
+    }
+    void write_attribute_double(const std::string& name, double value) {
+        write_attribute(name, std::to_string(value));
+    }
+    void write_attribute_bytes(const std::string& name, const std::string& bytes, bool base64 = false) {
+        const unsigned char* data = reinterpret_cast<const unsigned char*>(bytes.data());
+        if (base64) {
+            write_attribute(name, base64_encode(data, bytes.size()));
+            return;
+        }
+        std::stringstream ss;
+        for (size_t i = 0; i < bytes.size(); ++i)
+            ss << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(data[i]);
+        write_attribute(name, ss.str());
+    }
+    void write_text(const std::string& text) {
+        OpenElement& element = open_elements.back();
+        if (element.start_pending) {
+            out << '>';
+            element.start_pending = false;
+        }
+        out << text;
+    }
+private:
+    struct OpenElement {
+        std::string tag;
+        bool start_pending;
+        bool has_children;
+    };
+    std::ostream& out;
+    std::vector<OpenElement> open_elements;
+    void finish_start_tag(bool child_follows) {
+        OpenElement& parent = open_elements.back();
+        if (parent.start_pending)
+            out << '>';
+        if (child_follows && !parent.has_children)
+            out << '\n';
+        parent.start_pending = false;
+        parent.has_children = parent.has_children || child_follows;
+    }
+};
+// Deterministic generator of documents shaped like the system_server files
+// that are stored as ABX: packages.xml, settings_*.xml, appops.xml and
+// usage-stats. The same seed always yields the same document; top-level
+// records are emitted until the output reaches the requested size.
+class CorpusGenerator {
+public:
+    enum class Shape { PACKAGES, SETTINGS, APPOPS, USAGE_STATS };
+    CorpusGenerator(Shape shape, uint64_t seed) : shape(shape), state(seed * 0x9E3779B97F4A7C15ULL + 1) {}
+    static bool parse_shape(const std::string& name, Shape& shape) {
+        if (name == "packages")
+            shape = Shape::PACKAGES;
+        else if (name == "settings")
+            shape = Shape::SETTINGS;
+        else if (name == "appops")
+            shape = Shape::APPOPS;
+        else if (name == "usagestats")
+            shape = Shape::USAGE_STATS;
+        else
+            return false;
+        return true;
+    }
+    // size() reports the bytes written so far; generation stops once it
+    // reaches target_size, after at least one record.
+    template <typename Writer, typename SizeFn>
+    void generate(Writer& writer, uint64_t target_size, SizeFn size) {
+        writer.write_start_document();
+        switch (shape) {
+            case Shape::PACKAGES:
+                writer.write_start_tag("packages");
+                writer.write_start_tag("version");
+                writer.write_attribute_int("sdkVersion", 34);
+                writer.write_attribute_int("databaseVersion", 3);
+                writer.write_attribute("fingerprint", "google/device/device:14/" + word(6) + "/" + std::to_string(below(99999999)) + ":user/release-keys");
+                writer.write_end_tag("version");
+                writer.write_start_tag("permissions");
+                for (size_t i = 0; i < PERMISSION_COUNT; ++i) {
+                    writer.write_start_tag("item");
+                    writer.write_attribute_interned("name", PERMISSIONS[i]);
+                    writer.write_attribute_interned("package", "android");
+                    writer.write_attribute_int("protection", static_cast<int32_t>(below(4)));
+                    writer.write_end_tag("item");
+                }
+                writer.write_end_tag("permissions");
+                do {
+                    package_record(writer);
+                } while (size() < target_size);
+                writer.write_end_tag("packages");
+                break;
+            case Shape::SETTINGS:
+                writer.write_start_tag("settings");
+                writer.write_attribute_int("version", 213);
+                do {
+                    setting_record(writer);
+                } while (size() < target_size);
+                writer.write_end_tag("settings");
+                break;
+            case Shape::APPOPS:
+                writer.write_start_tag("app-ops");
+                writer.write_attribute_int("v", 1);
+                do {
+                    appops_record(writer);
+                } while (size() < target_size);
+                writer.write_end_tag("app-ops");
+                break;
+            case Shape::USAGE_STATS:
+                writer.write_start_tag("usagestats");
+                writer.write_attribute_int("version", 1);
+                writer.write_attribute_long("endTime", 1700000000000LL + static_cast<int64_t>(below(1000000000)));
+                do {
+                    usage_record(writer);
+                } while (size() < target_size);
+                writer.write_end_tag("usagestats");
+                break;
+        }
+        writer.write_end_document();
+    }
+private:
+    static constexpr const char* PERMISSIONS[] = {
+        "android.permission.INTERNET", "android.permission.ACCESS_NETWORK_STATE",
+        "android.permission.WAKE_LOCK", "android.permission.RECEIVE_BOOT_COMPLETED",
+        "android.permission.FOREGROUND_SERVICE", "android.permission.POST_NOTIFICATIONS",
+        "android.permission.CAMERA", "android.permission.RECORD_AUDIO",
+        "android.permission.ACCESS_FINE_LOCATION", "android.permission.ACCESS_COARSE_LOCATION",
+        "android.permission.READ_CONTACTS", "android.permission.READ_PHONE_STATE",
+        "android.permission.VIBRATE", "android.permission.BLUETOOTH_CONNECT",
+        "android.permission.READ_MEDIA_IMAGES", "android.permission.USE_BIOMETRIC",
+        "android.permission.SCHEDULE_EXACT_ALARM", "android.permission.QUERY_ALL_PACKAGES",
+        "com.google.android.c2dm.permission.RECEIVE", "android.permission.NFC"
+    };
+    static constexpr size_t PERMISSION_COUNT = sizeof(PERMISSIONS) / sizeof(PERMISSIONS[0]);
+    static constexpr const char* VENDORS[] = {
+        "google", "android", "samsung", "whatsapp", "spotify", "microsoft",
+        "facebook", "example", "mozilla", "netflix", "termux", "xiaomi"
+    };
+    static constexpr const char* SETTING_PREFIXES[] = {
+        "screen_", "wifi_", "bluetooth_", "location_", "accessibility_",
+        "sound_", "display_", "notification_", "lock_screen_", "adb_"
+    };
+    Shape shape;
+    uint64_t state;
+    uint32_t package_count = 0;
+    uint32_t setting_count = 0;
+    uint64_t next() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+    uint64_t below(uint64_t bound) {
+        return next() % bound;
+    }
+    // Fan-out skewed toward small values, as most packages hold few entries.
+    uint64_t skewed(uint64_t bound) {
+        return below(1 + below(bound));
+    }
+    std::string word(size_t length) {
+        std::string out(length, 'a');
+        for (auto& c : out)
+            c = 'a' + below(26);
+        return out;
+    }
+    std::string bytes(size_t length) {
+        std::string out(length, '\0');
+        for (auto& c : out)
+            c = static_cast<char>(next());
+        return out;
+    }
+    std::string package_name(uint32_t index) {
+        uint64_t saved = state;
+        state = index * 0x2545F4914F6CDD1DULL + 7;
+        std::string name = std::string("com.") + VENDORS[below(sizeof(VENDORS) / sizeof(VENDORS[0]))] + "." + word(3 + below(10));
+        state = saved;
+        return name + std::to_string(index);
+    }
+    int64_t timestamp() {
+        return 1600000000000LL + static_cast<int64_t>(below(100000000000ULL));
+    }
+    template <typename Writer>
+    void package_record(Writer& writer) {
+        uint32_t index = package_count++;
+        std::string name = package_name(index);
+        writer.write_start_tag("package");
+        writer.write_attribute("name", name);
+        writer.write_attribute("codePath", "/data/app/~~" + word(22) + "==/" + name + "-" + word(22) + "==");
+        if (below(3) == 0)
+            writer.write_attribute_interned("primaryCpuAbi", below(2) ? "arm64-v8a" : "armeabi-v7a");
+        writer.write_attribute_int("publicFlags", static_cast<int32_t>(next()));
+        writer.write_attribute_int("privateFlags", static_cast<int32_t>(next()));
+        writer.write_attribute_long("ft", timestamp(), true);
+        writer.write_attribute_long("ut", timestamp(), true);
+        writer.write_attribute_long("version", static_cast<int64_t>(below(2000000000)));
+        writer.write_attribute_int("userId", 10000 + static_cast<int32_t>(index));
+        writer.write_attribute_interned("installer", below(4) ? "com.android.vending" : "com.android.packageinstaller");
+        if (below(8) == 0)
+            writer.write_attribute_boolean("isOrphaned", true);
+        writer.write_start_tag("sigs");
+        writer.write_attribute_int("count", 1);
+        writer.write_attribute_int("schemeVersion", 3);
+        writer.write_start_tag("cert");
+        writer.write_attribute_int("index", static_cast<int32_t>(index));
+        writer.write_attribute_bytes("key", bytes(64 + below(400)));
+        writer.write_end_tag("cert");
+        writer.write_end_tag("sigs");
+        uint64_t permissions = skewed(PERMISSION_COUNT);
+        if (permissions) {
+            writer.write_start_tag("perms");
+            for (uint64_t i = 0; i < permissions; ++i) {
+                writer.write_start_tag("item");
+                writer.write_attribute_interned("name", PERMISSIONS[below(PERMISSION_COUNT)]);
+                writer.write_attribute_boolean("granted", below(4) != 0);
+                writer.write_attribute_int("flags", static_cast<int32_t>(below(0x10000)), true);
+                writer.write_end_tag("item");
+            }
+            writer.write_end_tag("perms");
+        }
+        writer.write_start_tag("proper-signing-keyset");
+        writer.write_attribute_long("identifier", static_cast<int64_t>(1 + below(5000)));
+        writer.write_end_tag("proper-signing-keyset");
+        writer.write_end_tag("package");
+    }
+    template <typename Writer>
+    void setting_record(Writer& writer) {
+        uint32_t index = setting_count++;
+        writer.write_start_tag("setting");
+        writer.write_attribute_int("id", static_cast<int32_t>(index));
+        writer.write_attribute("name", std::string(SETTING_PREFIXES[below(sizeof(SETTING_PREFIXES) / sizeof(SETTING_PREFIXES[0]))]) + word(4 + below(16)));
+        switch (below(4)) {
+            case 0:
+                writer.write_attribute("value", std::to_string(below(2)));
+                break;
+            case 1:
+                writer.write_attribute("value", std::to_string(below(100000)));
+                break;
+            case 2:
+                writer.write_attribute("value", word(1 + skewed(64)));
+                break;
+            default:
+                writer.write_attribute_null("value");
+                break;
+        }
+        writer.write_attribute_interned("package", below(3) ? "android" : package_name(static_cast<uint32_t>(below(200))));
+        if (below(2)) {
+            writer.write_attribute("defaultValue", std::to_string(below(2)));
+            writer.write_attribute_boolean("defaultSysSet", true);
+        }
+        writer.write_attribute_boolean("preserve_in_restore", below(2) != 0);
+        writer.write_end_tag("setting");
+    }
+    template <typename Writer>
+    void appops_record(Writer& writer) {
+        writer.write_start_tag("pkg");
+        writer.write_attribute("n", package_name(package_count++));
+        writer.write_start_tag("uid");
+        writer.write_attribute_int("n", 10000 + static_cast<int32_t>(below(20000)));
+        writer.write_attribute_boolean("p", below(8) == 0);
+        uint64_t ops = 1 + skewed(12);
+        for (uint64_t i = 0; i < ops; ++i) {
+            writer.write_start_tag("op");
+            writer.write_attribute_int("n", static_cast<int32_t>(below(120)));
+            uint64_t states = 1 + skewed(4);
+            for (uint64_t j = 0; j < states; ++j) {
+                writer.write_start_tag("st");
+                writer.write_attribute_long("n", static_cast<int64_t>(below(0x100000)), true);
+                writer.write_attribute_long("t", timestamp());
+                if (below(2))
+                    writer.write_attribute_long("r", timestamp());
+                writer.write_attribute_long("d", static_cast<int64_t>(skewed(600000)));
+                if (below(4) == 0)
+                    writer.write_attribute("pp", package_name(static_cast<uint32_t>(below(200))));
+                writer.write_end_tag("st");
+            }
+            writer.write_end_tag("op");
+        }
+        writer.write_end_tag("uid");
+        writer.write_end_tag("pkg");
+    }
+    template <typename Writer>
+    void usage_record(Writer& writer) {
+        uint32_t index = package_count++;
+        std::string name = package_name(static_cast<uint32_t>(below(500)));
+        if (index % 64 == 0) {
+            writer.write_start_tag("package");
+            writer.write_attribute_interned("package", name);
+            writer.write_attribute_long("lastTimeActive", timestamp());
+            writer.write_attribute_long("timeActive", static_cast<int64_t>(skewed(86400000)));
+            writer.write_attribute_int("lastEvent", static_cast<int32_t>(below(30)));
+            writer.write_attribute_int("appLaunchCount", static_cast<int32_t>(skewed(500)));
+            writer.write_end_tag("package");
+            writer.write_start_tag("config");
+            writer.write_attribute_float("fs", 1.0f + below(4) * 0.15f);
+            writer.write_attribute_int("mcc", 310 + static_cast<int32_t>(below(10)));
+            writer.write_attribute_interned("locales", below(2) ? "en-US" : "en-US,de-DE");
+            writer.write_attribute_double("timeActive", static_cast<double>(skewed(86400000)));
+            writer.write_end_tag("config");
+        }
+        writer.write_start_tag("event");
+        writer.write_attribute_long("time", static_cast<int64_t>(below(86400000)));
+        writer.write_attribute_interned("package", name);
+        if (below(2))
+            writer.write_attribute_interned("class", name + ".MainActivity");
+        writer.write_attribute_int("type", static_cast<int32_t>(1 + below(26)));
+        writer.write_attribute_int("flags", static_cast<int32_t>(below(16)), true);
+        if (below(16) == 0)
+            writer.write_attribute_bytes("extras", bytes(8 + below(48)), true);
+        writer.write_end_tag("event");
+    }
+};
+enum class InputFormat { UNKNOWN, ABX, XML };
+// Classifies already loaded input by its first bytes: ABX magic, or a '<'
+// after an optional UTF-8 byte order mark and leading whitespace. Gzip input
+// is classified by its decompressed content.
+InputFormat sniff_format(const std::string& input) {
+    std::string data = peek_decompressed(input, 64);
+    if (has_abx_magic(data))
+        return InputFormat::ABX;
+    size_t pos = data.compare(0, 3, "\xEF\xBB\xBF") == 0 ? 3 : 0;
+    while (pos < data.size() && ::isspace(static_cast<unsigned char>(data[pos])))
+        pos++;
+    return pos < data.size() && data[pos] == '<' ? InputFormat::XML : InputFormat::UNKNOWN;
+}
+void print_usage() {
+    std::cerr << "usage: abxtool <command> [options] input [output]\n"
+              << "       abxtool convert [-i] [-z] [--fsync] [-mr] [-j N] [-v] [--latency] [--slowest N]\n"
+              << "                       [--trace file] [--cache dir ...] input [output]\n"
+              << "       abxtool cache-stats <dir>\n"
+              << "       abxtool watch [--reverse] [-mr] [-j N] [--debounce ms] [-v] [--cache dir ...]\n"
+              << "                     <dir> <mirror>\n"
+              << "       abxtool tar [-mr] [-v] <archive.tar|-> <outdir/|out.tar|->\n"
+              << "       abxtool carve [-j N] [--window size] [--max-doc size] <image> <outdir>\n"
+              << "       abxtool bench [-n N] [-mr] [--perf] <file>\n"
+              << "       abxtool roundtrip [-mr] [-j N] [-v] <file|dir>...\n"
+              << "       abxtool generate [--shape name] [--size size] [--seed N] [--format abx|xml] <output>\n"
+              << "       abxtool serve [-j N] <socket>\n"
+              << "       abxtool client <socket> <abx2xml|xml2abx> [-mr] [--inline|--paths] input [output]\n"
+              << "\n"
+              << "Commands:\n"
+              << "  abx2xml  : Convert Android Binary XML to human-readable XML\n"
+              << "  xml2abx  : Convert human-readable XML to Android Binary XML\n"
+              << "  convert  : Detect the direction from the input's magic; a directory input\n"
+              << "             converts every file into the output directory (or in place)\n"
+              << "  cache-stats : Show entry count and size of a conversion cache\n"
+              << "  watch    : Keep an XML mirror of a directory of ABX files up to date\n"
+              << "             (--reverse mirrors XML as ABX)\n"
+              << "  tar      : Convert ABX members of a tar stream in memory, writing them to\n"
+              << "             a directory or passing the archive through with them replaced\n"
+              << "  carve    : Recover ABX documents from a raw image, writing each as\n"
+              << "             <offset>.abx and <offset>.xml plus an index.tsv\n"
+              << "  bench    : Time decode, decode+format and (for XML input) encode of a\n"
+              << "             file in memory; reports latency percentiles, MB/s, tokens/s\n"
+              << "             and peak RSS; --perf adds hardware counter ratios\n"
+              << "  roundtrip : Convert each file to the other format and back in memory and\n"
+              << "             report the first difference with its path; ABX input is also\n"
+              << "             checked for attribute values and types the round trip lost\n"
+              << "  generate : Write a synthetic document shaped like packages, settings,\n"
+              << "             appops or usagestats (default packages, 1M, seed 1); the\n"
+              << "             same seed always produces the same document\n"
+              << "  serve    : Run a conversion daemon on a Unix domain socket\n"
+              << "             (up to 256 connections at a time; more wait to be accepted)\n"
+              << "  client   : Convert through a running daemon; input and output are passed\n"
+              << "             as file descriptors, sent inline with --inline, or opened by\n"
+              << "             the server with --paths\n"
+              << "\n"
+              << "Options:\n"
+              << "  -i       : Overwrite input file with output\n"
+              << "  -mr      : Enable Multi-Root Processing (abx2xml only)\n"
+              << "  -z       : Gzip the output (implied by a .gz output path, and by gzip\n"
+              << "             input for -i and directory runs); gzip input is detected\n"
+              << "             by magic. Requires a build with ABX_WITH_ZLIB\n"
+              << "  --pipeline : Decode, format and write on separate threads (abx2xml only;\n"
+              << "             not combined with --cache or compression). Output that is\n"
+              << "             not a regular file, such as a pipe, uses the DOM conversion\n"
+              << "  --profile[=json] : Report time per phase (read, decode, dom, format or\n"
+              << "             parse/encode, write, teardown) on stderr\n"
+              << "  --alloc-stats[=json] : Report heap allocations per phase and per input\n"
+              << "             byte on stderr (builds with ABX_ALLOC_STATS only)\n"
+              << "  --alloc-limit <n> : With --alloc-stats, fail if there are more than n\n"
+              << "             allocations per input byte\n"
+              << "  --stats-json <file> : Write token, DataType, interning, size, depth and\n"
+              << "             phase time statistics as JSON (- for stderr)\n"
+              << "  --token-stats : Report count, bytes and cycles per token type of the\n"
+              << "             reader and writer on stderr (builds with ABX_TOKEN_STATS only)\n"
+              << "  --latency : For directory runs of convert, print per-file latency and\n"
+              << "             throughput percentiles by input size (MB/s min1% is the\n"
+              << "             1st-percentile, i.e. slowest, throughput) and the slowest files\n"
+              << "  --slowest N : Number of slowest files listed (default 10; implies --latency)\n"
+              << "  --trace <file> : Write Chrome trace events (phases, files, worker threads,\n"
+              << "             queue waits) for Perfetto or chrome://tracing at exit\n"
+              << "  --fsync  : Make output durable before replacing the target; directory\n"
+              << "             runs of convert sync once for the whole batch\n"
+              << "  --cache <dir>      : Reuse converted output for unchanged inputs (abx2xml,\n"
+              << "                       xml2abx, convert and watch)\n"
+              << "  --cache-max <size> : Evict least recently used entries above size (e.g. 512M)\n"
+              << "  --cache-hardlink   : Allow serving cache hits as hard links\n"
+              << "  --cache-stats      : Print cache hit/miss statistics to stderr\n"
+              << "\n"
+              << "Input:\n"
+              << "  Use '-' as input to read from stdin\n"
+              << "  When reading from stdin, output path must be specified\n"
+              << "\n"
+              << "Output:\n"
+              << "  Use '-' as output to write to stdout\n";
+}
+int run_cache_stats(int argc, char* argv[]) {
+    if (argc != 3) {
+        print_usage();
+        return 1;
+    }
+    try {
+        ConversionCache cache(argv[2], 0);
+        ConversionCache::Usage usage = cache.usage();
+        std::cout << "entries: " << usage.entries << "\n"
+                  << "bytes: " << usage.bytes << "\n";
+        return 0;
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+}
+int run_watch(int argc, char* argv[]) {
+    bool is_abx2xml = true;
+    bool multi_root = false;
+    bool verbose = false;
+    int debounce_ms = 200;
+    size_t jobs = WorkerPool::default_threads();
+    std::vector<std::string> paths;
+    std::string cache_dir;
+    uint64_t cache_max = 0;
+    bool cache_hardlink = false;
+    bool cache_stats = false;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--reverse") {
+            is_abx2xml = false;
+        } else if (arg == "--cache" && i + 1 < argc) {
+            cache_dir = argv[++i];
+        } else if (arg == "--cache-max" && i + 1 < argc) {
+            try {
+                cache_max = parse_size(argv[++i]);
+            } catch (const std::exception&) {
+                std::cerr << "Error: Invalid cache size '" << argv[i] << "'\n";
+                return 1;
+            }
+        } else if (arg == "--cache-hardlink") {
+            cache_hardlink = true;
+        } else if (arg == "--cache-stats") {
+            cache_stats = true;
+        } else if (arg == "-mr") {
+            multi_root = true;
+        } else if (arg == "-v") {
+            verbose = true;
+        } else if (arg == "-j" && i + 1 < argc) {
+            jobs = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--debounce" && i + 1 < argc) {
+            debounce_ms = std::atoi(argv[++i]);
+        } else {
+            paths.push_back(arg);
+        }
+    }
+    if (paths.size() != 2) {
+        std::cerr << "Error: watch requires a source and a mirror directory\n";
+        print_usage();
+        return 1;
+    }
+    if (!is_directory(paths[0])) {
+        std::cerr << "Error: '" << paths[0] << "' is not a directory\n";
+        return 1;
+    }
+    try {
+        std::unique_ptr<ConversionCache> cache;
+        if (!cache_dir.empty())
+            cache.reset(new ConversionCache(cache_dir, cache_max, cache_hardlink));
+        int rc;
+        {
+            WorkerPool pool(jobs);
+            DirectoryMirror mirror(paths[0], paths[1], is_abx2xml, multi_root, debounce_ms, verbose, pool, cache.get());
+            rc = mirror.run();
+        }
+        if (cache && cache_stats)
+            cache->print_stats(std::cerr);
+        return rc;
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+}
+int run_tar(int argc, char* argv[]) {
+    bool multi_root = false;
+    bool verbose = false;
+    std::vector<std::string> paths;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-mr") {
+            multi_root = true;
+        } else if (arg == "-v") {
+            verbose = true;
+        } else {
+            paths.push_back(arg);
+        }
+    }
+    if (paths.size() != 2) {
+        std::cerr << "Error: tar requires an input archive and an output\n";
+        print_usage();
+        return 1;
+    }
+    const std::string& output_path = paths[1];
+    bool to_directory = is_directory(output_path) || output_path.back() == '/';
+    try {
+        std::ifstream input_file;
+        if (paths[0] != "-") {
+            input_file.open(paths[0], std::ios::binary);
+            if (!input_file)
+                throw std::runtime_error("Could not open input file");
+        }
+        std::istream& input = paths[0] == "-" ? std::cin : input_file;
+        std::ofstream output_file;
+        std::unique_ptr<TarWriter> writer;
+        if (to_directory) {
+            make_dirs(output_path);
+        } else {
+            if (output_path != "-") {
+                output_file.open(output_path, std::ios::binary | std::ios::trunc);
+                if (!output_file)
+                    throw std::runtime_error("Could not open output file");
+            }
+            writer.reset(new TarWriter(output_path == "-" ? std::cout : output_file));
+        }
+        TarReader reader(input);
+        TarEntry entry;
+        size_t converted = 0;
+        size_t failed = 0;
+        while (reader.next(entry)) {
+            bool is_abx = entry.is_regular() && has_abx_magic(entry.data);
+            if (!is_abx) {
+                if (writer)
+                    writer->write_streamed(entry, reader);
+                continue;
+            }
+            reader.read_body(entry);
+            std::string xml;
+            try {
+                xml = convert_buffer(true, entry.data, multi_root);
+            } catch (const std::exception& e) {
+                std::cerr << "Error: " << entry.name << ": " << e.what() << std::endl;
+                failed++;
+                is_abx = false;
+            }
+            if (writer) {
+                if (is_abx)
+                    writer->write_replaced(entry, xml);
+                else
+                    writer->write(entry);
+            } else if (is_abx) {
+                if (!is_safe_member_path(entry.name)) {
+                    std::cerr << "Error: Refusing unsafe member path '" << entry.name << "'" << std::endl;
+                    failed++;
+                    continue;
+                }
+                std::string target = output_path + "/" + entry.name;
+                size_t slash = target.find_last_of('/');
+                make_dirs(target.substr(0, slash));
+                write_output_file(target, xml);
+            }
+            if (is_abx) {
+                converted++;
+                if (verbose)
+                    std::cerr << "converted " << entry.name << std::endl;
+            }
+        }
+        if (writer)
+            writer->finish();
+        if (verbose)
+            std::cerr << converted << " members converted, " << failed << " failed" << std::endl;
+        return failed == 0 ? 0 : 1;
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+}
+int run_carve(int argc, char* argv[]) {
+    uint64_t window_size = 64ULL << 20;
+    uint64_t max_doc = 16ULL << 20;
+    size_t jobs = WorkerPool::default_threads();
+    std::vector<std::string> paths;
+    try {
+        for (int i = 2; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "-j" && i + 1 < argc) {
+                jobs = std::strtoul(argv[++i], nullptr, 10);
+            } else if (arg == "--window" && i + 1 < argc) {
+                window_size = parse_size(argv[++i]);
+            } else if (arg == "--max-doc" && i + 1 < argc) {
+                max_doc = parse_size(argv[++i]);
+            } else {
+                paths.push_back(arg);
+            }
+        }
+        if (paths.size() != 2) {
+            std::cerr << "Error: carve requires an image and an output directory\n";
+            print_usage();
+            return 1;
+        }
+        WorkerPool pool(jobs);
+        AbxCarver carver(paths[0], paths[1], window_size, max_doc);
+        auto found = carver.run(pool);
+        std::cerr << "Recovered " << found.size() << " documents into " << paths[1] << std::endl;
+        return 0;
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+}
+int run_generate(int argc, char* argv[]) {
+    CorpusGenerator::Shape shape = CorpusGenerator::Shape::PACKAGES;
+    uint64_t target_size = 1ULL << 20;
+    uint64_t seed = 1;
+    bool xml_output = false;
+    std::string output_path;
+    try {
+        for (int i = 2; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--shape" && i + 1 < argc) {
+                if (!CorpusGenerator::parse_shape(argv[++i], shape)) {
+                    std::cerr << "Error: Unknown shape " << argv[i] << "\n";
+                    return 1;
+                }
+            } else if (arg == "--size" && i + 1 < argc) {
+                target_size = parse_size(argv[++i]);
+            } else if (arg == "--seed" && i + 1 < argc) {
+                seed = std::stoull(argv[++i]);
+            } else if (arg == "--format" && i + 1 < argc) {
+                std::string format = argv[++i];
+                if (format != "abx" && format != "xml") {
+                    std::cerr << "Error: Format must be abx or xml\n";
+                    return 1;
+                }
+                xml_output = (format == "xml");
+            } else if (output_path.empty()) {
+                output_path = arg;
+            } else {
+                print_usage();
+                return 1;
+            }
+        }
+        if (output_path.empty()) {
+            std::cerr << "Error: generate requires an output path\n";
+            print_usage();
+            return 1;
+        }
+        std::unique_ptr<std::ofstream> file;
+        std::ostream* target = &std::cout;
+        if (output_path != "-") {
+            file.reset(new std::ofstream(output_path, std::ios::binary));
+            if (!*file)
+                throw std::runtime_error("Could not open output file");
+            target = file.get();
+        }
+        CountingStreamBuf counter(target->rdbuf());
+        std::ostream out(&counter);
+        auto written = [&counter]() { return counter.count(); };
+        CorpusGenerator generator(shape, seed);
+        if (xml_output) {
+            XmlTextWriter writer(out);
+            generator.generate(writer, target_size, written);
+        } else {
+            AbxWriter writer(out);
+            generator.generate(writer, target_size, written);
+        }
+        if (!out.flush() || !target->flush())
+            throw std::runtime_error("Could not write output");
+        return 0;
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+}
+// Returns input inflated if it is gzip-compressed, otherwise unchanged.
+std::string inflate_if_gzip(const std::string& input) {
+    if (!has_gzip_magic(input))
+        return input;
+#ifdef ABX_WITH_ZLIB
+    GzipInputBuf gzip_in(input.data(), input.size());
+    std::string plain((std::istreambuf_iterator<char>(&gzip_in)), std::istreambuf_iterator<char>());
+    if (!gzip_in.error().empty())
+        throw std::runtime_error(gzip_in.error());
+    return plain;
+#else
+    throw std::runtime_error("Compressed input requires a build with ABX_WITH_ZLIB");
+#endif
+}
+// Token, DataType and interning statistics of an ABX document for --stats-json,
+// gathered by walking the encoded bytes without decoding values. Both
+// directions report on their ABX side: the input of abx2xml, the output of
+// xml2abx.
+struct AbxDocumentStats {
+    uint64_t xml_types[16] = {};
+    uint64_t data_types[16] = {};
+    uint64_t interned_new = 0;
+    uint64_t interned_refs = 0;
+    uint64_t elements = 0;
+    uint64_t max_depth = 0;
+    void scan(const std::string& abx) {
+        const unsigned char* data = reinterpret_cast<const unsigned char*>(abx.data());
+        size_t size = abx.size();
+        size_t pos = static_cast<size_t>(AbxReader(abx.data(), size).skip_header());
+        auto need = [&](size_t bytes) {
+            if (size - pos < bytes)
+                throw AbxDecodeError("Truncated document");
+        };
+        auto read_u16 = [&]() {
+            need(2);
+            uint16_t value = static_cast<uint16_t>((data[pos] << 8) | data[pos + 1]);
+            pos += 2;
+            return value;
+        };
+        auto skip_interned = [&]() {
+            if (read_u16() == 0xffff) {
+                ++interned_new;
+                size_t length = read_u16();
+                need(length);
+                pos += length;
+            } else {
+                ++interned_refs;
+            }
+        };
+        uint64_t depth = 0;
+        while (pos < size) {
+            uint8_t token = data[pos++];
+            uint8_t xml_type = token & 0x0f;
+            uint8_t data_type = token >> 4;
+            ++xml_types[xml_type];
+            ++data_types[data_type];
+            if (xml_type == static_cast<uint8_t>(XmlType::END_DOCUMENT))
+                break;
+            if (xml_type == static_cast<uint8_t>(XmlType::START_TAG)) {
+                ++elements;
+                max_depth = std::max(max_depth, ++depth);
+            } else if (xml_type == static_cast<uint8_t>(XmlType::END_TAG) && depth > 0) {
+                --depth;
+            }
+            if (xml_type == static_cast<uint8_t>(XmlType::ATTRIBUTE))
+                skip_interned();
+            switch (static_cast<DataType>(token & 0xf0)) {
+                case DataType::TYPE_STRING:
+                case DataType::TYPE_BYTES_HEX:
+                case DataType::TYPE_BYTES_BASE64: {
+                    size_t length = read_u16();
+                    need(length);
+                    pos += length;
+                    break;
+                }
+                case DataType::TYPE_STRING_INTERNED:
+                    skip_interned();
+                    break;
+                case DataType::TYPE_INT:
+                case DataType::TYPE_INT_HEX:
+                case DataType::TYPE_FLOAT:
+                    need(4);
+                    pos += 4;
+                    break;
+                case DataType::TYPE_LONG:
+                case DataType::TYPE_LONG_HEX:
+                case DataType::TYPE_DOUBLE:
+                    need(8);
+                    pos += 8;
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+    // One JSON object; phases come from the run's PhaseProfile in milliseconds.
+    void write_json(std::ostream& out, const std::string& direction, uint64_t bytes_in, uint64_t bytes_out,
+                    const std::vector<std::pair<std::string, double>>& phases) const {
+        std::ostringstream text;
+        text << std::fixed << std::setprecision(3);
+        text << "{\"direction\":\"" << direction << "\",\"bytes_in\":" << bytes_in << ",\"bytes_out\":" << bytes_out
+             << ",\"elements\":" << elements << ",\"max_depth\":" << max_depth << ",\"tokens\":{";
+        const char* separator = "";
+        for (int i = 0; i < 16; ++i) {
+            if (xml_types[i]) {
+                text << separator << "\"" << XML_TYPE_NAMES[i] << "\":" << xml_types[i];
+                separator = ",";
+            }
+        }
+        text << "},\"data_types\":{";
+        separator = "";
+        for (int i = 0; i < 16; ++i) {
+            if (data_types[i]) {
+                text << separator << "\"" << DATA_TYPE_NAMES[i] << "\":" << data_types[i];
+                separator = ",";
+            }
+        }
+        uint64_t lookups = interned_new + interned_refs;
+        text << "},\"intern_table\":{\"size\":" << interned_new << ",\"lookups\":" << lookups
+             << ",\"hit_rate\":" << (lookups ? static_cast<double>(interned_refs) / lookups : 0) << "},\"phases_ms\":{";
+        double total = 0;
+        for (size_t i = 0; i < phases.size(); ++i) {
+            text << (i ? "," : "") << "\"" << phases[i].first << "\":" << phases[i].second;
+            total += phases[i].second;
+        }
+        text << "},\"total_ms\":" << total << "}\n";
+        out << text.str() << std::flush;
+    }
+};
+// Hardware counters from perf_event_open for the calling thread, user space
+// only. Each counter is opened on its own so one the CPU or kernel does not
+// offer (or perf_event_paranoid forbids) is reported as unavailable without
+// losing the others; multiplexed counts are scaled by their running time.
+class PerfCounters {
+public:
+    enum Counter { CYCLES, INSTRUCTIONS, BRANCH_MISSES, L1D_MISSES, LLC_MISSES, COUNTER_COUNT };
+    struct Sample {
+        bool valid[COUNTER_COUNT] = {};
+        double value[COUNTER_COUNT] = {};
+        bool has(Counter counter) const {
+            return valid[counter];
+        }
+        double operator[](Counter counter) const {
+            return value[counter];
+        }
+    };
+    PerfCounters() {
+        for (int i = 0; i < COUNTER_COUNT; ++i)
+            fds[i] = -1;
+#ifdef __linux__
+        const uint64_t l1d_read_miss = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                       (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        fds[CYCLES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        fds[INSTRUCTIONS] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        fds[BRANCH_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+        fds[L1D_MISSES] = open_counter(PERF_TYPE_HW_CACHE, l1d_read_miss);
+        fds[LLC_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+#else
+        open_errno = ENOSYS;
+#endif
+    }
+    ~PerfCounters() {
+        for (int fd : fds) {
+            if (fd >= 0)
+                close(fd);
+        }
+    }
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+    // Why the first unavailable counter could not be opened.
+    std::string error() const {
+        return open_errno ? strerror(open_errno) : "";
+    }
+    bool available() const {
+        for (int fd : fds) {
+            if (fd >= 0)
+                return true;
+        }
+        return false;
+    }
+    void start() {
+#ifdef __linux__
+        for (int fd : fds) {
+            if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+    }
+    Sample stop() {
+        Sample sample;
+#ifdef __linux__
+        for (int fd : fds) {
+            if (fd >= 0)
+                ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        }
+        for (int i = 0; i < COUNTER_COUNT; ++i) {
+            uint64_t values[3];
+            if (fds[i] < 0 || read(fds[i], values, sizeof(values)) != sizeof(values) || values[2] == 0)
+                continue;
+            sample.valid[i] = true;
+            sample.value[i] = static_cast<double>(values[0]) * values[1] / values[2];
+        }
+#endif
+        return sample;
+    }
+    static const char* name(Counter counter) {
+        static const char* names[] = {"cycles", "instructions", "branch-misses", "L1d-misses", "LLC-misses"};
+        return names[counter];
+    }
+private:
+    int fds[COUNTER_COUNT];
+    int open_errno = 0;
+#ifdef __linux__
+    int open_counter(uint32_t type, uint64_t config) {
+        perf_event_attr attr = {};
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+        if (fd < 0 && open_errno == 0)
+            open_errno = errno;
+        return fd;
+    }
+#endif
+};
+// Times one in-memory operation repeatedly; latencies are in seconds.
+// With counters, their totals over all timed iterations are kept in perf.
+struct BenchSeries {
+    std::string name;
+    std::vector<double> latencies;
+    uint64_t bytes = 0;
+    uint64_t tokens = 0;
+    PerfCounters::Sample perf;
+    double percentile(double fraction) const {
+        std::vector<double> sorted = latencies;
+        std::sort(sorted.begin(), sorted.end());
+        size_t index = static_cast<size_t>(std::ceil(fraction * sorted.size()));
+        return sorted[std::min(sorted.size(), std::max<size_t>(index, 1)) - 1];
+    }
+};
+template <typename Fn>
+BenchSeries time_repeatedly(const std::string& name, int iterations, uint64_t bytes, uint64_t tokens, PerfCounters* counters, Fn fn) {
+    BenchSeries series;
+    series.name = name;
+    series.bytes = bytes;
+    series.tokens = tokens;
+    fn();
+    for (int i = 0; i < iterations; ++i) {
+        if (counters)
+            counters->start();
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        series.latencies.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        if (counters) {
+            PerfCounters::Sample sample = counters->stop();
+            for (int c = 0; c < PerfCounters::COUNTER_COUNT; ++c) {
+                series.perf.valid[c] = sample.valid[c] && (i == 0 || series.perf.valid[c]);
+                series.perf.value[c] += sample.value[c];
+            }
+        }
+    }
+    return series;
+}
+// Prints cycles/byte, IPC and per-token misses from counter totals over
+// the given bytes and tokens; counters that could not be read show as n/a.
+void print_perf_ratios(std::ostream& out, const PerfCounters::Sample& perf, double bytes, double tokens) {
+    auto ratio = [&](bool valid, double value) {
+        std::ostringstream cell;
+        if (valid)
+            cell << std::fixed << std::setprecision(3) << value;
+        else
+            cell << "n/a";
+        return cell.str();
+    };
+    using C = PerfCounters;
+    out << std::setw(10) << ratio(perf.has(C::CYCLES) && bytes > 0, perf[C::CYCLES] / bytes)
+        << std::setw(8) << ratio(perf.has(C::CYCLES) && perf.has(C::INSTRUCTIONS) && perf[C::CYCLES] > 0,
+                                 perf[C::INSTRUCTIONS] / perf[C::CYCLES])
+        << std::setw(12) << ratio(perf.has(C::BRANCH_MISSES) && tokens > 0, perf[C::BRANCH_MISSES] / tokens)
+        << std::setw(10) << ratio(perf.has(C::L1D_MISSES) && tokens > 0, perf[C::L1D_MISSES] / tokens)
+        << std::setw(10) << ratio(perf.has(C::LLC_MISSES) && tokens > 0, perf[C::LLC_MISSES] / tokens);
+}
+void print_perf_header(std::ostream& out) {
+    out << std::setw(10) << "cyc/B" << std::setw(8) << "IPC" << std::setw(12) << "brmiss/tok"
+        << std::setw(10) << "L1d/tok" << std::setw(10) << "LLC/tok";
+}
+uint64_t peak_rss_bytes() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+}
+int run_bench(int argc, char* argv[]) {
+    int iterations = 20;
+    bool multi_root = false;
+    bool use_perf = false;
+    std::string input_path;
+    try {
+        for (int i = 2; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "-n" && i + 1 < argc) {
+                iterations = std::max(1, std::atoi(argv[++i]));
+            } else if (arg == "--perf") {
+                use_perf = true;
+            } else if (arg == "-mr") {
+                multi_root = true;
+            } else if (input_path.empty()) {
+                input_path = arg;
+            } else {
+                print_usage();
+                return 1;
+            }
+        }
+        if (input_path.empty()) {
+            std::cerr << "Error: bench requires an input file\n";
+            print_usage();
+            return 1;
+        }
+        std::string input = inflate_if_gzip(read_input_file(input_path));
+        InputFormat format = sniff_format(input);
+        if (format == InputFormat::UNKNOWN)
+            throw std::runtime_error("Input is neither ABX nor XML");
+        std::vector<BenchSeries> results;
+        std::string abx;
+        if (format == InputFormat::XML) {
+            std::ostringstream encoded;
+            XmlToAbxConverter::convert_content(input, encoded);
+            abx = encoded.str();
+        } else {
+            abx.swap(input);
+        }
+        TokenCounter counter;
+        AbxReader(abx.data(), abx.size()).read_events(counter, multi_root);
+        std::unique_ptr<PerfCounters> perf;
+        if (use_perf) {
+            perf.reset(new PerfCounters());
+            if (!perf->available()) {
+                std::cerr << "Hardware counters unavailable: " << perf->error() << std::endl;
+                perf.reset();
+            }
+        }
+        if (format == InputFormat::XML) {
+            results.push_back(time_repeatedly("encode", iterations, input.size(), counter.tokens, perf.get(), [&] {
+                CountingStreamBuf discard(nullptr);
+                std::ostream out(&discard);
+                XmlToAbxConverter::convert_content(input, out);
+            }));
+        }
+        results.push_back(time_repeatedly("decode", iterations, abx.size(), counter.tokens, perf.get(), [&] {
+            TokenCounter tokens;
+            AbxReader(abx.data(), abx.size()).read_events(tokens, multi_root);
+        }));
+        results.push_back(time_repeatedly("decode+format", iterations, abx.size(), counter.tokens, perf.get(), [&] {
+            AbxReader reader(abx.data(), abx.size());
+            auto root = reader.read(multi_root);
+            CountingStreamBuf discard(nullptr);
+            std::ostream out(&discard);
+            reader.print_xml(out, root);
+        }));
+        std::cout << input_path << ": " << (format == InputFormat::XML ? "XML, " + std::to_string(input.size()) + " bytes, " : "")
+                  << "ABX " << abx.size() << " bytes, " << counter.tokens << " tokens, "
+                  << iterations << " iterations\n";
+        std::cout << std::left << std::setw(15) << "phase" << std::right
+                  << std::setw(11) << "min ms" << std::setw(11) << "median ms" << std::setw(11) << "p99 ms"
+                  << std::setw(11) << "MB/s" << std::setw(13) << "Mtokens/s";
+        if (perf)
+            print_perf_header(std::cout);
+        std::cout << "\n";
+        std::cout << std::fixed << std::setprecision(3);
+        for (const auto& series : results) {
+            double median = series.percentile(0.5);
+            std::cout << std::left << std::setw(15) << series.name << std::right
+                      << std::setw(11) << series.percentile(0) * 1e3
+                      << std::setw(11) << median * 1e3
+                      << std::setw(11) << series.percentile(0.99) * 1e3
+                      << std::setw(11) << series.bytes / median / 1e6
+                      << std::setw(13) << series.tokens / median / 1e6;
+            if (perf)
+                print_perf_ratios(std::cout, series.perf, static_cast<double>(series.bytes) * iterations,
+                                  static_cast<double>(series.tokens) * iterations);
+            std::cout << "\n";
+        }
+        std::cout << "peak RSS: " << peak_rss_bytes() / 1024 << " KiB\n";
+        return 0;
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+}
+// Reduces a parsed XML tree to what ABX can carry: comments are dropped and
+// text and CDATA are joined into the element's text.
+std::shared_ptr<XMLElement> element_from_node(const XmlNode& node) {
+    auto element = std::make_shared<XMLElement>(node.name);
+    for (const auto& attr : node.attributes)
+        element->attrib[attr.first] = attr.second;
+    for (const auto& child : node.children) {
+        if (child.type == XmlNode::Type::ELEMENT)
+            element->add_child(element_from_node(child));
+        else if (child.type == XmlNode::Type::TEXT || child.type == XmlNode::Type::CDATA)
+            element->text += child.text;
+    }
+    return element;
+}
+// Describes the first difference between two trees as "<path>: <what>", or
+// returns an empty string when they match. Attribute order is not significant;
+// paths index same-named siblings from 1, as XPath does.
+std::string first_divergence(const XMLElement& expected, const XMLElement& actual, const std::string& parent_path, size_t index = 1) {
+    std::string path = parent_path + "/" + expected.tag + "[" + std::to_string(index) + "]";
+    if (expected.tag != actual.tag)
+        return path + ": element became <" + actual.tag + ">";
+    std::map<std::string, std::string> expected_attrib(expected.attrib.begin(), expected.attrib.end());
+    for (const auto& [name, value] : expected_attrib) {
+        auto it = actual.attrib.find(name);
+        if (it == actual.attrib.end())
+            return path + ": attribute " + name + " lost";
+        if (it->second != value)
+            return path + ": attribute " + name + " changed from \"" + value + "\" to \"" + it->second + "\"";
+    }
+    std::map<std::string, std::string> actual_attrib(actual.attrib.begin(), actual.attrib.end());
+    for (const auto& [name, value] : actual_attrib) {
+        if (!expected.attrib.count(name))
+            return path + ": attribute " + name + " added";
+    }
+    if (expected.text != actual.text)
+        return path + ": text changed from \"" + expected.text + "\" to \"" + actual.text + "\"";
+    std::map<std::string, size_t> seen;
+    size_t common = std::min(expected.children.size(), actual.children.size());
+    for (size_t i = 0; i < common; ++i) {
+        std::string divergence = first_divergence(*expected.children[i], *actual.children[i], path, ++seen[expected.children[i]->tag]);
+        if (!divergence.empty())
+            return divergence;
+    }
+    if (expected.children.size() != actual.children.size())
+        return path + ": " + std::to_string(expected.children.size()) + " children became " + std::to_string(actual.children.size());
+    return "";
+}
+// Attributes of one element as stored in ABX: the DataType and payload bytes
+// of each, with interned strings resolved.
+struct TypedAttributes {
+    std::string path;
+    std::map<std::string, std::pair<uint8_t, std::string>> values;
+};
+// Walks the raw tokens of an ABX document and collects every element's typed
+// attributes in document order, with the same paths as first_divergence.
+std::vector<TypedAttributes> typed_attributes(const std::string& abx, bool multi_root) {
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(abx.data());
+    size_t size = abx.size();
+    size_t pos = static_cast<size_t>(AbxReader(abx.data(), abx.size()).skip_header());
+    auto need = [&](size_t bytes) {
+        if (size - pos < bytes)
+            throw AbxDecodeError("Truncated document");
+    };
+    auto read_u16 = [&]() {
+        need(2);
+        uint16_t value = static_cast<uint16_t>((data[pos] << 8) | data[pos + 1]);
+        pos += 2;
+        return value;
+    };
+    auto read_raw = [&]() {
+        size_t length = read_u16();
+        need(length);
+        std::string value(reinterpret_cast<const char*>(data + pos), length);
+        pos += length;
+        return value;
+    };
+    std::vector<std::string> interned;
+    auto read_interned = [&]() {
+        uint16_t reference = read_u16();
+        if (reference == 0xffff) {
+            interned.push_back(read_raw());
+            return interned.back();
+        }
+        if (reference >= interned.size())
+            throw AbxDecodeError("Invalid interned string reference");
+        return interned[reference];
+    };
+    auto read_payload = [&](uint8_t data_type) {
+        switch (static_cast<DataType>(data_type)) {
+            case DataType::TYPE_STRING:
+            case DataType::TYPE_BYTES_HEX:
+            case DataType::TYPE_BYTES_BASE64:
+                return read_raw();
+            case DataType::TYPE_STRING_INTERNED:
+                return read_interned();
+            case DataType::TYPE_INT:
+            case DataType::TYPE_INT_HEX:
+            case DataType::TYPE_FLOAT:
+                need(4);
+                pos += 4;
+                return std::string(reinterpret_cast<const char*>(data + pos - 4), 4);
+            case DataType::TYPE_LONG:
+            case DataType::TYPE_LONG_HEX:
+            case DataType::TYPE_DOUBLE:
+                need(8);
+                pos += 8;
+                return std::string(reinterpret_cast<const char*>(data + pos - 8), 8);
+            default:
+                return std::string();
+        }
+    };
+    struct Frame {
+        size_t entry;
+        std::map<std::string, size_t> seen;
+    };
+    std::vector<TypedAttributes> elements;
+    std::vector<Frame> stack;
+    auto open = [&](const std::string& tag) {
+        std::string parent = stack.empty() ? "" : elements[stack.back().entry].path;
+        size_t index = stack.empty() ? 1 : ++stack.back().seen[tag];
+        elements.push_back({parent + "/" + tag + "[" + std::to_string(index) + "]", {}});
+        stack.push_back({elements.size() - 1, {}});
+    };
+    if (multi_root)
+        open("root");
+    while (pos < size) {
+        uint8_t token = data[pos++];
+        uint8_t xml_type = token & 0x0f;
+        uint8_t data_type = token & 0xf0;
+        if (xml_type == static_cast<uint8_t>(XmlType::END_DOCUMENT))
+            break;
+        if (xml_type == static_cast<uint8_t>(XmlType::START_TAG)) {
+            open(read_interned());
+        } else if (xml_type == static_cast<uint8_t>(XmlType::END_TAG)) {
+            read_interned();
+            if (stack.size() > (multi_root ? 1u : 0u))
+                stack.pop_back();
+        } else if (xml_type == static_cast<uint8_t>(XmlType::ATTRIBUTE)) {
+            std::string name = read_interned();
+            std::string payload = read_payload(data_type);
+            if (stack.empty())
+                throw AbxDecodeError("Unexpected ATTRIBUTE");
+            elements[stack.back().entry].values[name] = {data_type, std::move(payload)};
+        } else {
+            read_payload(data_type);
+        }
+    }
+    return elements;
+}
+uint64_t big_endian_value(const std::string& raw) {
+    uint64_t value = 0;
+    for (unsigned char byte : raw)
+        value = (value << 8) | byte;
+    return value;
+}
+// A typed ABX value as text: exactly as abx2xml renders it, or with exact
+// set, with enough digits to identify a float or double uniquely.
+std::string typed_value_text(uint8_t data_type, const std::string& raw, bool exact) {
+    uint64_t bits = big_endian_value(raw);
+    char buffer[64];
+    switch (static_cast<DataType>(data_type)) {
+        case DataType::TYPE_NULL:
+            return "null";
+        case DataType::TYPE_BOOLEAN_TRUE:
+            return "true";
+        case DataType::TYPE_BOOLEAN_FALSE:
+            return "false";
+        case DataType::TYPE_INT:
+            return std::to_string(static_cast<int32_t>(bits));
+        case DataType::TYPE_LONG:
+            return std::to_string(static_cast<int64_t>(bits));
+        case DataType::TYPE_INT_HEX:
+        case DataType::TYPE_LONG_HEX:
+            snprintf(buffer, sizeof(buffer), "%llx", static_cast<unsigned long long>(bits));
+            return buffer;
+        case DataType::TYPE_FLOAT: {
+            uint32_t narrow = static_cast<uint32_t>(bits);
+            float value;
+            memcpy(&value, &narrow, 4);
+            if (!exact)
+                return std::to_string(value);
+            snprintf(buffer, sizeof(buffer), "%.9g", value);
+            return buffer;
+        }
+        case DataType::TYPE_DOUBLE: {
+            double value;
+            memcpy(&value, &bits, 8);
+            if (!exact)
+                return std::to_string(value);
+            snprintf(buffer, sizeof(buffer), "%.17g", value);
+            return buffer;
+        }
+        case DataType::TYPE_BYTES_HEX: {
+            static const char digits[] = "0123456789abcdef";
+            std::string text;
+            for (unsigned char byte : raw) {
+                text += digits[byte >> 4];
+                text += digits[byte & 0x0f];
+            }
+            return text;
+        }
+        case DataType::TYPE_BYTES_BASE64:
+            return base64_encode(reinterpret_cast<const unsigned char*>(raw.data()), raw.size());
+        default:
+            return raw;
+    }
+}
+// Whether a value that may have changed type still holds the original value:
+// floats and doubles must parse back to the same bits, everything else must
+// read exactly as the original renders.
+bool same_typed_value(uint8_t expected_type, const std::string& expected_raw, uint8_t actual_type,
+                      const std::string& actual_raw) {
+    std::string actual = typed_value_text(actual_type, actual_raw, true);
+    if (expected_type == static_cast<uint8_t>(DataType::TYPE_FLOAT) ||
+        expected_type == static_cast<uint8_t>(DataType::TYPE_DOUBLE)) {
+        if (actual_type == expected_type)
+            return actual_raw == expected_raw;
+        char* end = nullptr;
+        double parsed = strtod(actual.c_str(), &end);
+        if (actual.empty() || *end != '\0')
+            return false;
+        if (expected_type == static_cast<uint8_t>(DataType::TYPE_FLOAT)) {
+            float narrow = static_cast<float>(parsed);
+            uint32_t bits;
+            memcpy(&bits, &narrow, 4);
+            return bits == static_cast<uint32_t>(big_endian_value(expected_raw));
+        }
+        uint64_t bits;
+        memcpy(&bits, &parsed, 8);
+        return bits == big_endian_value(expected_raw);
+    }
+    return actual == typed_value_text(expected_type, expected_raw, false);
+}
+// Plain and interned strings are the same type for a round trip.
+uint8_t comparable_type(uint8_t data_type) {
+    return data_type == static_cast<uint8_t>(DataType::TYPE_STRING_INTERNED)
+               ? static_cast<uint8_t>(DataType::TYPE_STRING)
+               : data_type;
+}
+// Compares the typed attributes of an ABX document with those of its round
+// trip, whose structure already matched. Lost values are reported before
+// lost types, since a type change alone keeps the data.
+std::string typed_divergence(const std::string& original, const std::string& roundtrip, bool multi_root) {
+    auto expected = typed_attributes(original, multi_root);
+    auto actual = typed_attributes(roundtrip, false);
+    if (expected.size() != actual.size())
+        return "document has " + std::to_string(expected.size()) + " elements but its round trip has " +
+               std::to_string(actual.size());
+    for (bool values : {true, false}) {
+        for (size_t i = 0; i < expected.size(); ++i) {
+            for (const auto& [name, value] : expected[i].values) {
+                auto it = actual[i].values.find(name);
+                if (it == actual[i].values.end())
+                    return expected[i].path + ": attribute " + name + " lost";
+                uint8_t type = value.first;
+                uint8_t actual_type = it->second.first;
+                if (values && !same_typed_value(type, value.second, actual_type, it->second.second))
+                    return expected[i].path + ": attribute " + name + " (" + DATA_TYPE_NAMES[type >> 4] + " " +
+                           typed_value_text(type, value.second, true) + ") became \"" +
+                           typed_value_text(actual_type, it->second.second, true) + "\"";
+                if (!values && comparable_type(type) != comparable_type(actual_type))
+                    return expected[i].path + ": attribute " + name + " changed type from " +
+                           DATA_TYPE_NAMES[type >> 4] + " to " + DATA_TYPE_NAMES[actual_type >> 4];
+            }
+        }
+    }
+    return "";
+}
+// Converts input to the other format and back in memory and compares the
+// trees. XML is compared after parsing. ABX is compared after decoding and
+// then by the typed value and DataType of every attribute, so conversions
+// that lose precision or types are reported too.
+std::string roundtrip_divergence(const std::string& input, InputFormat format, bool multi_root) {
+    if (format == InputFormat::XML) {
+        XmlParser parser;
+        auto original = element_from_node(parser.parse(input));
+        std::ostringstream abx;
+        XmlToAbxConverter::convert_content(input, abx);
+        std::string abx_data = abx.str();
+        AbxReader reader(abx_data.data(), abx_data.size());
+        std::ostringstream xml;
+        reader.print_xml(xml, reader.read());
+        XmlParser reparser;
+        return first_divergence(*original, *element_from_node(reparser.parse(xml.str())), "");
+    }
+    AbxReader reader(input.data(), input.size());
+    auto original = reader.read(multi_root);
+    std::ostringstream xml;
+    reader.print_xml(xml, original);
+    std::ostringstream abx;
+    XmlToAbxConverter::convert_content(xml.str(), abx);
+    std::string abx_data = abx.str();
+    AbxReader rereader(abx_data.data(), abx_data.size());
+    std::string divergence = first_divergence(*original, *rereader.read(), "");
+    if (!divergence.empty())
+        return divergence;
+    return typed_divergence(input, abx_data, multi_root);
+}
+int run_roundtrip(int argc, char* argv[]) {
+    bool multi_root = false;
+    bool verbose = false;
+    size_t jobs = WorkerPool::default_threads();
+    std::vector<std::string> inputs;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-mr") {
+            multi_root = true;
+        } else if (arg == "-v") {
+            verbose = true;
+        } else if (arg == "-j" && i + 1 < argc) {
+            jobs = std::strtoul(argv[++i], nullptr, 10);
+        } else {
+            inputs.push_back(arg);
+        }
+    }
+    if (inputs.empty()) {
+        std::cerr << "Error: roundtrip requires at least one file or directory\n";
+        print_usage();
+        return 1;
+    }
+    std::atomic<size_t> identical(0);
+    std::atomic<size_t> diverged(0);
+    std::atomic<size_t> skipped(0);
+    std::atomic<size_t> failed(0);
+    auto check = [&](const std::string& path) {
+        try {
+            std::string input = inflate_if_gzip(read_input_file(path));
+            InputFormat format = sniff_format(input);
+            if (format == InputFormat::UNKNOWN) {
+                skipped++;
+                return;
+            }
+            std::string divergence = roundtrip_divergence(input, format, multi_root);
+            if (divergence.empty()) {
+                identical++;
+                if (verbose)
+                    std::cerr << "ok " << path << std::endl;
+            } else {
+                diverged++;
+                std::cout << (path + ": " + divergence + "\n") << std::flush;
+            }
+        } catch (const std::exception& e) {
+            failed++;
+            std::cerr << ("Error: " + path + ": " + e.what() + "\n");
+        }
+    };
+    {
+        WorkerPool pool(jobs);
+        for (const auto& input : inputs) {
+            if (!is_directory(input)) {
+                pool.submit([&check, input] { check(input); });
+                continue;
+            }
+            walk_files(input, "", [&](const std::string& rel) {
+                pool.submit([&check, path = input + "/" + rel] { check(path); });
+            });
+        }
+        pool.wait_idle();
+    }
+    std::cerr << identical << " identical, " << diverged << " diverged, " << failed << " failed, "
+              << skipped << " skipped" << std::endl;
+    return diverged == 0 && failed == 0 ? 0 : 1;
+}
+int run_serve(int argc, char* argv[]) {
+    size_t jobs = WorkerPool::default_threads();
+    std::string socket_path;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-j" && i + 1 < argc) {
+            jobs = std::strtoul(argv[++i], nullptr, 10);
+        } else if (socket_path.empty()) {
+            socket_path = arg;
+        } else {
+            std::cerr << "Error: Too many arguments\n";
+            print_usage();
+            return 1;
+        }
+    }
+    try {
+        WorkerPool pool(jobs);
+        ConversionServer server(socket_path, pool);
+        return server.run();
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+}
+int run_client(int argc, char* argv[]) {
+    if (argc < 5) {
+        print_usage();
+        return 1;
+    }
+    std::string socket_path = argv[2];
+    std::string command = argv[3];
+    if (command != "abx2xml" && command != "xml2abx") {
+        std::cerr << "Error: Invalid command. Use 'abx2xml' or 'xml2abx'\n";
+        return 1;
+    }
+    bool is_abx2xml = (command == "abx2xml");
+    bool multi_root = false;
+    ServeTransport transport = ServeTransport::FDS;
+    std::string input_path;
+    std::string output_path;
+    for (int i = 4; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-mr" && is_abx2xml) {
+            multi_root = true;
+        } else if (arg == "--inline") {
+            transport = ServeTransport::INLINE;
+        } else if (arg == "--paths") {
+            transport = ServeTransport::PATHS;
+        } else if (input_path.empty()) {
+            input_path = arg;
+        } else if (output_path.empty()) {
+            output_path = arg;
+        } else {
+            std::cerr << "Error: Too many arguments\n";
+            print_usage();
+            return 1;
+        }
+    }
+    if (output_path.empty())
+        output_path = is_abx2xml ? "-" : input_path + ".abx";
+    try {
+        return serve_client_request(socket_path, is_abx2xml, multi_root, transport, input_path, output_path);
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+}
+int run_convert(int argc, char* argv[]) {
+    bool multi_root = false;
+    bool overwrite_input = false;
+    bool sync_output = false;
+    bool compress_output = false;
+    bool verbose = false;
+    bool latency_report = false;
+    size_t slowest_count = 10;
+    size_t jobs = WorkerPool::default_threads();
+    std::string input_path;
+    std::string output_path;
+    std::string cache_dir;
+    uint64_t cache_max = 0;
+    bool cache_hardlink = false;
+    bool cache_stats = false;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-mr") {
+            multi_root = true;
+        } else if (arg == "-i") {
+            overwrite_input = true;
+        } else if (arg == "--cache" && i + 1 < argc) {
+            cache_dir = argv[++i];
+        } else if (arg == "--cache-max" && i + 1 < argc) {
+            try {
+                cache_max = parse_size(argv[++i]);
+            } catch (const std::exception&) {
+                std::cerr << "Error: Invalid cache size '" << argv[i] << "'\n";
+                return 1;
+            }
+        } else if (arg == "--cache-hardlink") {
+            cache_hardlink = true;
+        } else if (arg == "--cache-stats") {
+            cache_stats = true;
+        } else if (arg == "-v") {
+            verbose = true;
+        } else if (arg == "--latency") {
+            latency_report = true;
+        } else if (arg == "--slowest" && i + 1 < argc) {
+            latency_report = true;
+            slowest_count = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--trace" && i + 1 < argc) {
+            Trace::enable(argv[++i]);
+            Trace::name_thread("main");
+        } else if (arg == "--fsync") {
+            sync_output = true;
+        } else if (arg == "-z") {
+            compress_output = true;
+        } else if (arg == "-j" && i + 1 < argc) {
+            jobs = std::strtoul(argv[++i], nullptr, 10);
+        } else if (input_path.empty()) {
+            input_path = arg;
+        } else if (output_path.empty()) {
+            output_path = arg;
+        } else {
+            std::cerr << "Error: Too many arguments\n";
+            print_usage();
+            return 1;
+        }
+    }
+    if (input_path.empty()) {
+        std::cerr << "Error: Input path is required\n";
+        print_usage();
+        return 1;
+    }
+    if (overwrite_input && !output_path.empty()) {
+        std::cerr << "Error: Cannot specify output path with -i option\n";
+        return 1;
+    }
+    std::unique_ptr<ConversionCache> cache;
+    try {
+        if (!cache_dir.empty())
+            cache.reset(new ConversionCache(cache_dir, cache_max, cache_hardlink));
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    auto report_cache = [&] {
+        if (cache && cache_stats)
+            cache->print_stats(std::cerr);
+    };
+    if (!is_directory(input_path)) {
+        try {
+            std::string input = read_input_file(input_path);
+            InputFormat format = sniff_format(input);
+            if (format == InputFormat::UNKNOWN)
+                throw std::runtime_error("Input is neither ABX nor XML");
+            bool is_abx2xml = format == InputFormat::ABX;
+            std::string target = output_path.empty() ? (is_abx2xml ? "-" : input_path + ".abx") : output_path;
+            bool compress = compress_output || (overwrite_input ? has_gzip_magic(input) : has_gz_suffix(target));
+            std::string cache_key;
+            if (cache) {
+                cache_key = ConversionCache::key_for(input, ConversionCache::options_for(is_abx2xml, multi_root, compress));
+                if (!overwrite_input && cache->fetch(cache_key, target)) {
+                    report_cache();
+                    return 0;
+                }
+            }
+            std::unique_ptr<AtomicFile> file;
+            if (overwrite_input)
+                file.reset(new AtomicFile(input_path));
+            if (!file || !cache || !cache->fetch_to_fd(cache_key, file->descriptor())) {
+                std::string output = convert_buffer(is_abx2xml, input, multi_root, compress);
+                if (file)
+                    file->write(output);
+                else
+                    write_output_file(target, output);
+                if (cache)
+                    cache->store(cache_key, output);
+            }
+            if (file)
+                file->commit(sync_output);
+            report_cache();
+            return 0;
+        }
+        catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+    if (!overwrite_input && output_path.empty()) {
+        std::cerr << "Error: Output directory is required for directory input\n";
+        return 1;
+    }
+    std::atomic<size_t> converted(0);
+    std::atomic<size_t> skipped(0);
+    std::atomic<size_t> failed(0);
+    FsyncBatch batch;
+    BatchLatencyStats latency(slowest_count);
+    {
+        WorkerPool pool(jobs);
+        walk_files(input_path, "", [&](const std::string& rel) {
+            pool.submit([&, rel] {
+                std::string source = input_path + "/" + rel;
+                std::string target = overwrite_input ? source : output_path + "/" + rel;
+                TraceSpan file_span("file", rel);
+                ABX_PROBE1(batch_file_start, rel.c_str());
+                auto started = std::chrono::steady_clock::now();
+                try {
+                    TraceSpan read_span("phase", "read");
+                    std::string input = read_input_file(source);
+                    read_span.end();
+                    InputFormat format = sniff_format(input);
+                    if (format == InputFormat::UNKNOWN) {
+                        skipped++;
+                        ABX_PROBE2(batch_file_end, rel.c_str(), 2);
+                        if (verbose)
+                            std::cerr << "skipped " << rel << std::endl;
+                        return;
+                    }
+                    bool is_abx2xml = format == InputFormat::ABX;
+                    bool compress = compress_output || has_gzip_magic(input);
+                    make_dirs(parent_directory(target));
+                    // Cache hits are served by link or clone where possible;
+                    // with --fsync they go through the batch like conversions.
+                    std::string cache_key;
+                    bool served = false;
+                    std::unique_ptr<AtomicFile> file;
+                    if (cache) {
+                        TraceSpan cache_span("phase", "cache");
+                        cache_key = ConversionCache::key_for(input, ConversionCache::options_for(is_abx2xml, multi_root, compress));
+                        if (sync_output) {
+                            file.reset(new AtomicFile(target));
+                            served = cache->fetch_to_fd(cache_key, file->descriptor());
+                        } else {
+                            served = cache->fetch(cache_key, target);
+                        }
+                    }
+                    if (!served) {
+                        TraceSpan convert_span("phase", is_abx2xml ? "abx2xml" : "xml2abx");
+                        std::string output = convert_buffer(is_abx2xml, input, multi_root, compress);
+                        convert_span.end();
+                        TraceSpan write_span("phase", "write");
+                        if (!file)
+                            file.reset(new AtomicFile(target));
+                        file->write(output);
+                        if (cache)
+                            cache->store(cache_key, output);
+                    }
+                    if (file && sync_output)
+                        batch.add(std::move(file));
+                    else if (file)
+                        file->commit(false);
+                    converted++;
+                    ABX_PROBE2(batch_file_end, rel.c_str(), 0);
+                    if (latency_report)
+                        latency.record(rel, input.size(), std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
+                    if (verbose)
+                        std::cerr << (is_abx2xml ? "abx2xml " : "xml2abx ") << rel << (served ? " (cached)" : "") << std::endl;
+                } catch (const std::exception& e) {
+                    failed++;
+                    ABX_PROBE2(batch_file_end, rel.c_str(), 1);
+                    std::cerr << "Error: " << rel << ": " << e.what() << std::endl;
+                }
+            });
+        });
+        pool.wait_idle();
+    }
+    try {
+        batch.flush();
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    if (verbose)
+        std::cerr << converted << " converted, " << skipped << " skipped, " << failed << " failed" << std::endl;
+    if (latency_report)
+        latency.print(std::cerr);
+    report_cache();
+    return failed == 0 ? 0 : 1;
+}
+#ifndef ABXTOOL_NO_MAIN
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        print_usage();
+        return 1;
+    }
+    std::string command = argv[1];
+    if (command == "convert") {
+        return run_convert(argc, argv);
+    }
+    if (command == "cache-stats") {
+        return run_cache_stats(argc, argv);
+    }
+    if (command == "watch") {
+        return run_watch(argc, argv);
+    }
+    if (command == "tar") {
+        return run_tar(argc, argv);
+    }
+    if (command == "carve") {
+        return run_carve(argc, argv);
+    }
+    if (command == "bench") {
+        return run_bench(argc, argv);
+    }
+    if (command == "roundtrip") {
+        return run_roundtrip(argc, argv);
+    }
+    if (command == "generate") {
+        return run_generate(argc, argv);
+    }
+    if (command == "serve") {
+        return run_serve(argc, argv);
+    }
+    if (command == "client") {
+        return run_client(argc, argv);
+    }
+    if (command != "abx2xml" && command != "xml2abx") {
+        std::cerr << "Error: Invalid command. Use 'abx2xml' or 'xml2abx'\n";
+        print_usage();
+        return 1;
+    }
+    bool is_abx2xml = (command == "abx2xml");
+    std::string input_path;
+    std::string output_path;
+    bool overwrite_input = false;
+    bool multi_root = false;
+    std::string cache_dir;
+    uint64_t cache_max = 0;
+    bool cache_hardlink = false;
+    bool cache_stats = false;
+    bool sync_output = false;
+    bool compress_output = false;
+    bool pipeline = false;
+    std::unique_ptr<PhaseProfile> profile;
+    bool profile_json = false;
+    bool report_profile = false;
+    bool alloc_stats = false;
+    bool alloc_json = false;
+    double alloc_limit = -1;
+    std::string stats_path;
+    bool token_stats = false;
+    uint64_t input_size = 0;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-i") {
+            overwrite_input = true;
+        } 
+        else if (arg == "-mr" && is_abx2xml) {
+            multi_root = true;
+        }
+        else if (arg == "--cache" && i + 1 < argc) {
+            cache_dir = argv[++i];
+        }
+        else if (arg == "--cache-max" && i + 1 < argc) {
+            try {
+                cache_max = parse_size(argv[++i]);
+            } catch (const std::exception&) {
+                std::cerr << "Error: Invalid cache size '" << argv[i] << "'\n";
+                return 1;
+            }
+        }
+        else if (arg == "--cache-hardlink") {
+            cache_hardlink = true;
+        }
+        else if (arg == "--cache-stats") {
+            cache_stats = true;
+        }
+        else if (arg == "--fsync") {
+            sync_output = true;
+        }
+        else if (arg == "-z") {
+            compress_output = true;
+        }
+        else if (arg == "--pipeline" && is_abx2xml) {
+            pipeline = true;
+        }
+        else if (arg == "--profile" || arg == "--profile=json") {
+            report_profile = true;
+            profile_json = (arg == "--profile=json");
+        }
+        else if (arg == "--alloc-stats" || arg == "--alloc-stats=json") {
+            alloc_stats = true;
+            alloc_json = (arg == "--alloc-stats=json");
+        }
+        else if (arg == "--alloc-limit" && i + 1 < argc) {
+            alloc_stats = true;
+            alloc_limit = std::atof(argv[++i]);
+        }
+        else if (arg == "--token-stats") {
+            token_stats = true;
+        }
+        else if (arg == "--stats-json" && i + 1 < argc) {
+            stats_path = argv[++i];
+        }
+        else if (arg == "--trace" && i + 1 < argc) {
+            Trace::enable(argv[++i]);
+            Trace::name_thread("main");
+        }
+        else if (input_path.empty()) {
+            input_path = arg;
+        } 
+        else if (output_path.empty()) {
+            output_path = arg;
+        } 
+        else {
+            std::cerr << "Error: Too many arguments\n";
+            print_usage();
+            return 1;
+        }
+    }
+    if (input_path.empty()) {
+        std::cerr << "Error: Input path is required\n";
+        print_usage();
+        return 1;
+    }
+#ifndef ABX_ALLOC_STATS
+    if (alloc_stats) {
+        std::cerr << "Error: --alloc-stats and --alloc-limit require a build with ABX_ALLOC_STATS\n";
+        return 1;
+    }
+    (void)alloc_json;
+    (void)alloc_limit;
+    (void)input_size;
+#endif
+    if (token_stats && !TOKEN_STATS) {
+        std::cerr << "Error: --token-stats requires a build with ABX_TOKEN_STATS\n";
+        return 1;
+    }
+    if (report_profile || alloc_stats || Trace::enabled() || !stats_path.empty())
+        profile.reset(new PhaseProfile());
+    std::unique_ptr<AbxDocumentStats> stats;
+    uint64_t output_size = 0;
+    auto finish_reports = [&]() {
+        if (stats) {
+            if (stats_path == "-") {
+                stats->write_json(std::cerr, command, input_size, output_size, profile->totals());
+            } else {
+                std::ofstream stats_out(stats_path);
+                stats->write_json(stats_out, command, input_size, output_size, profile->totals());
+                if (!stats_out) {
+                    std::cerr << "Error: Could not write " << stats_path << std::endl;
+                    return 1;
+                }
+            }
+        }
+        if (token_stats)
+            TokenStats::report(std::cerr);
+        if (report_profile)
+            profile->report(std::cerr, profile_json);
+        else if (profile)
+            profile->end();
+#ifdef ABX_ALLOC_STATS
+        if (alloc_stats) {
+            AllocationStats::report(std::cerr, input_size, alloc_json);
+            double per_byte = input_size ? static_cast<double>(AllocationStats::total_allocations()) / input_size : 0;
+            if (alloc_limit >= 0 && per_byte > alloc_limit) {
+                std::cerr << "Error: " << per_byte << " allocations per input byte exceeds the limit of "
+                          << alloc_limit << std::endl;
+                return 1;
+            }
+        }
+#endif
+        return 0;
+    };
+    if (input_path == "-" && !is_abx2xml) {
+        if (output_path.empty()) {
+            std::cerr << "Error: Output path is required when reading from stdin\n";
+            return 1;
+        }
+    } else if (overwrite_input) {
+        if (!output_path.empty()) {
+            std::cerr << "Error: Cannot specify output path with -i option\n";
+            return 1;
+        }
+        output_path = input_path;
+    } else if (output_path.empty()) {
+        output_path = is_abx2xml ? "-" : input_path + ".abx";
+    }
+    std::unique_ptr<ConversionCache> cache;
+    auto phase = [&profile](const char* name) {
+        if (profile)
+            profile->begin(name);
+    };
+    // Walks the ABX side of the conversion, timed as its own "stats" phase.
+    auto collect_stats = [&](const std::string& abx) {
+        if (stats_path.empty())
+            return;
+        phase("stats");
+        stats.reset(new AbxDocumentStats());
+        stats->scan(inflate_if_gzip(abx));
+    };
+    try {
+        if (!cache_dir.empty()) {
+            cache.reset(new ConversionCache(cache_dir, cache_max, cache_hardlink));
+        }
+        // Only the cache, --pipeline and the reports need the whole input and
+        // output in memory; otherwise the conversion streams.
+        if (!cache && !profile && !pipeline) {
+            convert_file_streaming(is_abx2xml, input_path, output_path, multi_root, compress_output,
+                                   overwrite_input, sync_output);
+            return finish_reports();
+        }
+        phase("read");
+        std::string input = read_input_file(input_path);
+        input_size = input.size();
+        std::unique_ptr<AtomicFile> in_place;
+        if (overwrite_input) {
+            in_place.reset(new AtomicFile(input_path));
+            compress_output = compress_output || has_gzip_magic(input);
+        }
+        compress_output = compress_output || has_gz_suffix(output_path);
+        if (is_abx2xml)
+            collect_stats(input);
+        if (pipeline && !cache && !compress_output && !has_gzip_magic(input)) {
+            phase("pipeline");
+            if (output_path == "-") {
+                std::cout.flush();
+                pipelined_abx_to_xml(input, STDOUT_FILENO, multi_root);
+            } else if (is_special_file(output_path)) {
+                ScopedFd output(open(output_path.c_str(), O_WRONLY | O_CLOEXEC));
+                if (output.get() < 0)
+                    throw std::runtime_error("Could not open output file");
+                pipelined_abx_to_xml(input, output.get(), multi_root);
+            } else {
+                AtomicFile output(output_path);
+                pipelined_abx_to_xml(input, output.descriptor(), multi_root);
+                output.commit(sync_output);
+                struct stat st;
+                if (stat(output_path.c_str(), &st) == 0)
+                    output_size = st.st_size;
+            }
+            return finish_reports();
+        }
+        std::string cache_key;
+        bool served = false;
+        if (cache) {
+            phase("cache");
+            cache_key = ConversionCache::key_for(input, ConversionCache::options_for(is_abx2xml, multi_root, compress_output));
+            served = in_place ? cache->fetch_to_fd(cache_key, in_place->descriptor())
+                              : cache->fetch(cache_key, output_path);
+        }
+        if (!served) {
+            std::string output = profile ? convert_buffer_profiled(is_abx2xml, input, multi_root, compress_output, *profile)
+                                         : convert_buffer(is_abx2xml, input, multi_root, compress_output);
+            output_size = output.size();
+            if (!is_abx2xml)
+                collect_stats(output);
+            phase("write");
+            if (in_place) {
+                in_place->write(output);
+            } else {
+                write_output_file(output_path, output);
+            }
+            if (cache) {
+                phase("cache");
+                cache->store(cache_key, output);
+            }
+            phase("teardown");
+            std::string().swap(output);
+        }
+        if (in_place) {
+            phase("write");
+            in_place->commit(sync_output);
+        }
+        // A hit is reported on from the cached entry, since stdout or a device
+        // cannot be read back; an entry evicted since the hit is converted again.
+        if (served && !stats_path.empty()) {
+            std::string output;
+            if (!cache->peek(cache_key, output))
+                output = convert_buffer(is_abx2xml, input, multi_root, compress_output);
+            output_size = output.size();
+            if (!is_abx2xml)
+                collect_stats(output);
+        }
+        phase("teardown");
+        std::string().swap(input);
+        if (cache && cache_stats) {
+            cache->print_stats(std::cerr);
+        }
+        return finish_reports();
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+}
+#endif
@@ -3,6 +3,7 @@
 NDK_PATH="" # Your Android NDK PATH
 DIR="$(pwd)" #Directory where abx2xml.xpp and xml2abx.cpp are located
 OUTPUT_DIR="$DIR/build"
+CLI_FLAGS="" # "-DABX_MINIMAL_STARTUP" drops iostreams and --profile from abx2xml and xml2abx
 
 # Create output directory
 mkdir -p "$OUTPUT_DIR"
@@ -22,13 +23,20 @@ for ARCH in "${ARCHS[@]}"; do
 
     # Compile abx2xml
     $COMPILER -Os -static -ffunction-sections -fdata-sections -fvisibility=hidden \
-        -flto -Wl,--gc-sections -o "$OUTPUT_DIR/abx2xml-$ARCH" "$DIR/abx2xml.cpp"
+        -flto -Wl,--gc-sections $CLI_FLAGS -o "$OUTPUT_DIR/abx2xml-$ARCH" "$DIR/abx2xml.cpp"
 
     # Compile xml2abx
     $COMPILER -Os -static -ffunction-sections -fdata-sections -fvisibility=hidden \
-        -flto -Wl,--gc-sections -o "$OUTPUT_DIR/xml2abx-$ARCH" "$DIR/xml2abx.cpp"
+        -flto -Wl,--gc-sections $CLI_FLAGS -o "$OUTPUT_DIR/xml2abx-$ARCH" "$DIR/xml2abx.cpp"
+
+    # Compile abxtool (zlib enables gzip input/output)
+    $COMPILER -Os -static -ffunction-sections -fdata-sections -fvisibility=hidden \
+        -flto -Wl,--gc-sections -DABX_WITH_ZLIB -o "$OUTPUT_DIR/abxtool-$ARCH" "$DIR/abxtool.cpp" -lz
+    # Compile abxbench (microbenchmarks, not stripped so profiles keep symbols)
+    $COMPILER -O2 -static -DABX_WITH_ZLIB -o "$OUTPUT_DIR/abxbench-$ARCH" "$DIR/abxbench.cpp" -lz
     "$NDK_PATH/llvm-strip" --strip-all "$OUTPUT_DIR/abx2xml-$ARCH"
     "$NDK_PATH/llvm-strip" --strip-all "$OUTPUT_DIR/xml2abx-$ARCH"
+    "$NDK_PATH/llvm-strip" --strip-all "$OUTPUT_DIR/abxtool-$ARCH"
 
     echo "Finished compiling for $ARCH"
 done
@@ -19,11 +19,18 @@ This C++ implementation originates from:
 https://github.com/rhythmcache/android-xml-converter/
 */
 
+// Building with -DABX_MINIMAL_STARTUP leaves out iostreams and --profile, so
+// the binary has no iostream or locale initialization and a conversion is
+// only read(2), parse, encode and write(2).
+#ifndef ABX_MINIMAL_STARTUP
 #include <iostream>
-#include <fstream>
 #include <sstream>
+#include <chrono>
+#include <iomanip>
+#endif
 #include <vector>
 #include <string>
+#include <memory>
 #include <stack>
 #include <stdexcept>
 #include <algorithm>
@@ -31,6 +38,11 @@ https://github.com/rhythmcache/android-xml-converter/
 #include <cstdint>
 #include <cstring>
 #include <map>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 
 class XmlNode {
@@ -218,6 +230,50 @@ public:
 };
 
 
+bool write_all_fd(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Encoded output waiting to be written: spill() hands it to write(2) once
+// FLUSH_SIZE bytes are pending. Without a descriptor the whole output is
+// collected instead, for -i and --profile.
+class OutputBuffer {
+public:
+    std::string data;
+
+    OutputBuffer() = default;
+    explicit OutputBuffer(int fd) : fd(fd) {
+        data.reserve(FLUSH_SIZE + 4096);
+    }
+
+    void spill() {
+        if (data.size() >= FLUSH_SIZE)
+            flush();
+    }
+
+    void flush() {
+        if (fd < 0)
+            return;
+        if (!write_all_fd(fd, data.data(), data.size()))
+            throw std::runtime_error("Could not write output file");
+        data.clear();
+    }
+
+private:
+    static constexpr size_t FLUSH_SIZE = 65536;
+    int fd = -1;
+};
+
 class AbxWriter {
 public:
     enum class XmlType : uint8_t {
@@ -239,14 +295,11 @@ public:
         TYPE_BOOLEAN_FALSE = 13 << 4
     };
 
-    AbxWriter(const std::string& output_path) : output_stream(output_path, std::ios::binary) {
-        if (!output_stream) {
-            throw std::runtime_error("Could not open output file");
-        }
-
+    // Encodes into out; the caller flushes it once the document is complete.
+    explicit AbxWriter(OutputBuffer& out) : buffer(out), output(out.data) {
         // Write magic number
         const char magic[] = "ABX\0";
-        output_stream.write(magic, 4);
+        output.append(magic, 4);
     }
 
     void write_start_document() {
@@ -265,6 +318,7 @@ public:
     void write_end_tag(const std::string& tag_name) {
         write_token(XmlType::END_TAG, DataType::TYPE_STRING_INTERNED);
         write_string_interned(tag_name);
+        buffer.spill();
     }
 
     void write_attribute(const std::string& name, const std::string& value) {
@@ -279,19 +333,20 @@ public:
     }
 
 private:
-    std::ofstream output_stream;
+    OutputBuffer& buffer;
+    std::string& output;
     std::vector<std::string> interned_strings;
 
     void write_token(XmlType xml_type, DataType data_type) {
         uint8_t token = static_cast<uint8_t>(xml_type) | static_cast<uint8_t>(data_type);
-        output_stream.write(reinterpret_cast<char*>(&token), 1);
+        output.append(reinterpret_cast<char*>(&token), 1);
     }
 
     void write_string(const std::string& str) {
         uint16_t length = str.length();
         uint16_t be_length = __builtin_bswap16(length);
-        output_stream.write(reinterpret_cast<char*>(&be_length), 2);
-        output_stream.write(str.data(), length);
+        output.append(reinterpret_cast<char*>(&be_length), 2);
+        output.append(str.data(), length);
     }
 
     void write_string_interned(const std::string& str) {
@@ -299,11 +354,11 @@ private:
         if (it != interned_strings.end()) {
             int16_t index = std::distance(interned_strings.begin(), it);
             int16_t be_index = __builtin_bswap16(index);
-            output_stream.write(reinterpret_cast<char*>(&be_index), 2);
+            output.append(reinterpret_cast<char*>(&be_index), 2);
         } else {
             int16_t index = -1;
             int16_t be_index = __builtin_bswap16(index);
-            output_stream.write(reinterpret_cast<char*>(&be_index), 2);
+            output.append(reinterpret_cast<char*>(&be_index), 2);
             write_string(str);
             interned_strings.push_back(str);
         }
@@ -311,39 +366,239 @@ private:
 };
 
 
-class XmlToAbxConverter {
-public:
-    static void convert(const std::string& input_path, const std::string& output_path) {
-        std::string xml_content;
-        
-        if (input_path == "-") {
-            // Read from stdin
-            xml_content = read_from_stdin();
+// Replaces path with data without ever truncating it in place: the data goes
+// to an unnamed O_TMPFILE in the same directory that is linked in with linkat()
+// and renamed over path once complete, or to a mkstemp() sibling where
+// O_TMPFILE or /proc is unavailable.
+void replace_file_atomically(const std::string& path, const std::string& data) {
+    size_t slash = path.find_last_of('/');
+    std::string dir = slash == std::string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+    std::string temp_path = path + ".tmp" + std::to_string(getpid());
+    int fd = -1;
+    bool linked = false;
+#ifdef O_TMPFILE
+    fd = open(dir.c_str(), O_TMPFILE | O_WRONLY | O_CLOEXEC, 0666);
+    if (fd >= 0) {
+        char proc_path[64];
+        snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0) {
+            fchmod(fd, st.st_mode & 07777);
+            if (fchown(fd, st.st_uid, st.st_gid) != 0) {
+                // Unprivileged runs keep their own ownership.
+            }
+        }
+        linked = write_all_fd(fd, data.data(), data.size()) &&
+                 linkat(AT_FDCWD, proc_path, AT_FDCWD, temp_path.c_str(), AT_SYMLINK_FOLLOW) == 0;
+        close(fd);
+    }
+#endif
+    if (!linked) {
+        temp_path = path + ".tmpXXXXXX";
+        fd = mkstemp(&temp_path[0]);
+        if (fd < 0)
+            throw std::runtime_error("Could not create temporary output file");
+        // mkstemp() creates files 0600; a new file gets the umask applied to
+        // 0666 as open() would.
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0) {
+            fchmod(fd, st.st_mode & 07777);
         } else {
-            // Read from file
-            std::ifstream input_file(input_path);
-            if (!input_file) {
-                throw std::runtime_error("Could not open input file");
+            mode_t mask = umask(0);
+            umask(mask);
+            fchmod(fd, 0666 & ~mask);
+        }
+        bool ok = write_all_fd(fd, data.data(), data.size());
+        close(fd);
+        if (!ok) {
+            unlink(temp_path.c_str());
+            throw std::runtime_error("Could not write output file");
+        }
+    }
+    if (rename(temp_path.c_str(), path.c_str()) != 0) {
+        unlink(temp_path.c_str());
+        throw std::runtime_error("Could not replace output file");
+    }
+}
+
+
+#ifndef ABX_MINIMAL_STARTUP
+// Wall-clock time spent in each phase of a conversion, for --profile.
+// begin() closes the running phase; a phase entered again accumulates.
+class PhaseProfile {
+public:
+    void begin(const std::string& phase) {
+        end();
+        current = phase;
+        started = std::chrono::steady_clock::now();
+    }
+
+    void end() {
+        if (current.empty())
+            return;
+        add(current, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count());
+        current.clear();
+    }
+
+    void add(const std::string& phase, double ms) {
+        for (auto& entry : phases) {
+            if (entry.first == phase) {
+                entry.second += ms;
+                return;
             }
-            xml_content = std::string((std::istreambuf_iterator<char>(input_file)),
-                                     std::istreambuf_iterator<char>());
         }
+        phases.emplace_back(phase, ms);
+    }
 
+    void report(std::ostream& out, bool json) {
+        end();
+        double total = 0;
+        for (const auto& entry : phases)
+            total += entry.second;
+        std::ostringstream text;
+        text << std::fixed << std::setprecision(3);
+        if (json) {
+            text << "{\"unit\":\"ms\",\"phases\":[";
+            for (size_t i = 0; i < phases.size(); ++i)
+                text << (i ? "," : "") << "{\"name\":\"" << phases[i].first << "\",\"ms\":" << phases[i].second << "}";
+            text << "],\"total_ms\":" << total << "}\n";
+        } else {
+            for (const auto& entry : phases)
+                text << std::left << std::setw(10) << entry.first << std::right << std::setw(12) << entry.second
+                     << " ms " << std::setw(6) << std::setprecision(1)
+                     << (total > 0 ? entry.second * 100 / total : 0) << "%\n" << std::setprecision(3);
+            text << std::left << std::setw(10) << "total" << std::right << std::setw(12) << total << " ms\n";
+        }
+        out << text.str() << std::flush;
+    }
+
+private:
+    std::vector<std::pair<std::string, double>> phases;
+    std::string current;
+    std::chrono::steady_clock::time_point started;
+};
+#else
+class PhaseProfile;
+#endif
+
+// Reads a whole file, or stdin for "-", with plain read(2) calls.
+std::string read_file(const std::string& path) {
+    int fd = path == "-" ? STDIN_FILENO : open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error("Could not open input file");
+    std::string data;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        data.reserve(st.st_size);
+    char chunk[65536];
+    while (true) {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            if (fd != STDIN_FILENO)
+                close(fd);
+            throw std::runtime_error("Could not read input file");
+        }
+        if (n == 0)
+            break;
+        data.append(chunk, n);
+    }
+    if (fd != STDIN_FILENO)
+        close(fd);
+    return data;
+}
+
+int open_output_file(const std::string& path) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0)
+        throw std::runtime_error("Could not open output file");
+    return fd;
+}
+
+void close_output_file(int fd) {
+    if (close(fd) != 0)
+        throw std::runtime_error("Could not write output file");
+}
+
+void write_output_file(const std::string& path, const std::string& data) {
+    int fd = open_output_file(path);
+    if (!write_all_fd(fd, data.data(), data.size())) {
+        close(fd);
+        throw std::runtime_error("Could not write output file");
+    }
+    close_output_file(fd);
+}
+
+// Messages are written straight to the descriptor, without iostreams.
+void print_to(int fd, const std::string& text) {
+    write_all_fd(fd, text.data(), text.size());
+}
+
+class XmlToAbxConverter {
+public:
+    // The ABX is written out as it is encoded. In-place conversions and
+    // profiled runs (not in minimal-startup builds) encode it in memory
+    // first, the latter so each phase can be timed.
+    static void convert(const std::string& input_path, const std::string& output_path, PhaseProfile* profile = nullptr) {
+        auto phase = [profile](const char* name) {
+#ifndef ABX_MINIMAL_STARTUP
+            if (profile)
+                profile->begin(name);
+#else
+            (void)profile;
+            (void)name;
+#endif
+        };
+        phase("read");
+        std::string xml_content = read_file(input_path);
+
+        phase("parse");
         XmlParser parser;
         XmlNode root = parser.parse(xml_content);
-        AbxWriter writer(output_path);
+
+        phase("encode");
+        if (!profile && output_path != input_path) {
+            int fd = open_output_file(output_path);
+            try {
+                OutputBuffer output(fd);
+                encode(output, root);
+                output.flush();
+            } catch (...) {
+                close(fd);
+                throw;
+            }
+            close_output_file(fd);
+            return;
+        }
+        OutputBuffer output;
+        encode(output, root);
+
+        phase("write");
+        if (output_path == input_path) {
+            replace_file_atomically(output_path, output.data);
+        } else {
+            write_output_file(output_path, output.data);
+        }
+#ifndef ABX_MINIMAL_STARTUP
+        if (profile) {
+            profile->begin("teardown");
+            root = XmlNode(XmlNode::Type::ELEMENT);
+            std::string().swap(xml_content);
+            std::string().swap(output.data);
+            profile->end();
+        }
+#endif
+    }
+
+private:
+    static void encode(OutputBuffer& output, const XmlNode& root) {
+        AbxWriter writer(output);
         writer.write_start_document();
         process_node(writer, root);
         writer.write_end_document();
     }
 
-private:
-    static std::string read_from_stdin() {
-        std::stringstream buffer;
-        buffer << std::cin.rdbuf();
-        return buffer.str();
-        }
-        
     static void process_node(AbxWriter& writer, const XmlNode& node) {
         if (node.type == XmlNode::Type::ELEMENT) {
             writer.write_start_tag(node.name);
@@ -364,14 +619,17 @@ private:
 };
 
 void print_usage() {
-    std::cerr << "usage: xml2abx [-i] input [output]\n"
-              << "\n"
-              << "Converts between human-readable XML and Android Binary XML.\n\n"
-              << "When invoked with the '-i' argument, the output of a successful conversion\n"
-              << "will overwrite the original input file\n"
-              << "\n"
-              << "Use '-' as input to read from stdin. When reading from stdin,\n"
-              << "output path must be specified.\n";
+    print_to(STDERR_FILENO,
+             "usage: xml2abx [-i] [--profile[=json]] input [output]\n"
+             "\n"
+             "Converts between human-readable XML and Android Binary XML.\n\n"
+             "--profile reports time per phase (read, parse, encode, write, teardown)\n"
+             "on stderr, as JSON with --profile=json\n\n"
+             "When invoked with the '-i' argument, the output of a successful conversion\n"
+             "will overwrite the original input file\n"
+             "\n"
+             "Use '-' as input to read from stdin. When reading from stdin,\n"
+             "output path must be specified.\n");
 }
 
 int main(int argc, char* argv[]) {
@@ -383,18 +641,30 @@ int main(int argc, char* argv[]) {
     std::string input_path;
     std::string output_path;
     bool overwrite_input = false;
+#ifndef ABX_MINIMAL_STARTUP
+    std::unique_ptr<PhaseProfile> profile;
+    bool profile_json = false;
+#endif
     
     // Parse arguments
     for (int i = 1; i < argc; ++i) {
         std::string arg = argv[i];
         if (arg == "-i") {
             overwrite_input = true;
+        } else if (arg == "--profile" || arg == "--profile=json") {
+#ifdef ABX_MINIMAL_STARTUP
+            print_to(STDERR_FILENO, "Error: --profile is not available in minimal-startup builds\n");
+            return 1;
+#else
+            profile.reset(new PhaseProfile());
+            profile_json = (arg == "--profile=json");
+#endif
         } else if (input_path.empty()) {
             input_path = arg;
         } else if (output_path.empty()) {
             output_path = arg;
         } else {
-            std::cerr << "Error: Too many arguments\n";
+            print_to(STDERR_FILENO, "Error: Too many arguments\n");
             print_usage();
             return 1;
         }
@@ -402,7 +672,7 @@ int main(int argc, char* argv[]) {
 
     // Validate input path
     if (input_path.empty()) {
-        std::cerr << "Error: Input path is required\n";
+        print_to(STDERR_FILENO, "Error: Input path is required\n");
         print_usage();
         return 1;
     }
@@ -411,24 +681,32 @@ int main(int argc, char* argv[]) {
     if (output_path.empty()) {
         if (overwrite_input) {
             if (input_path == "-") {
-                std::cerr << "Error: Cannot overwrite stdin, output path is required\n";
+                print_to(STDERR_FILENO, "Error: Cannot overwrite stdin, output path is required\n");
                 print_usage();
                 return 1;
             }
             output_path = input_path;
         } else {
-            std::cerr << "Error: Output path is required\n";
+            print_to(STDERR_FILENO, "Error: Output path is required\n");
             print_usage();
             return 1;
         }
     }
 
     try {
+#ifdef ABX_MINIMAL_STARTUP
         XmlToAbxConverter::convert(input_path, output_path);
-        std::cout << "Successfully converted " << (input_path == "-" ? "stdin" : input_path) 
-                  << " to " << output_path << std::endl;
+#else
+        XmlToAbxConverter::convert(input_path, output_path, profile.get());
+#endif
+        print_to(STDOUT_FILENO, "Successfully converted " + (input_path == "-" ? std::string("stdin") : input_path) +
+                                " to " + output_path + "\n");
+#ifndef ABX_MINIMAL_STARTUP
+        if (profile)
+            profile->report(std::cerr, profile_json);
+#endif
     } catch (const std::exception& e) {
-        std::cerr << "Error: " << e.what() << std::endl;
+        print_to(STDERR_FILENO, std::string("Error: ") + e.what() + "\n");
         return 1;
     }
 